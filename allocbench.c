@@ -0,0 +1,175 @@
+/* Allocator benchmark: replays bursts of messages through the same kind of
+ * allocation pattern of the bot request threads (JSON parsing, argument
+ * splitting, transcript strings growing while streamed), one short lived
+ * thread per message, and reports throughput and RSS.
+ *
+ * Compare backends rebuilding with different MALLOC values:
+ *
+ *  make clean; make allocbench && ./allocbench
+ *  make clean; make MALLOC=jemalloc allocbench && ./allocbench
+ *
+ * Output is a single line of key=value pairs. */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "sds.h"
+#include "cJSON.h"
+#include "xmalloc.h"
+
+cJSON *cJSON_Select(cJSON *o, const char *fmt, ...);
+
+#define RETAIN_SLOTS 1024   /* Long lived allocations kept across bursts. */
+
+static sds Payload;         /* getUpdates reply every thread parses. */
+static sds Retained[RETAIN_SLOTS];
+static pthread_mutex_t RetainLock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long ustime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Build a getUpdates reply with 'count' messages, similar to what
+ * Telegram sends us. */
+static sds syntheticPayload(int count) {
+    sds s = sdsnew("{\"ok\":true,\"result\":[");
+    for (int j = 0; j < count; j++) {
+        if (j) s = sdscatlen(s,",",1);
+        s = sdscatprintf(s,
+            "{\"update_id\":%d,\"message\":{\"message_id\":%d,"
+            "\"from\":{\"id\":%d,\"is_bot\":false,\"first_name\":\"User\","
+            "\"username\":\"user%d\",\"language_code\":\"it\"},"
+            "\"chat\":{\"id\":-100%d,\"title\":\"Some group\","
+            "\"type\":\"supergroup\"},\"date\":1700000000,"
+            "\"text\":\"please transcribe this message number %d\","
+            "\"voice\":{\"duration\":%d,\"mime_type\":\"audio/ogg\","
+            "\"file_id\":\"AwACAgQAAxkBAAIBQ2V%dAAGq3gABHsF8\","
+            "\"file_unique_id\":\"AgAD%d\",\"file_size\":%d}}}",
+            100000+j, 500+j, 1000+j, j, 7000+j, j, 2+j%60, j, j,
+            4000+j*731);
+    }
+    return sdscat(s,"]}");
+}
+
+/* What a request thread does, allocation wise. */
+static void *serveMessage(void *arg) {
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    cJSON *json = cJSON_Parse(Payload);
+    cJSON *update;
+    cJSON_ArrayForEach(update,cJSON_Select(json,".result:a")) {
+        cJSON *text = cJSON_Select(update,".message.text:s");
+        if (!text) continue;
+        int argc;
+        sds request = sdsnew(text->valuestring);
+        sds *argv = sdssplitargs(request,&argc);
+
+        /* Transcript streamed back with periodic edits. */
+        sds transcript = sdsempty();
+        int segments = 5 + rand_r(&seed) % 60;
+        for (int j = 0; j < segments; j++) {
+            transcript = sdscatprintf(transcript,
+                " segment %d of the transcription of message %d.",
+                j, (int)cJSON_Select(update,".update_id:n")->valuedouble);
+            sds edit = sdscatprintf(sdsempty(),"chat_id=%d&text=%s",
+                                    j,transcript);
+            sdsfree(edit);
+        }
+
+        /* A small fraction of allocations outlive the request. */
+        if (rand_r(&seed) % 50 == 0) {
+            int slot = rand_r(&seed) % RETAIN_SLOTS;
+            sds keep = sdsnewlen(transcript,rand_r(&seed)%256);
+            pthread_mutex_lock(&RetainLock);
+            sdsfree(Retained[slot]);
+            Retained[slot] = keep;
+            pthread_mutex_unlock(&RetainLock);
+        }
+        sdsfree(transcript);
+        sdsfreesplitres(argv,argc);
+        sdsfree(request);
+    }
+    cJSON_Delete(json);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int bursts = 50, burst_size = 64, idle_ms = 200, arenas = XMALLOC_DEFAULT_ARENAS;
+    const char *payload_file = NULL;
+
+    for (int j = 1; j < argc; j++) {
+        int morearg = argc-j-1;
+        if (!strcmp(argv[j],"--bursts") && morearg) {
+            bursts = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--burst-size") && morearg) {
+            burst_size = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--idle") && morearg) {
+            idle_ms = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--malloc-arenas") && morearg) {
+            arenas = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--payload") && morearg) {
+            payload_file = argv[++j];
+        } else {
+            printf("Usage: %s [--bursts <count>] [--burst-size <threads>] "
+                   "[--idle <ms>] [--malloc-arenas <count>] "
+                   "[--payload <getUpdates reply file>]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    xmallocInit(arenas);
+    cJSON_Hooks jh = {.malloc_fn = xmalloc, .free_fn = xfree};
+    cJSON_InitHooks(&jh);
+
+    if (payload_file) {
+        FILE *fp = fopen(payload_file,"r");
+        if (fp == NULL) {
+            perror("Opening payload");
+            exit(1);
+        }
+        Payload = sdsempty();
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf,1,sizeof(buf),fp)) > 0)
+            Payload = sdscatlen(Payload,buf,n);
+        fclose(fp);
+    } else {
+        Payload = syntheticPayload(20);
+    }
+
+    pthread_t *tids = xmalloc(sizeof(pthread_t)*burst_size);
+    size_t rss_burst_max = 0;
+    long long busy = 0;
+    for (int b = 0; b < bursts; b++) {
+        long long start = ustime();
+        for (int j = 0; j < burst_size; j++)
+            pthread_create(&tids[j],NULL,serveMessage,
+                           (void*)(uintptr_t)(b*burst_size+j+1));
+        for (int j = 0; j < burst_size; j++) pthread_join(tids[j],NULL);
+        busy += ustime()-start;
+        size_t rss = xmallocRSS();
+        if (rss > rss_burst_max) rss_burst_max = rss;
+        usleep(idle_ms*1000);
+    }
+    xmallocRelease();
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF,&ru);
+    long long msgs = (long long)bursts*burst_size;
+    printf("allocbench malloc=%s arenas=%d bursts=%d burst_size=%d "
+           "msgs=%lld msgs_per_sec=%.0f rss_peak_kb=%ld "
+           "rss_after_burst_max_kb=%zu rss_final_kb=%zu\n",
+           XMALLOC_LIB, arenas, bursts, burst_size, msgs,
+           busy ? msgs*1000000.0/busy : 0,
+           ru.ru_maxrss, rss_burst_max/1024, xmallocRSS()/1024);
+    return 0;
+}
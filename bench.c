@@ -0,0 +1,915 @@
+/* Microbenchmarks for the core libraries: SDS, cJSON and our JSON selector,
+ * the SQLite wrapper and KV store, glob matching, URL building, plus the
+ * cost of starting a child process, the audio DSP kernels, and the job
+ * ring against a mutex protected queue.
+ *
+ * Usage: ./wbbench [--time <ms>] [--payload <file>] [pattern]
+ *
+ * Only benchmarks whose name matches the glob-style 'pattern' are run.
+ * Each benchmark runs for about --time milliseconds (default 200). The
+ * output is one line per benchmark, tab separated, with a header line:
+ *
+ *  name    iterations    ns/op    allocs/op
+ *
+ * Allocations are the xmalloc()/xrealloc() calls (so SDS, cJSON and
+ * our own code, but not SQLite and curl internals).
+ *
+ * The DSP benchmarks also check the accuracy of every implementation
+ * against the scalar one and of the resampler against a pure tone, and the
+ * trigger benchmarks that the compiled triggers agree with strmatch(), and
+ * the ring benchmarks run a stress test of the job ring first, reporting
+ * on stderr: the exit code is non zero if a check fails. */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+
+#include "botlib.h"
+#include "spawn.h"
+#include "dsp.h"
+#include "ring.h"
+
+/* Benchmark state, initialized by benchInit(). */
+static sds Payload[4];              /* getUpdates replies to parse. */
+static int NumPayloads;
+static cJSON *ParsedPayload;        /* Payload[0] already parsed. */
+static sqlite3 *BenchDb;
+static long long SinkInt;           /* Prevent the compiler from removing
+                                       code with unused results. */
+
+/* Recorded getUpdates replies: a private voice message, a group text
+ * message with mentions, and an audio document. */
+static const char *RecordedPayloads[] = {
+    "{\"ok\":true,\"result\":[{\"update_id\":736511201,\"message\":"
+    "{\"message_id\":4312,\"from\":{\"id\":31203311,\"is_bot\":false,"
+    "\"first_name\":\"Anna\",\"username\":\"anna_b\",\"language_code\":"
+    "\"it\"},\"chat\":{\"id\":31203311,\"first_name\":\"Anna\","
+    "\"username\":\"anna_b\",\"type\":\"private\"},\"date\":1760000000,"
+    "\"voice\":{\"duration\":14,\"mime_type\":\"audio/ogg\",\"file_id\":"
+    "\"AwACAgQAAxkBAAIQ2GjZ3o7rGmEpW9nk2S0zF8QeAAF5AAKBGQAC0q3RUvnhZ0q2"
+    "gDTONgQ\",\"file_unique_id\":\"AgADgRkAAtKt0VI\",\"file_size\":"
+    "51234}}}]}",
+
+    "{\"ok\":true,\"result\":[{\"update_id\":736511202,\"message\":"
+    "{\"message_id\":88121,\"from\":{\"id\":55102311,\"is_bot\":false,"
+    "\"first_name\":\"Marco\",\"username\":\"marcor\"},\"chat\":{\"id\":"
+    "-1001421230011,\"title\":\"Coffee machine\",\"type\":\"supergroup\"},"
+    "\"date\":1760000003,\"text\":\"@whisper_bot can you transcribe the "
+    "one above? thanks @anna_b\",\"entities\":[{\"offset\":0,\"length\":12,"
+    "\"type\":\"mention\"},{\"offset\":52,\"length\":7,\"type\":"
+    "\"mention\"}]}},{\"update_id\":736511203,\"message\":{\"message_id\":"
+    "88122,\"from\":{\"id\":55102312,\"is_bot\":false,\"first_name\":"
+    "\"Luca\"},\"chat\":{\"id\":-1001421230011,\"title\":\"Coffee machine\","
+    "\"type\":\"supergroup\"},\"date\":1760000005,\"text\":\"ok\"}}]}",
+
+    "{\"ok\":true,\"result\":[{\"update_id\":736511204,\"message\":"
+    "{\"message_id\":4313,\"from\":{\"id\":31203311,\"is_bot\":false,"
+    "\"first_name\":\"Anna\",\"username\":\"anna_b\"},\"chat\":{\"id\":"
+    "31203311,\"first_name\":\"Anna\",\"username\":\"anna_b\",\"type\":"
+    "\"private\"},\"date\":1760000010,\"document\":{\"file_name\":"
+    "\"lecture 3 - part 2.m4a\",\"mime_type\":\"audio/mp4\",\"file_id\":"
+    "\"BQACAgQAAxkBAAIQ2WjZ3pqv0xCMyhSgQdWWc1gPAAF5AAKCGQAC0q3RUqAbr2m7"
+    "Zx9TNgQ\",\"file_unique_id\":\"AgADghkAAtKt0VI\",\"file_size\":"
+    "8123411}}}]}",
+};
+
+/* ============================================================================
+ * Benchmarks. Each function performs one operation.
+ * ========================================================================= */
+
+void benchSdsCatGrowth(void) {
+    sds s = sdsempty();
+    for (int j = 0; j < 100; j++) s = sdscat(s,"word ");
+    sdsfree(s);
+}
+
+void benchSdsCatlenGrowth(void) {
+    sds s = sdsempty();
+    for (int j = 0; j < 100; j++) s = sdscatlen(s,"segment of text\n",16);
+    sdsfree(s);
+}
+
+void benchSdsSplitargs(void) {
+    int argc;
+    sds *argv = sdssplitargs("/transcribe \"some quoted arg\" foo bar 123",
+                             &argc);
+    sdsfreesplitres(argv,argc);
+}
+
+void benchSdsTrim(void) {
+    sds s = sdsnew("  \n The transcription of the message.\r\n\t ");
+    s = sdstrim(s," \t\r\n");
+    sdsfree(s);
+}
+
+void benchJsonParse(void) {
+    for (int j = 0; j < NumPayloads; j++) {
+        cJSON *json = cJSON_Parse(Payload[j]);
+        cJSON_Delete(json);
+    }
+}
+
+void benchJsonSelect(void) {
+    cJSON *update = cJSON_Select(ParsedPayload,".result[0]");
+    SinkInt += cJSON_Select(update,".update_id:n") != NULL;
+    SinkInt += cJSON_Select(update,".message.chat.id:n") != NULL;
+    SinkInt += cJSON_Select(update,".message.chat.type:s") != NULL;
+    SinkInt += cJSON_Select(update,".message.voice.file_id:s") != NULL;
+    SinkInt += cJSON_Select(update,".message.document.file_id:s") != NULL;
+}
+
+void benchSqlQuery(void) {
+    SinkInt += sqlSelectInt(BenchDb,"SELECT ?i+1",(int64_t)SinkInt);
+}
+
+void benchKvSet(void) {
+    kvSet(BenchDb,"bench:key","some value stored in the kv store",0);
+}
+
+void benchKvGet(void) {
+    sds v = kvGet(BenchDb,"bench:key");
+    sdsfree(v);
+}
+
+void benchStrmatch(void) {
+    const char *text = "Hey bot, can you transcribe the voice message?";
+    SinkInt += strmatch("*transcri*",10,text,strlen(text),1);
+    SinkInt += strmatch("/start*",7,text,strlen(text),1);
+    SinkInt += strmatch("*[Bb]ot*message?",17,text,strlen(text),1);
+}
+
+void benchURLBuild(void) {
+    char *options[8] = {
+        "chat_id", "-1001421230011",
+        "message_id", "88123",
+        "text", "Transcribing (medium)... più o meno & così?",
+        "parse_mode", "Markdown"
+    };
+    sds url = makeHTTPURL("https://api.telegram.org/botTOKEN/editMessageText",
+                          options,4);
+    sdsfree(url);
+}
+
+/* ============================================================================
+ * Runner
+ * ========================================================================= */
+
+typedef struct benchCase {
+    const char *name;
+    void (*op)(void);
+} benchCase;
+
+benchCase BenchCases[] = {
+    {"sds.cat.growth", benchSdsCatGrowth},
+    {"sds.catlen.growth", benchSdsCatlenGrowth},
+    {"sds.splitargs", benchSdsSplitargs},
+    {"sds.trim", benchSdsTrim},
+    {"json.parse.getupdates", benchJsonParse},
+    {"json.select", benchJsonSelect},
+    {"sql.query", benchSqlQuery},
+    {"kv.set", benchKvSet},
+    {"kv.get", benchKvGet},
+    {"strmatch", benchStrmatch},
+    {"url.build", benchURLBuild},
+    {NULL, NULL}
+};
+
+long long nstime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Print a result line. Also used by benchmarks that don't fit the
+ * one-operation model and time themselves. */
+void benchReport(const char *name, long long iters, double ns_op,
+                 double allocs_op)
+{
+    printf("%s\t%lld\t%.1f\t%.2f\n", name, iters, ns_op, allocs_op);
+    fflush(stdout);
+}
+
+/* Run 'op' in batches of growing size until 'time_ms' milliseconds are
+ * spent, then report the figures for the last batch. */
+void benchRun(benchCase *bc, int time_ms) {
+    long long iters = 1;
+    bc->op(); /* Warm up. */
+    while (1) {
+        unsigned long long allocs = xmallocThreadAllocs();
+        long long start = nstime();
+        for (long long j = 0; j < iters; j++) bc->op();
+        long long elapsed = nstime()-start;
+        allocs = xmallocThreadAllocs()-allocs;
+        if (elapsed >= time_ms*1000000LL || iters >= (1LL<<40)) {
+            benchReport(bc->name,iters,(double)elapsed/iters,
+                        (double)allocs/iters);
+            return;
+        }
+        /* Aim to the target time, but never grow more than 10x. */
+        long long next = elapsed ? iters*time_ms*1100000LL/elapsed : iters*10;
+        if (next > iters*10) next = iters*10;
+        if (next <= iters) next = iters+1;
+        iters = next;
+    }
+}
+
+/* ============================================================================
+ * Process spawn latency. Timed separately since what matters is how the
+ * cost changes with the memory of the parent: fork() copies the page
+ * tables, posix_spawn() does not. For each size we touch that much memory,
+ * then start /bin/true and wait for it, with both methods.
+ * ========================================================================= */
+
+static int SpawnRSSMB[] = {0, 128, 512};
+
+void benchSpawnOne(const char *name, int use_fork, int time_ms) {
+    const char *argv[] = {"/bin/true", NULL};
+    long long iters = 0, start = nstime(), elapsed;
+    do {
+        if (use_fork) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                execv(argv[0], (char *const *)argv);
+                _exit(1);
+            }
+            if (pid != -1) waitpid(pid, NULL, 0);
+        } else {
+            childProc c;
+            if (spawnChild(&c, argv, -1, -1) == 0) spawnWait(&c, NULL, NULL);
+        }
+        iters++;
+        elapsed = nstime()-start;
+    } while (elapsed < time_ms*1000000LL || iters < 3);
+    benchReport(name,iters,(double)elapsed/iters,0);
+}
+
+void benchSpawn(const char *pattern, int time_ms) {
+    char *ballast = NULL;
+    size_t ballast_len = 0;
+    for (size_t j = 0; j < sizeof(SpawnRSSMB)/sizeof(int); j++) {
+        char fname[64], sname[64];
+        snprintf(fname,sizeof(fname),"spawn.fork.rss_%dmb",SpawnRSSMB[j]);
+        snprintf(sname,sizeof(sname),"spawn.posix.rss_%dmb",SpawnRSSMB[j]);
+        int dofork = strmatch(pattern,strlen(pattern),fname,strlen(fname),0);
+        int dospawn = strmatch(pattern,strlen(pattern),sname,strlen(sname),0);
+        if (!dofork && !dospawn) continue;
+
+        /* Grow the ballast and touch every page, so that it is mapped. */
+        size_t len = (size_t)SpawnRSSMB[j]*1024*1024;
+        if (len > ballast_len) {
+            ballast = xrealloc(ballast,len);
+            memset(ballast+ballast_len,1,len-ballast_len);
+            ballast_len = len;
+        }
+        if (dofork) benchSpawnOne(fname,1,time_ms);
+        if (dospawn) benchSpawnOne(sname,0,time_ms);
+    }
+    xfree(ballast);
+}
+
+/* ============================================================================
+ * DSP kernels. Each operation processes one second of 48 kHz stereo audio,
+ * so ns/op * 3600 is the time needed for an hour of audio. Every benchmark
+ * runs once per implementation supported by the CPU.
+ * ========================================================================= */
+
+#define DSP_FRAMES 48000
+
+static int16_t *DspStereo;          /* Input: 48 kHz stereo speech-like. */
+static float *DspMono, *DspOut;
+static int16_t *DspS16;
+static dspResampler *DspRs48, *DspRs44;
+static int BenchFailed = 0;
+
+void benchDspS16ToFloat(void) {
+    dspS16ToFloat(DspStereo,DspOut,DSP_FRAMES*2);
+}
+
+void benchDspDownmix(void) {
+    dspS16ToMono(DspStereo,2,DspMono,DSP_FRAMES);
+}
+
+void benchDspFloatToS16(void) {
+    dspFloatToS16(DspMono,DspS16,DSP_FRAMES);
+}
+
+void benchDspAnalyze(void) {
+    dspAnalysis a;
+    dspAnalyze(DspS16,DSP_FRAMES,&a);
+    SinkInt += a.rms > 0;
+}
+
+void benchDspResample48k(void) {
+    SinkInt += dspResample(DspRs48,DspMono,DSP_FRAMES,DspOut);
+}
+
+void benchDspResample44k(void) {
+    /* Feed one second at 44.1 kHz, out of the same buffer. */
+    SinkInt += dspResample(DspRs44,DspMono,44100,DspOut);
+}
+
+benchCase DspCases[] = {
+    {"dsp.s16tofloat", benchDspS16ToFloat},
+    {"dsp.downmix", benchDspDownmix},
+    {"dsp.floattos16", benchDspFloatToS16},
+    {"dsp.analyze", benchDspAnalyze},
+    {"dsp.resample.48k", benchDspResample48k},
+    {"dsp.resample.44k1", benchDspResample44k},
+    {NULL, NULL}
+};
+
+/* Resample the whole buffer 'in' and return the output, of *outlen
+ * samples. */
+float *dspResampleAll(int in_rate, int out_rate, const float *in, size_t n,
+                      size_t *outlen)
+{
+    dspResampler *r = dspResamplerNew(in_rate,out_rate);
+    float *out = xmalloc(sizeof(float)*(dspResampleMaxOut(r,n)+
+                                        dspResampleMaxOut(r,0)));
+    *outlen = dspResample(r,in,n,out);
+    *outlen += dspResampleFlush(r,out+*outlen);
+    dspResamplerFree(r);
+    return out;
+}
+
+/* Resample a tone of 'freq' Hz from 'rate' to 16 kHz with the current
+ * implementation and return the error against the ideal output, in dB
+ * relative to the tone. For tones above 8 kHz the ideal output is silence,
+ * so this is the stopband attenuation. */
+double dspToneError(int rate, double freq) {
+    size_t n = rate, outlen;
+    float *in = xmalloc(sizeof(float)*n);
+    for (size_t j = 0; j < n; j++) in[j] = 0.5*sin(2*M_PI*freq*j/rate);
+    float *out = dspResampleAll(rate,16000,in,n,&outlen);
+
+    /* Skip the edges, where the filter sees the zero padding. */
+    double err = 0, sig = 0;
+    for (size_t j = 200; j+200 < outlen; j++) {
+        double ideal = freq < 8000 ? 0.5*sin(2*M_PI*freq*j/16000) : 0;
+        double ref = 0.5*sin(2*M_PI*freq*j/16000);
+        err += (out[j]-ideal)*(out[j]-ideal);
+        sig += ref*ref;
+    }
+    xfree(in);
+    xfree(out);
+    if (outlen != 16000) return 0;   /* Wrong length: fail the check. */
+    return 10*log10(err/sig);
+}
+
+/* Compare the current implementation with the scalar one. Returns the max
+ * absolute difference of all the kernels' outputs. */
+double dspCompareScalar(const char *impl) {
+    size_t n = DSP_FRAMES, len1, len2;
+    float *a = xmalloc(sizeof(float)*n*2), *b = xmalloc(sizeof(float)*n*2);
+    int16_t *sa = xmalloc(sizeof(int16_t)*n), *sb = xmalloc(sizeof(int16_t)*n);
+    double maxdiff = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        dspSetImpl(pass == 0 ? "scalar" : impl);
+        float *f = pass == 0 ? a : b;
+        int16_t *s16 = pass == 0 ? sa : sb;
+        dspS16ToFloat(DspStereo,f,n*2);
+        dspS16ToMono(DspStereo,2,f,n);
+        dspFloatToS16(f,s16,n);
+    }
+    for (size_t j = 0; j < n; j++) {
+        double d = fabs(a[j]-b[j]);
+        if (d > maxdiff) maxdiff = d;
+        /* Ties may round differently: allow one LSB. */
+        d = abs(sa[j]-sb[j]) > 1 ? 1 : 0;
+        if (d > maxdiff) maxdiff = d;
+    }
+
+    dspAnalysis aa, ab;
+    dspSetImpl("scalar");
+    dspAnalyze(sa,n,&aa);
+    dspSetImpl(impl);
+    dspAnalyze(sa,n,&ab);
+    double d = fabs(aa.rms-ab.rms) + fabs(aa.peak-ab.peak) +
+               fabs(aa.clip_ratio-ab.clip_ratio) +
+               fabs(aa.speech_ratio-ab.speech_ratio);
+    if (d > maxdiff) maxdiff = d;
+
+    dspSetImpl("scalar");
+    float *ra = dspResampleAll(44100,16000,a,n,&len1);
+    dspSetImpl(impl);
+    float *rb = dspResampleAll(44100,16000,a,n,&len2);
+    if (len1 != len2) maxdiff = 1;
+    for (size_t j = 0; j < len1 && j < len2; j++) {
+        double d = fabs(ra[j]-rb[j]);
+        if (d > maxdiff) maxdiff = d;
+    }
+    xfree(a); xfree(b); xfree(sa); xfree(sb); xfree(ra); xfree(rb);
+    return maxdiff;
+}
+
+void benchDspAccuracy(void) {
+    const char **impls = dspImpls();
+    for (int j = 0; impls[j]; j++) {
+        double diff = dspCompareScalar(impls[j]);
+        double pass48 = dspToneError(48000,1000);
+        double pass44 = dspToneError(44100,3000);
+        double stop44 = dspToneError(44100,10000);
+        int ok = diff < 1e-5 && pass48 < -60 && pass44 < -60 && stop44 < -60;
+        fprintf(stderr,"dsp accuracy %s: max diff vs scalar %g, "
+                       "1 kHz@48k %.1f dB, 3 kHz@44.1k %.1f dB, "
+                       "10 kHz@44.1k stopband %.1f dB: %s\n",
+                impls[j], diff, pass48, pass44, stop44, ok ? "ok" : "FAIL");
+        if (!ok) BenchFailed = 1;
+    }
+}
+
+void benchDsp(const char *pattern, int time_ms) {
+    int selected = 0;
+    for (benchCase *bc = DspCases; bc->name; bc++)
+        if (strmatch(pattern,strlen(pattern),bc->name,strlen(bc->name),0))
+            selected = 1;
+    if (!selected && !strmatch(pattern,strlen(pattern),"dsp.",4,0)) return;
+
+    /* A tone sweep with some noise, different on the two channels. */
+    DspStereo = xmalloc(sizeof(int16_t)*DSP_FRAMES*2);
+    DspMono = xmalloc(sizeof(float)*DSP_FRAMES);
+    DspOut = xmalloc(sizeof(float)*DSP_FRAMES*2);
+    DspS16 = xmalloc(sizeof(int16_t)*DSP_FRAMES);
+    unsigned int seed = 1;
+    for (int j = 0; j < DSP_FRAMES; j++) {
+        double t = (double)j/48000;
+        double v = 0.4*sin(2*M_PI*(200+2000*t)*t);
+        DspStereo[j*2] = (v + (rand_r(&seed)%1000-500)/32768.0)*32767;
+        DspStereo[j*2+1] = (v*0.5 + (rand_r(&seed)%1000-500)/32768.0)*32767;
+    }
+    dspS16ToMono(DspStereo,2,DspMono,DSP_FRAMES);
+    dspFloatToS16(DspMono,DspS16,DSP_FRAMES);
+
+    benchDspAccuracy();
+    const char *best = dspImplName();
+    const char **impls = dspImpls();
+    for (benchCase *bc = DspCases; bc->name; bc++) {
+        for (int j = 0; impls[j]; j++) {
+            char name[64];
+            snprintf(name,sizeof(name),"%s.%s",bc->name,impls[j]);
+            if (!strmatch(pattern,strlen(pattern),name,strlen(name),0))
+                continue;
+            dspSetImpl(impls[j]);
+            DspRs48 = dspResamplerNew(48000,16000);
+            DspRs44 = dspResamplerNew(44100,16000);
+            benchCase c = {name, bc->op};
+            benchRun(&c,time_ms);
+            dspResamplerFree(DspRs48);
+            dspResamplerFree(DspRs44);
+        }
+    }
+    dspSetImpl(best);
+    xfree(DspStereo);
+    xfree(DspMono);
+    xfree(DspOut);
+    xfree(DspS16);
+}
+
+/* ============================================================================
+ * Triggers: the strmatch() loop the bot used to run for every group message,
+ * against the triggers compiled by triggerCompile().
+ * ========================================================================= */
+
+static char *Triggers[] = {
+    "*@whisper_bot*", "/transcribe*", "/tr *", "/start*", "/help*",
+    "/status*", "/lang *", "/model *", "*trascrivi*", "*transcri[bp]*",
+    "*[Bb]ot*message?", "hey bot*", "ok bot*", "bot,*", "*voice note*",
+    "*audio*please*", "*vocale*", "!w *", "!whisper*", ".t *", "#transcribe*",
+    "*?[0-9][0-9]:[0-9][0-9]*", "*summari[sz]e*", "*riassumi*",
+    "*what did * say*", "*cosa ha detto*", "*listen to this*", "*ascolta*",
+    "*speech to text*", "*stt*", "*w[h]isper*", "*\\*urgent\\**",
+    "*[^a-z]tldr*", "tl;dr*", "*can't listen*", "*non posso ascoltare*",
+    NULL
+};
+
+static const char *TriggerTexts[] = {
+    "lol",
+    "Hey everyone, the meeting moved to 15:30, see you there",
+    "@whisper_bot can you transcribe the one above? thanks @anna_b",
+    "I can't listen right now, I'm on the train, what did Marco say?",
+    "ok",
+    "Does anybody know a good place for lunch near the station? "
+    "Somewhere cheap, the usual one is closed for holidays until monday",
+    "/status",
+    "ahahahahahahahahahahahahahahahahahahahahahahahahahahahahahaha",
+};
+#define TRIGGER_TEXTS (int)(sizeof(TriggerTexts)/sizeof(TriggerTexts[0]))
+
+static triggerSet *BenchTriggers;
+
+void benchTriggersLoop(void) {
+    for (int j = 0; j < TRIGGER_TEXTS; j++) {
+        const char *s = TriggerTexts[j];
+        for (int k = 0; Triggers[k]; k++) {
+            if (strmatch(Triggers[k],strlen(Triggers[k]),s,strlen(s),1)) {
+                SinkInt++;
+                break;
+            }
+        }
+    }
+}
+
+void benchTriggersCompiled(void) {
+    for (int j = 0; j < TRIGGER_TEXTS; j++)
+        SinkInt += triggerMatch(BenchTriggers,TriggerTexts[j],
+                                strlen(TriggerTexts[j]));
+}
+
+benchCase TriggerCases[] = {
+    {"triggers.loop", benchTriggersLoop},
+    {"triggers.compiled", benchTriggersCompiled},
+    {NULL, NULL}
+};
+
+/* Random string of up to 'maxlen' bytes from 'alphabet'. */
+static void benchRandomString(char *buf, int maxlen, const char *alphabet,
+                              unsigned int *seed)
+{
+    int len = rand_r(seed) % (maxlen+1), n = strlen(alphabet);
+    for (int j = 0; j < len; j++) buf[j] = alphabet[rand_r(seed) % n];
+    buf[len] = '\0';
+}
+
+/* Check that the compiled triggers match exactly what strmatch() matches,
+ * with the bench triggers and with random patterns and strings, where
+ * mismatches in corner cases (escapes, ranges, unterminated classes,
+ * empty strings) are likely. */
+void benchTriggersCheck(void) {
+    unsigned int seed = 1;
+    long checks = 0, failed = 0;
+    for (int j = 0; j < TRIGGER_TEXTS; j++) {
+        const char *s = TriggerTexts[j];
+        int expected = 0;
+        for (int k = 0; Triggers[k] && !expected; k++)
+            expected = strmatch(Triggers[k],strlen(Triggers[k]),
+                                s,strlen(s),1);
+        checks++;
+        if (triggerMatch(BenchTriggers,s,strlen(s)) != expected) failed++;
+    }
+    for (int j = 0; j < 20000; j++) {
+        char pat[16], str[4][16];
+        char *set[2] = {pat, NULL};
+        benchRandomString(pat,sizeof(pat)-1,"aAbB*?[]^-\\",&seed);
+        triggerSet *ts = triggerCompile(set);
+        for (int k = 0; k < 4; k++) {
+            benchRandomString(str[k],sizeof(str[k])-1,"aAbBc*?[]^-\\",
+                              &seed);
+            int expected = strmatch(pat,strlen(pat),str[k],strlen(str[k]),1);
+            checks++;
+            if (triggerMatch(ts,str[k],strlen(str[k])) == expected) continue;
+            if (failed++ < 10)
+                fprintf(stderr,"triggers mismatch: \"%s\" vs \"%s\"\n",
+                        pat,str[k]);
+        }
+        triggerFree(ts);
+    }
+    fprintf(stderr,"triggers check: %ld patterns/strings, %ld mismatches: "
+                   "%s\n", checks, failed, failed ? "FAIL" : "ok");
+    if (failed) BenchFailed = 1;
+}
+
+void benchTriggers(const char *pattern, int time_ms) {
+    int selected = 0;
+    for (benchCase *bc = TriggerCases; bc->name; bc++)
+        if (strmatch(pattern,strlen(pattern),bc->name,strlen(bc->name),0))
+            selected = 1;
+    if (!selected) return;
+
+    BenchTriggers = triggerCompile(Triggers);
+    benchTriggersCheck();
+    for (benchCase *bc = TriggerCases; bc->name; bc++)
+        if (strmatch(pattern,strlen(pattern),bc->name,strlen(bc->name),0))
+            benchRun(bc,time_ms);
+    triggerFree(BenchTriggers);
+}
+
+/* ============================================================================
+ * Job ring: the lock-free queue of ring.c against a queue protected by a
+ * mutex and condition variables, with producers and consumers handing
+ * items over. Before timing, a stress test checks that under contention
+ * no item is lost or duplicated, that items of the same producer and class
+ * are popped in order, that sleeping consumers are always woken, and that
+ * the depth is exact when idle. Build with "make tsan" to run it under
+ * ThreadSanitizer.
+ * ========================================================================= */
+
+#define RING_CLASSES 3
+#define RING_CAPACITY 64
+#define RING_STRESS_ITEMS 100000    /* Per producer. */
+#define RING_BENCH_ITEMS 1000000    /* Total. */
+
+/* Baseline: the same queue with a mutex. */
+typedef struct mutexQueue {
+    void **items[RING_CLASSES];
+    size_t head[RING_CLASSES], count[RING_CLASSES], size, total;
+    pthread_mutex_t lock;
+    pthread_cond_t notempty, notfull;
+} mutexQueue;
+
+static mutexQueue *mutexQueueNew(size_t size) {
+    mutexQueue *q = xmalloc(sizeof(*q));
+    for (int c = 0; c < RING_CLASSES; c++) {
+        q->items[c] = xmalloc(sizeof(void*)*size);
+        q->head[c] = q->count[c] = 0;
+    }
+    q->size = size;
+    q->total = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notempty, NULL);
+    pthread_cond_init(&q->notfull, NULL);
+    return q;
+}
+
+static void mutexQueueFree(mutexQueue *q) {
+    for (int c = 0; c < RING_CLASSES; c++) xfree(q->items[c]);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->notempty);
+    pthread_cond_destroy(&q->notfull);
+    xfree(q);
+}
+
+static void mutexQueuePush(mutexQueue *q, int class, void *item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count[class] == q->size)
+        pthread_cond_wait(&q->notfull, &q->lock);
+    q->items[class][(q->head[class]+q->count[class]) % q->size] = item;
+    q->count[class]++;
+    q->total++;
+    pthread_cond_signal(&q->notempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *mutexQueuePop(mutexQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->total == 0) pthread_cond_wait(&q->notempty, &q->lock);
+    int c = 0;
+    while (q->count[c] == 0) c++;
+    void *item = q->items[c][q->head[c]];
+    q->head[c] = (q->head[c]+1) % q->size;
+    q->count[c]--;
+    q->total--;
+    pthread_cond_broadcast(&q->notfull);
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+/* State shared by the producers and consumers of a run. Items are the
+ * numbers from 1 to producers*per_producer, the next one is the end
+ * marker: every consumer exits after popping one. */
+typedef struct ringRun {
+    ring *r;                    /* NULL to use 'mq'. */
+    mutexQueue *mq;
+    int producers, consumers;
+    long per_producer;
+    atomic_uchar *seen;         /* Times every item was popped. */
+    atomic_int failed;
+} ringRun;
+
+typedef struct ringThread {
+    ringRun *run;
+    int id;
+    pthread_t tid;
+} ringThread;
+
+static uintptr_t ringRunEnd(ringRun *run) {
+    return (uintptr_t)run->producers*run->per_producer+1;
+}
+
+static void ringRunPush(ringRun *run, int class, uintptr_t v) {
+    if (run->r == NULL) {
+        mutexQueuePush(run->mq, class, (void*)v);
+        return;
+    }
+    while (ringPush(run->r, class, (void*)v) == -1) sched_yield();
+}
+
+static void *ringProducer(void *arg) {
+    ringThread *t = arg;
+    ringRun *run = t->run;
+    for (long j = 0; j < run->per_producer; j++)
+        ringRunPush(run, j % RING_CLASSES, t->id*run->per_producer+j+1);
+    return NULL;
+}
+
+static void *ringConsumer(void *arg) {
+    ringThread *t = arg;
+    ringRun *run = t->run;
+    long *last = xmalloc(sizeof(long)*run->producers*RING_CLASSES);
+    for (int j = 0; j < run->producers*RING_CLASSES; j++) last[j] = -1;
+
+    while (1) {
+        uintptr_t v;
+        if (run->r) {
+            /* A sleeping consumer never woken up would wait forever. */
+            v = (uintptr_t)ringPop(run->r, NULL, 10000);
+            if (v == 0) {
+                fprintf(stderr, "ring stress: consumer %d not woken up\n",
+                        t->id);
+                run->failed = 1;
+                break;
+            }
+        } else {
+            v = (uintptr_t)mutexQueuePop(run->mq);
+        }
+        if (v == ringRunEnd(run)) break;
+        if (run->seen == NULL) continue;
+
+        long p = (v-1) / run->per_producer, j = (v-1) % run->per_producer;
+        long *l = last + p*RING_CLASSES + j % RING_CLASSES;
+        if (j <= *l) {
+            fprintf(stderr, "ring stress: item %ld of producer %ld after "
+                            "item %ld\n", j, p, *l);
+            run->failed = 1;
+        }
+        *l = j;
+        atomic_fetch_add(&run->seen[v-1], 1);
+    }
+    xfree(last);
+    return NULL;
+}
+
+/* Run 'producers' threads pushing 'per_producer' items each, and
+ * 'consumers' threads popping them. Returns the elapsed nanoseconds. */
+static long long ringRunAll(ringRun *run) {
+    int n = run->producers + run->consumers;
+    ringThread *t = xmalloc(sizeof(ringThread)*n);
+    run->failed = 0;
+    long long start = nstime();
+    for (int j = 0; j < n; j++) {
+        t[j].run = run;
+        t[j].id = j < run->producers ? j : j - run->producers;
+        pthread_create(&t[j].tid, NULL,
+                       j < run->producers ? ringProducer : ringConsumer,
+                       t+j);
+    }
+    for (int j = 0; j < run->producers; j++) pthread_join(t[j].tid, NULL);
+    /* Lowest class: popped after all the items. */
+    for (int j = 0; j < run->consumers; j++)
+        ringRunPush(run, RING_CLASSES-1, ringRunEnd(run));
+    for (int j = run->producers; j < n; j++) pthread_join(t[j].tid, NULL);
+    long long elapsed = nstime() - start;
+    xfree(t);
+    return elapsed;
+}
+
+static int RingFailed = 0;
+
+static void ringCheck(int ok, const char *what) {
+    if (ok) return;
+    fprintf(stderr, "ring check failed: %s\n", what);
+    RingFailed = BenchFailed = 1;
+}
+
+void benchRingStress(void) {
+    /* Single thread: capacity, priority order, depth. */
+    ring *r = ringNew(RING_CLASSES, RING_CAPACITY);
+    int full = 0;
+    for (uintptr_t j = 1; j <= RING_CAPACITY+1; j++)
+        full += ringPush(r, 2, (void*)j) == -1;
+    ringCheck(full == 1, "a class takes exactly its capacity");
+    ringCheck(ringPush(r, 0, (void*)1000) == 0, "classes are independent");
+    ringPush(r, 1, (void*)2000);
+    ringCheck(ringDepth(r) == RING_CAPACITY+2, "depth");
+    ringCheck(ringClassDepth(r, 2) == RING_CAPACITY, "class depth");
+    int class;
+    ringCheck((uintptr_t)ringTryPop(r, &class) == 1000 && class == 0,
+              "class 0 first");
+    ringCheck((uintptr_t)ringTryPop(r, &class) == 2000 && class == 1,
+              "then class 1");
+    int inorder = 1;
+    for (uintptr_t j = 1; j <= RING_CAPACITY; j++)
+        inorder &= (uintptr_t)ringTryPop(r, NULL) == j;
+    ringCheck(inorder, "FIFO in the class");
+    ringCheck(ringTryPop(r, NULL) == NULL && ringDepth(r) == 0, "empty");
+    ringCheck(ringPop(r, NULL, 10) == NULL, "pop times out when empty");
+    ringFree(r);
+
+    /* Contention: a small ring, so producers find it full and consumers
+     * find it empty and sleep, often. */
+    ringRun run = {
+        .r = ringNew(RING_CLASSES, RING_CAPACITY),
+        .producers = 4,
+        .consumers = 4,
+        .per_producer = RING_STRESS_ITEMS
+    };
+    long items = run.producers * run.per_producer;
+    run.seen = xmalloc(sizeof(atomic_uchar)*items);
+    for (long j = 0; j < items; j++) atomic_init(&run.seen[j], 0);
+    ringRunAll(&run);
+    long bad = 0;
+    for (long j = 0; j < items; j++) bad += run.seen[j] != 1;
+    ringCheck(!run.failed, "order and wakeups under contention");
+    ringCheck(bad == 0, "every item popped exactly once");
+    ringCheck(ringDepth(run.r) == 0, "depth zero when drained");
+    fprintf(stderr, "ring stress: %dx%d threads, %ld items, %ld lost or "
+                    "duplicated: %s\n", run.producers, run.consumers, items,
+            bad, RingFailed ? "FAIL" : "ok");
+    xfree(run.seen);
+    ringFree(run.r);
+}
+
+void benchRing(const char *pattern, int time_ms) {
+    static const int threads[][2] = {{1,1}, {4,4}, {8,2}};
+    (void)time_ms;
+    int selected = 0;
+    for (int j = 0; j < 3; j++) {
+        for (int lockfree = 0; lockfree <= 1; lockfree++) {
+            char name[64];
+            snprintf(name, sizeof(name), "ring.%s.%dx%d",
+                     lockfree ? "mpmc" : "mutex", threads[j][0],
+                     threads[j][1]);
+            if (!strmatch(pattern,strlen(pattern),name,strlen(name),0))
+                continue;
+            if (!selected++) benchRingStress();
+
+            ringRun run = {
+                .producers = threads[j][0],
+                .consumers = threads[j][1],
+                .per_producer = RING_BENCH_ITEMS / threads[j][0]
+            };
+            if (lockfree) run.r = ringNew(RING_CLASSES, RING_CAPACITY);
+            else run.mq = mutexQueueNew(RING_CAPACITY);
+            long long ns = ringRunAll(&run);
+            long items = run.producers * run.per_producer;
+            benchReport(name, items, (double)ns/items, 0);
+            if (lockfree) ringFree(run.r);
+            else mutexQueueFree(run.mq);
+        }
+    }
+}
+
+void benchInit(const char *payload_file) {
+    cJSON_Hooks jh = {.malloc_fn = xmalloc, .free_fn = xfree};
+    cJSON_InitHooks(&jh);
+
+    if (payload_file) {
+        FILE *fp = fopen(payload_file,"r");
+        if (fp == NULL) {
+            perror("Opening payload");
+            exit(1);
+        }
+        Payload[0] = sdsempty();
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf,1,sizeof(buf),fp)) > 0)
+            Payload[0] = sdscatlen(Payload[0],buf,n);
+        fclose(fp);
+        NumPayloads = 1;
+    } else {
+        for (int j = 0; j < 3; j++) Payload[j] = sdsnew(RecordedPayloads[j]);
+        NumPayloads = 3;
+    }
+    ParsedPayload = cJSON_Parse(Payload[0]);
+
+    if (sqlite3_open(":memory:",&BenchDb) != SQLITE_OK ||
+        sqlite3_exec(BenchDb,TB_CREATE_KV_STORE,0,0,NULL) != SQLITE_OK)
+    {
+        fprintf(stderr,"Can't create the benchmark database\n");
+        exit(1);
+    }
+    kvSet(BenchDb,"bench:key","initial value",0);
+}
+
+int main(int argc, char **argv) {
+    int time_ms = 200;
+    const char *payload_file = NULL;
+    const char *pattern = "*";
+
+    for (int j = 1; j < argc; j++) {
+        int morearg = argc-j-1;
+        if (!strcmp(argv[j],"--time") && morearg) {
+            time_ms = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--payload") && morearg) {
+            payload_file = argv[++j];
+        } else if (argv[j][0] != '-') {
+            pattern = argv[j];
+        } else {
+            printf("Usage: %s [--time <ms>] [--payload <file>] [pattern]\n",
+                   argv[0]);
+            exit(1);
+        }
+    }
+
+    benchInit(payload_file);
+    printf("name\titerations\tns/op\tallocs/op\n");
+    for (benchCase *bc = BenchCases; bc->name; bc++) {
+        if (!strmatch(pattern,strlen(pattern),bc->name,strlen(bc->name),0))
+            continue;
+        benchRun(bc,time_ms);
+    }
+    benchSpawn(pattern,time_ms);
+    benchDsp(pattern,time_ms);
+    benchTriggers(pattern,time_ms);
+    benchRing(pattern,time_ms);
+    return BenchFailed || SinkInt == -1;
+}
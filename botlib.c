@@ -43,6 +43,9 @@
 #include <unistd.h>
 #include <math.h>
 #include <time.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include <curl/curl.h>
 #include <sqlite3.h>
@@ -62,9 +65,17 @@ struct {
                           enabled with a few --debug calls. */
     int verbose;                        // If true enables verbose info.
     char *dbfile;                       // Change with --dbfile.
+    int arenas;                         // Change with --malloc-arenas.
+    char *record_dir;                   // Record traffic with --record.
+    char *replay_dir;                   // Replay traffic with --replay.
+    double replay_speed;                // Change with --replay-speed.
     char **triggers;                    // Strings triggering processing.
+    triggerSet *matcher;                // Triggers compiled.
     sds apikey;                         // Telegram API key for the bot.
     sds username;                       // Bot username from getMe call.
+    int flags;                          // TB_FLAGS_* given to startBot().
+    int64_t committed;                  // Update ID persisted, see
+                                        // botCommitOffset().
     TBRequestCallback req_callback;     // Callback handling requests.
     TBCronCallback cron_callback;
 } Bot;
@@ -76,12 +87,26 @@ struct {
 struct {
     time_t start_time;      /* Unix time the bot was started. */
     uint64_t queries;       /* Number of queries received. */
+    atomic_int active;      /* Request threads currently running. */
 } botStats;
 
+/* Forward declarations for the record / replay harness. */
+void recordTraffic(char type, const char *payload, size_t len);
+sds replayTransport(const char *action, char **optlist, int numopt);
+int replayGetFile(BotRequest *br, const char *filename);
+void replayRequestDone(long long start_us);
+
 /* ============================================================================
  * Utils
  * ========================================================================= */
 
+/* Return the current monotonic time in microseconds. */
+long long ustime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
 /* Glob-style pattern matching. Return 1 on match, 0 otherwise. */
 int strmatch(const char *pattern, int patternLen,
              const char *string, int stringLen, int nocase)
@@ -204,29 +229,240 @@ int strmatch(const char *pattern, int patternLen,
 }
 
 /* ============================================================================
- * Allocator wrapper: we want to exit on OOM instead of trying to recover.
- * ========================================================================= */
+ * Compiled triggers
+ *
+ * Group messages are matched against all the triggers, case insensitive,
+ * on the thread polling Telegram. Instead of calling strmatch() for every
+ * trigger, that backtracks recursively on '*', triggers are compiled once
+ * by triggerCompile(). Every pattern is split at the stars in segments of
+ * fixed length, and every token of a segment ('?', a class, a literal) in
+ * a table of the bytes it matches, computed with strmatch() itself, so the
+ * two always agree. A pattern matches if its segments are found in order:
+ * the first one at the start and the last one at the end of the string,
+ * unless the pattern starts / ends with a star, and the others leftmost
+ * first, which is enough for globs: no backtracking is needed.
+ *
+ * Moreover patterns anchored at the start with a literal are indexed by
+ * their first byte, and every pattern is skipped unless the string
+ * contains the longest literal run of the pattern.
+ * ==========================================================================*/
 
-void *xmalloc(size_t size) {
-    void *p = malloc(size);
-    if (p == NULL) {
-        printf("Out of memory: malloc(%zu)", size);
-        exit(1);
+typedef struct trigSegment {
+    int len;                    /* Tokens, that is bytes matched. */
+    unsigned char *match;       /* len tables of 256 entries. */
+} trigSegment;
+
+typedef struct trigPattern {
+    int nseg;
+    trigSegment *seg;
+    int anchor_start;           /* Doesn't start with a star. */
+    int anchor_end;             /* Doesn't end with a star. */
+    int empty;                  /* Empty pattern: matches only "". */
+    char *needle;               /* Longest literal run, lower case. */
+    int needle_len;
+} trigPattern;
+
+struct triggerSet {
+    int count;
+    trigPattern *pat;
+    int *index[257];            /* Patterns by first byte, lower case. The
+                                   last list has the other patterns. Lists
+                                   are terminated by -1. */
+};
+
+/* Return the length of the token at the start of 'p', mirroring how
+ * strmatch() consumes the pattern. */
+static int trigTokenLen(const char *p, int len) {
+    if (p[0] == '\\' && len >= 2) return 2;
+    if (p[0] != '[') return 1;
+    int j = 1;
+    if (j < len && p[j] == '^') j++;
+    while (j < len) {
+        if (p[j] == '\\' && len-j >= 2) j += 2;
+        else if (p[j] == ']') return j+1;
+        else if (len-j >= 3 && p[j+1] == '-') j += 3;
+        else j++;
     }
-    return p;
+    return len;
 }
 
-void *xrealloc(void *ptr, size_t size) {
-    void *p = realloc(ptr,size);
-    if (p == NULL) {
-        printf("Out of memory: realloc(%zu)", size);
-        exit(1);
+/* Append the list 'l' the pattern 'id'. */
+static int *trigListAdd(int *l, int id) {
+    int n = 0;
+    if (l) while (l[n] != -1) n++;
+    l = xrealloc(l,sizeof(int)*(n+2));
+    l[n] = id;
+    l[n+1] = -1;
+    return l;
+}
+
+static void trigCompilePattern(trigPattern *tp, const char *p) {
+    int len = strlen(p);
+    memset(tp,0,sizeof(*tp));
+    tp->empty = len == 0;
+    tp->anchor_start = len && p[0] != '*';
+
+    char run[256];
+    int runlen = 0;
+    int j = 0;
+    while (j < len) {
+        if (p[j] == '*') {
+            j++;
+            runlen = 0;
+            tp->anchor_end = 0;
+            continue;
+        }
+        tp->anchor_end = 1;
+
+        /* New segment, up to the next star. */
+        tp->seg = xrealloc(tp->seg,sizeof(trigSegment)*(tp->nseg+1));
+        trigSegment *seg = tp->seg+tp->nseg++;
+        seg->len = 0;
+        seg->match = NULL;
+        while (j < len && p[j] != '*') {
+            /* strmatch() looks past the end of the pattern for stars,
+             * so the token is matched as a string of its own. */
+            int tl = trigTokenLen(p+j,len-j);
+            char *tok = xmalloc(tl+1);
+            memcpy(tok,p+j,tl);
+            tok[tl] = '\0';
+            seg->match = xrealloc(seg->match,256*(seg->len+1));
+            unsigned char *m = seg->match+256*seg->len++;
+            for (int c = 0; c < 256; c++) {
+                char ch = c;
+                m[c] = strmatch(tok,tl,&ch,1,1);
+            }
+            xfree(tok);
+
+            /* Literals are the tokens matching a single letter, in
+             * both cases, or a single byte. */
+            int n = 0, lit = -1;
+            for (int c = 0; c < 256; c++) {
+                if (m[c] && tolower(c) != lit) {
+                    lit = tolower(c);
+                    n++;
+                }
+            }
+            if (n == 1 && runlen < (int)sizeof(run)) {
+                run[runlen++] = lit;
+                if (runlen > tp->needle_len) {
+                    xfree(tp->needle);
+                    tp->needle = xmalloc(runlen);
+                    memcpy(tp->needle,run,runlen);
+                    tp->needle_len = runlen;
+                }
+            } else {
+                runlen = 0;
+            }
+            j += tl;
+        }
+        runlen = 0;
+    }
+}
+
+/* Compile the NULL terminated array of glob-style 'triggers'. */
+triggerSet *triggerCompile(char **triggers) {
+    triggerSet *ts = xmalloc(sizeof(*ts));
+    memset(ts,0,sizeof(*ts));
+    while (triggers[ts->count]) ts->count++;
+    ts->pat = xmalloc(sizeof(trigPattern)*(ts->count ? ts->count : 1));
+    for (int j = 0; j < ts->count; j++) {
+        trigPattern *tp = ts->pat+j;
+        trigCompilePattern(tp,triggers[j]);
+
+        /* Index by first byte the patterns starting with a literal. */
+        int slot = 256;
+        if (tp->anchor_start && tp->nseg) {
+            unsigned char *m = tp->seg[0].match;
+            int first = -1, n = 0;
+            for (int c = 0; c < 256; c++) {
+                if (m[c] && tolower(c) != first) {
+                    first = tolower(c);
+                    n++;
+                }
+            }
+            if (n == 1) slot = first;
+        }
+        ts->index[slot] = trigListAdd(ts->index[slot],j);
+    }
+    return ts;
+}
+
+void triggerFree(triggerSet *ts) {
+    for (int j = 0; j < ts->count; j++) {
+        for (int k = 0; k < ts->pat[j].nseg; k++)
+            xfree(ts->pat[j].seg[k].match);
+        xfree(ts->pat[j].seg);
+        xfree(ts->pat[j].needle);
     }
-    return p;
+    for (int j = 0; j < 257; j++) xfree(ts->index[j]);
+    xfree(ts->pat);
+    xfree(ts);
 }
 
-void xfree(void *ptr) {
-    free(ptr);
+/* Does 'seg' match the bytes at 's'? */
+static int trigSegmentAt(trigSegment *seg, const unsigned char *s) {
+    for (int j = 0; j < seg->len; j++)
+        if (!seg->match[256*j+s[j]]) return 0;
+    return 1;
+}
+
+/* Case insensitive search of the lower case 'needle' in 's'. */
+static int trigContains(const unsigned char *s, size_t len,
+                        const char *needle, int nlen)
+{
+    if ((size_t)nlen > len) return 0;
+    for (size_t j = 0; j <= len-nlen; j++) {
+        if (tolower(s[j]) != needle[0]) continue;
+        int k = 1;
+        while (k < nlen && tolower(s[j+k]) == needle[k]) k++;
+        if (k == nlen) return 1;
+    }
+    return 0;
+}
+
+static int trigMatchPattern(trigPattern *tp, const unsigned char *s,
+                            size_t len)
+{
+    if (len == 0) return tp->empty;
+    if (tp->empty) return 0;
+    if (tp->needle && !trigContains(s,len,tp->needle,tp->needle_len))
+        return 0;
+
+    size_t pos = 0;
+    for (int j = 0; j < tp->nseg; j++) {
+        trigSegment *seg = tp->seg+j;
+        size_t sl = seg->len;
+        if (j == tp->nseg-1 && tp->anchor_end) {
+            /* Last segment: at the end of the string. */
+            if (sl > len-pos) return 0;
+            if (j == 0 && tp->anchor_start && sl != len) return 0;
+            return trigSegmentAt(seg,s+len-sl);
+        }
+        if (j == 0 && tp->anchor_start) {
+            if (sl > len || !trigSegmentAt(seg,s)) return 0;
+            pos = sl;
+            continue;
+        }
+        /* Leftmost occurrence. */
+        while (pos+sl <= len && !trigSegmentAt(seg,s+pos)) pos++;
+        if (pos+sl > len) return 0;
+        pos += sl;
+    }
+    return 1;
+}
+
+/* Return 1 if 's' matches at least one of the triggers in 'ts', like
+ * strmatch() with 'nocase' set would, otherwise 0. */
+int triggerMatch(triggerSet *ts, const char *s, size_t len) {
+    const unsigned char *u = (const unsigned char*)s;
+    int *lists[2] = {len ? ts->index[tolower(u[0])] : NULL, ts->index[256]};
+    for (int j = 0; j < 2; j++) {
+        if (lists[j] == NULL) continue;
+        for (int *id = lists[j]; *id != -1; id++)
+            if (trigMatchPattern(ts->pat+*id,u,len)) return 1;
+    }
+    return 0;
 }
 
 /* ============================================================================
@@ -294,11 +530,10 @@ sds makeHTTPGETCall(const char *url, int *resptr) {
     return body;
 }
 
-/* Like makeHTTPGETCall(), but the list of options will be concatenated to
- * the URL as a query string, and URL encoded as needed.
- * The option list array should contain optnum*2 strings, alternating
- * option names and values. */
-sds makeHTTPGETCallOpt(const char *url, int *resptr, char **optlist, int optnum) {
+/* Return a new SDS string with 'url' followed by the list of options as
+ * a query string, URL encoded as needed. The option list array should
+ * contain optnum*2 strings, alternating option names and values. */
+sds makeHTTPURL(const char *url, char **optlist, int optnum) {
     sds fullurl = sdsnew(url);
     if (optnum) fullurl = sdscatlen(fullurl,"?",1);
     CURL *curl = curl_easy_init();
@@ -312,6 +547,13 @@ sds makeHTTPGETCallOpt(const char *url, int *resptr, char **optlist, int optnum)
         curl_free(escaped);
     }
     curl_easy_cleanup(curl);
+    return fullurl;
+}
+
+/* Like makeHTTPGETCall(), but the list of options will be concatenated to
+ * the URL as a query string, see makeHTTPURL(). */
+sds makeHTTPGETCallOpt(const char *url, int *resptr, char **optlist, int optnum) {
+    sds fullurl = makeHTTPURL(url,optlist,optnum);
     sds body = makeHTTPGETCall(fullurl,resptr);
     sdsfree(fullurl);
     return body;
@@ -323,12 +565,29 @@ sds makeHTTPGETCallOpt(const char *url, int *resptr, char **optlist, int optnum)
  * makeHTTPGETCall(). */
 sds makeGETBotRequest(const char *action, int *resptr, char **optlist, int numopt)
 {
+    if (Bot.replay_dir) {
+        if (resptr) *resptr = 1;
+        return replayTransport(action,optlist,numopt);
+    }
+
     sds url = sdsnew("https://api.telegram.org/bot");
     url = sdscat(url,Bot.apikey);
     url = sdscatlen(url,"/",1);
     url = sdscat(url,action);
     sds body = makeHTTPGETCallOpt(url,resptr,optlist,numopt);
     sdsfree(url);
+
+    /* Log the raw getUpdates replies and all the other calls (without
+     * the API key) if we are recording. */
+    if (Bot.record_dir) {
+        if (!strcmp(action,"getUpdates")) {
+            recordTraffic('U',body,sdslen(body));
+        } else {
+            sds call = makeHTTPURL(action,optlist,numopt);
+            recordTraffic('C',call,sdslen(call));
+            sdsfree(call);
+        }
+    }
     return body;
 }
 
@@ -341,6 +600,8 @@ int botSendImage(int64_t target, char *filename) {
     struct curl_httppost *formpost = NULL;
     struct curl_httppost *lastptr = NULL;
 
+    if (Bot.replay_dir) return 1;
+
     /* Build the POST form to submit. */
     sds strtarget = sdsfromlonglong(target);
     curl_formadd(&formpost, &lastptr,
@@ -493,6 +754,8 @@ int botEditMessageText(int64_t chat_id, int message_id, sds text) {
  * When the function returns successfully, the caller can access
  * a file named 'br->file_id'. */
 int botGetFile(BotRequest *br, const char *target_filename) {
+    if (Bot.replay_dir) return replayGetFile(br,target_filename);
+
     /* 1. Get the file information and path. */
     char *options[2];
     options[0] = "file_id";
@@ -564,14 +827,14 @@ void freeBotRequest(BotRequest *br) {
     sdsfree(br->from_username);
     if (br->mentions) {
         for (int j = 0; j < br->num_mentions; j++) sdsfree(br->mentions[j]);
-        free(br->mentions);
+        xfree(br->mentions);
     }
-    free(br);
+    xfree(br);
 }
 
 /* Create a bot request object and return it to the caller. */
 BotRequest *createBotRequest(void) {
-    BotRequest *br = malloc(sizeof(*br));
+    BotRequest *br = xmalloc(sizeof(*br));
     br->request = NULL;
     br->argc = 0;
     br->argv = NULL;
@@ -579,10 +842,12 @@ BotRequest *createBotRequest(void) {
     br->from_username = NULL;
     br->target = 0;
     br->msg_id = 0;
+    br->update_id = 0;
     br->file_id = NULL;
     br->file_name = NULL;
     br->file_mime = NULL;
     br->file_size = 0;
+    br->file_duration = 0;
     br->type = TB_TYPE_UNKNOWN;
     br->file_type = TB_FILE_TYPE_NONE;
     br->bot_mentioned = 0;
@@ -606,6 +871,10 @@ sqlite3 *dbInit(char *createdb_query) {
         return NULL;
     }
 
+    /* Other threads, or other processes sharing the database, may be
+     * writing: wait for them instead of failing. */
+    sqlite3_busy_timeout(db,5000);
+
     if (createdb_query) {
         char *errmsg;
         int rc = sqlite3_exec(db, createdb_query, 0, 0, &errmsg);
@@ -631,18 +900,95 @@ void dbClose(void) {
  * ========================================================================== */
 
 /* Request handling thread entry point. */
+static void botUpdateDone(int64_t update_id);
+
 void *botHandleRequest(void *arg) {
+    long long start = ustime();
     DbHandle = dbInit(NULL);
     BotRequest *br = arg;
+    int64_t update_id = br->update_id;
 
     /* Parse the request as a command composed of arguments. */
     br->argv = sdssplitargs(br->request,&br->argc);
     Bot.req_callback(DbHandle,br);
     freeBotRequest(br);
+    botUpdateDone(update_id);
     dbClose();
+    if (Bot.replay_dir) replayRequestDone(start);
+    atomic_fetch_sub(&botStats.active,1);
     return NULL;
 }
 
+/* Telegram confirms an update as soon as getUpdates is called with a
+ * higher offset, and never returns it again. So the requests are made
+ * durable before the next poll: each one is saved in the PendingUpdates
+ * table, with the update as received, before its thread starts, and marked
+ * done when its callback returns (for the standalone bot that's when the
+ * audio was transcribed, in the split deployment when the job was inserted
+ * in the job table). At startup the requests not done are served again,
+ * and an update already in the table is never served twice, even if
+ * Telegram sends it again.
+ *
+ * The ID of the last update fetched is persisted as well, so that after a
+ * restart we resume from there instead of fetching again the last 100
+ * updates. This is a group commit: the offset is written, and the rows
+ * done up to it deleted, once every TB_OFFSET_COMMIT_UPDATES updates.
+ * A request can still be served twice if the bot dies after serving it
+ * but before marking it done. */
+#define TB_OFFSET_COMMIT_UPDATES 100
+#define TB_CREATE_OFFSET_TABLE \
+    "CREATE TABLE IF NOT EXISTS UpdateOffset(id INT PRIMARY KEY, " \
+                                            "update_id INT);"
+#define TB_CREATE_PENDING_TABLE \
+    "CREATE TABLE IF NOT EXISTS PendingUpdates(" \
+        "update_id INTEGER PRIMARY KEY, done INT, payload TEXT);"
+
+/* Return the persisted update ID to resume from, or -100 to start from
+ * the last 100 messages. */
+int64_t botLoadOffset(void) {
+    int64_t offset = sqlSelectInt(DbHandle,
+        "SELECT update_id FROM UpdateOffset WHERE id=0");
+    Bot.committed = offset ? offset : -100;
+    return Bot.committed;
+}
+
+/* Save the request of 'update' before serving it. Returns 0 if the
+ * update is already in the table, so it was served or is being served.
+ * Not when replaying: the recorded updates are not ours to acknowledge. */
+static int botUpdateSave(cJSON *update, int64_t update_id) {
+    if (Bot.replay_dir) return 1;
+    char *payload = cJSON_PrintUnformatted(update);
+    int saved = sqlQuery(DbHandle,
+        "INSERT OR IGNORE INTO PendingUpdates VALUES(?i,0,?s)",
+        update_id, payload);
+    xfree(payload);
+    /* If the database fails, serve the request anyway. */
+    return !saved || sqlite3_changes(DbHandle) == 1;
+}
+
+static void botUpdateDone(int64_t update_id) {
+    if (Bot.replay_dir || update_id == 0) return;
+    sqlQuery(DbHandle,"UPDATE PendingUpdates SET done=1 WHERE update_id=?i",
+             update_id);
+}
+
+/* Persist 'offset', the last update fetched, if TB_OFFSET_COMMIT_UPDATES
+ * updates went by since the last commit. */
+void botCommitOffset(int64_t offset) {
+    if (Bot.replay_dir) return;
+    if (offset-Bot.committed < TB_OFFSET_COMMIT_UPDATES) return;
+    sqlQuery(DbHandle,"BEGIN");
+    sqlQuery(DbHandle,"INSERT OR REPLACE INTO UpdateOffset VALUES(0,?i)",
+             offset);
+    sqlQuery(DbHandle,"DELETE FROM PendingUpdates "
+                      "WHERE done=1 AND update_id<=?i", offset);
+    if (sqlQuery(DbHandle,"COMMIT")) Bot.committed = offset;
+    else sqlQuery(DbHandle,"ROLLBACK");
+}
+
+static int64_t botDispatchUpdates(const char *body, int64_t offset,
+                                  int resumed);
+
 /* Get the updates from the Telegram API, process them, and return the
  * ID of the highest processed update.
  *
@@ -668,7 +1014,19 @@ int64_t botProcessUpdates(int64_t offset, int timeout) {
     if (Bot.debug >= 2)
         printf("RECEIVED FROM TELEGRAM API:\n%s\n",body);
 
+    offset = botDispatchUpdates(body,offset,0);
+    sdsfree(body);
+    return offset;
+}
+
+/* Start the requests of the getUpdates reply 'body', and return the ID of
+ * the highest update in it, or 'offset' if higher. If 'resumed' is true
+ * the updates come from the PendingUpdates table. */
+static int64_t botDispatchUpdates(const char *body, int64_t offset,
+                                  int resumed) {
     /* Parse the JSON in order to extract the message info. */
+    BotRequest **reqs = NULL;
+    int numreqs = 0;
     cJSON *json = cJSON_Parse(body);
     cJSON *result = cJSON_Select(json,".result:a");
     if (result == NULL) goto fmterr;
@@ -725,19 +1083,15 @@ int64_t botProcessUpdates(int64_t offset, int timeout) {
         /* Sanity check the request before starting the thread:
          * validate that is a request that is really targeting our bot
          * list of "triggers". */
-        if (text && type != TB_TYPE_PRIVATE && Bot.triggers) {
+        if (text && type != TB_TYPE_PRIVATE && Bot.matcher) {
             char *s = text->valuestring;
-            int j;
-            for (j = 0; Bot.triggers[j]; j++) {
-                if (strmatch(Bot.triggers[j], strlen(Bot.triggers[j]),
-                    s, strlen(s), 1))
-                {
-                    break;
-                }
-            }
-            if (Bot.triggers[j] == NULL) continue; // No match.
+            if (!triggerMatch(Bot.matcher,s,strlen(s))) continue;
         }
-        if (time(NULL)-timestamp > 60*5) continue; // Ignore stale messages
+        /* Ignore stale messages. When replaying, all the messages are
+         * old, so this check is skipped, and so it is for the requests
+         * resumed after a restart. */
+        if (!Bot.replay_dir && !resumed && time(NULL)-timestamp > 60*5)
+            continue;
 
         /* At this point we are sure we are going to pass the request
          * to our callback. Prepare the request object. */
@@ -752,7 +1106,9 @@ int64_t botProcessUpdates(int64_t offset, int timeout) {
             br->file_type = TB_FILE_TYPE_VOICE_OGG;
             br->file_id = sdsnew(voice->valuestring);
             cJSON *size = cJSON_Select(msg,".voice.file_size:n");
+            cJSON *duration = cJSON_Select(msg,".voice.duration:n");
             br->file_size = size ? size->valuedouble : 0;
+            br->file_duration = duration ? duration->valuedouble : 0;
         }
 
         cJSON *audio = cJSON_Select(msg,".audio.file_id:s");
@@ -762,7 +1118,9 @@ int64_t botProcessUpdates(int64_t offset, int timeout) {
             cJSON *size = cJSON_Select(msg,".audio.file_size:n");
             cJSON *mime = cJSON_Select(msg,".audio.mime_type:s");
             cJSON *name = cJSON_Select(msg,".audio.file_name:s");
+            cJSON *duration = cJSON_Select(msg,".audio.duration:n");
             br->file_size = size ? size->valuedouble : 0;
+            br->file_duration = duration ? duration->valuedouble : 0;
             br->file_mime = mime ? sdsnew(mime->valuestring) : NULL;
             br->file_name = name ? sdsnew(name->valuestring) : NULL;
         }
@@ -792,7 +1150,8 @@ int64_t botProcessUpdates(int64_t offset, int timeout) {
                 if (off+len <= sdslen(br->request)) {
                     sds mention = sdsnewlen(br->request+off,len);
                     br->num_mentions++;
-                    br->mentions = xrealloc(br->mentions,br->num_mentions);
+                    br->mentions = xrealloc(br->mentions,
+                                           sizeof(sds)*br->num_mentions);
                     br->mentions[br->num_mentions-1] = mention;
                     /* Is the user addressing the bot? Set the flag. */
                     if (Bot.username && !strcmp(Bot.username,mention+1))
@@ -806,28 +1165,295 @@ int64_t botProcessUpdates(int64_t offset, int timeout) {
         br->from = from;
         br->target = target;
         br->msg_id = message_id;
+        br->update_id = thisoff;
+        if (!resumed && !botUpdateSave(update,thisoff)) {
+            freeBotRequest(br);
+            continue;
+        }
+        reqs = xrealloc(reqs,sizeof(BotRequest*)*(numreqs+1));
+        reqs[numreqs++] = br;
+    }
 
-        /* Spawn a thread that will handle the request. */
+    for (int j = 0; j < numreqs; j++) {
+        BotRequest *br = reqs[j];
+
+        /* Spawn a thread that will handle the request. Log before
+         * starting it: after that 'br' belongs to the thread. */
         botStats.queries++;
+        if (Bot.verbose)
+            printf("Starting thread to serve: \"%s\"\n",br->request);
+        atomic_fetch_add(&botStats.active,1);
         pthread_t tid;
         if (pthread_create(&tid,NULL,botHandleRequest,br) != 0) {
+            /* Left pending: it will be served after a restart. */
+            atomic_fetch_sub(&botStats.active,1);
             freeBotRequest(br);
             continue;
         }
         pthread_detach(tid);
-        if (Bot.verbose)
-            printf("Starting thread to serve: \"%s\"\n",br->request);
 
         /* It's up to the callback to free the bot request with
          * freeBotRequest(). */
     }
 
 fmterr:
+    xfree(reqs);
     cJSON_Delete(json);
-    sdsfree(body);
     return offset;
 }
 
+/* Serve again the requests saved and not done before a restart. */
+static void botResumeUpdates(void) {
+    sqlRow row;
+    int count = 0;
+    sds body = sdsnew("{\"ok\":true,\"result\":[");
+    sqlSelect(DbHandle,&row,"SELECT payload FROM PendingUpdates "
+                            "WHERE done=0 ORDER BY update_id");
+    while (sqlNextRow(&row)) {
+        if (count++) body = sdscatlen(body,",",1);
+        body = sdscatlen(body,row.col[0].s,row.col[0].i);
+    }
+    body = sdscat(body,"]}");
+    if (count) {
+        printf("Resuming %d requests in flight before the restart.\n",
+               count);
+        botDispatchUpdates(body,0,1);
+    }
+    sdsfree(body);
+}
+
+/* =============================================================================
+ * Traffic recording and replay
+ *
+ * With --record <dir> every raw getUpdates reply and every other API call
+ * (action and query string, without the API key) is appended to the file
+ * <dir>/traffic.log. Each record is an header line followed by the payload:
+ *
+ *  <unix time in ms> <U|C> <payload length>\n<payload>\n
+ *
+ * where U is a getUpdates reply and C an outgoing call.
+ *
+ * With --replay <dir> the bot never talks with Telegram: the recorded
+ * getUpdates replies are fed to botProcessUpdates() with the original
+ * timing, scaled by --replay-speed (0 means as fast as possible), while
+ * all the other API calls are answered by a stub. Files are "downloaded"
+ * as synthetic WAV files as long as the duration reported by Telegram.
+ * At the end of the log, once all the requests were served, dispatch
+ * throughput and latency are reported and the process exits.
+ * ===========================================================================*/
+
+#define TRAFFIC_LOG "traffic.log"
+
+static struct {
+    FILE *fp;               /* Log we are recording to or replaying. */
+    pthread_mutex_t lock;   /* Serializes records and latency samples. */
+    atomic_llong calls;     /* API calls answered by the stub. */
+    atomic_llong msgid;     /* Last message ID assigned by the stub. */
+    sds updates;            /* getUpdates reply the stub returns next. */
+    long long *latency;     /* Request latencies in microseconds. */
+    size_t numlat, latcap;
+} Traffic = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Open the traffic log in 'dir' for appending or reading. Exit on error. */
+void trafficOpen(const char *dir, int replay) {
+    if (!replay) mkdir(dir,0755);
+    sds path = sdscatprintf(sdsempty(),"%s/%s",dir,TRAFFIC_LOG);
+    Traffic.fp = fopen(path,replay ? "r" : "a");
+    if (Traffic.fp == NULL) {
+        fprintf(stderr,"Can't open %s: %s\n",path,strerror(errno));
+        exit(1);
+    }
+    sdsfree(path);
+}
+
+/* Append a record to the traffic log. */
+void recordTraffic(char type, const char *payload, size_t len) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME,&ts);
+    long long ms = ts.tv_sec*1000LL + ts.tv_nsec/1000000;
+
+    pthread_mutex_lock(&Traffic.lock);
+    fprintf(Traffic.fp,"%lld %c %zu\n",ms,type,len);
+    fwrite(payload,1,len,Traffic.fp);
+    fputc('\n',Traffic.fp);
+    fflush(Traffic.fp);
+    pthread_mutex_unlock(&Traffic.lock);
+}
+
+/* Read the next record of the traffic log. Return 1 on success, populating
+ * the arguments by reference (the payload must be freed by the caller),
+ * or 0 at the end of the log or if the log is corrupted. */
+int replayReadRecord(long long *ms, char *type, sds *payload) {
+    char hdr[128];
+    size_t len;
+    if (fgets(hdr,sizeof(hdr),Traffic.fp) == NULL) return 0;
+    if (sscanf(hdr,"%lld %c %zu",ms,type,&len) != 3) return 0;
+    *payload = sdsnewlen(NULL,len);
+    if (fread(*payload,1,len,Traffic.fp) != len || fgetc(Traffic.fp) != '\n') {
+        sdsfree(*payload);
+        return 0;
+    }
+    return 1;
+}
+
+/* Return the value of the option 'name' in the option list, or NULL. */
+static char *optionValue(char **optlist, int numopt, const char *name) {
+    for (int j = 0; j < numopt; j++)
+        if (!strcmp(optlist[j*2],name)) return optlist[j*2+1];
+    return NULL;
+}
+
+/* The stub transport used while replaying: it returns the current
+ * recorded getUpdates reply, and minimal successful replies for the
+ * other calls. */
+sds replayTransport(const char *action, char **optlist, int numopt) {
+    if (!strcmp(action,"getUpdates")) {
+        return Traffic.updates ? sdsdup(Traffic.updates) :
+                                 sdsnew("{\"ok\":true,\"result\":[]}");
+    }
+
+    atomic_fetch_add(&Traffic.calls,1);
+    if (Bot.debug) printf("REPLAY STUB %s\n", action);
+    if (!strcmp(action,"sendMessage")) {
+        char *chat_id = optionValue(optlist,numopt,"chat_id");
+        return sdscatprintf(sdsempty(),
+            "{\"ok\":true,\"result\":{\"message_id\":%lld,"
+            "\"chat\":{\"id\":%s}}}",
+            (long long)atomic_fetch_add(&Traffic.msgid,1)+1,
+            chat_id ? chat_id : "0");
+    } else if (!strcmp(action,"getMe")) {
+        return sdsnew("{\"ok\":true,\"result\":{\"username\":\"replay_bot\"}}");
+    } else if (!strcmp(action,"getFile")) {
+        return sdsnew("{\"ok\":true,\"result\":{\"file_path\":\"replay\"}}");
+    }
+    return sdsnew("{\"ok\":true,\"result\":true}");
+}
+
+/* Stub for botGetFile(): write a 16 kHz mono WAV file as long as the file
+ * duration Telegram reported (one second if unknown). The content is a
+ * 500 Hz triangle wave at about -25 dBFS: not silence, that would be
+ * rejected before transcription. */
+int replayGetFile(BotRequest *br, const char *filename) {
+    if (filename == NULL) filename = br->file_id;
+    FILE *fp = fopen(filename,"w");
+    if (fp == NULL) return 0;
+
+    uint32_t rate = 16000, datalen = rate*2*(br->file_duration ?
+                                             br->file_duration : 1);
+    unsigned char hdr[44] = "RIFF....WAVEfmt ";
+    uint32_t riff = datalen+36, fmtlen = 16, byterate = rate*2;
+    uint16_t pcm = 1, channels = 1, align = 2, bits = 16;
+    memcpy(hdr+4,&riff,4);
+    memcpy(hdr+16,&fmtlen,4);
+    memcpy(hdr+20,&pcm,2);
+    memcpy(hdr+22,&channels,2);
+    memcpy(hdr+24,&rate,4);
+    memcpy(hdr+28,&byterate,4);
+    memcpy(hdr+32,&align,2);
+    memcpy(hdr+34,&bits,2);
+    memcpy(hdr+36,"data",4);
+    memcpy(hdr+40,&datalen,4);
+    fwrite(hdr,1,sizeof(hdr),fp);
+
+    int16_t wave[32];
+    for (int j = 0; j < 32; j++)
+        wave[j] = (j < 16 ? j-8 : 24-j)*375;
+    while (datalen) {
+        size_t n = datalen < sizeof(wave) ? datalen : sizeof(wave);
+        fwrite(wave,1,n,fp);
+        datalen -= n;
+    }
+    return fclose(fp) == 0;
+}
+
+/* Called by request threads when they are done, while replaying, to
+ * collect the request latency. */
+void replayRequestDone(long long start_us) {
+    long long lat = ustime()-start_us;
+    pthread_mutex_lock(&Traffic.lock);
+    if (Traffic.numlat == Traffic.latcap) {
+        Traffic.latcap = Traffic.latcap ? Traffic.latcap*2 : 1024;
+        Traffic.latency = xrealloc(Traffic.latency,
+                                   sizeof(long long)*Traffic.latcap);
+    }
+    Traffic.latency[Traffic.numlat++] = lat;
+    pthread_mutex_unlock(&Traffic.lock);
+}
+
+static int cmpLongLong(const void *a, const void *b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+/* Sleep for the specified number of microseconds. */
+static void sleepUs(long long us) {
+    struct timespec ts = {us/1000000, (us%1000000)*1000};
+    while (nanosleep(&ts,&ts) == -1 && errno == EINTR);
+}
+
+/* Replay the traffic log, see the top comment of this section. */
+void botReplay(void) {
+    long long start = ustime(), first_ms = -1, ms;
+    long long batches = 0, recorded_calls = 0;
+    long long dispatch_total = 0, dispatch_max = 0;
+    int64_t offset = 0;
+    char type;
+    sds payload;
+
+    while (replayReadRecord(&ms,&type,&payload)) {
+        if (type != 'U') {
+            recorded_calls++;
+            sdsfree(payload);
+            continue;
+        }
+
+        /* Wait for the moment this reply arrived, relative to the first
+         * one, at the requested speed. */
+        if (first_ms == -1) first_ms = ms;
+        if (Bot.replay_speed > 0) {
+            long long due = start + (ms-first_ms)*1000/Bot.replay_speed;
+            long long now = ustime();
+            if (due > now) sleepUs(due-now);
+        }
+
+        Traffic.updates = payload;
+        long long t = ustime();
+        offset = botProcessUpdates(offset,0);
+        botCommitOffset(offset);
+        t = ustime()-t;
+        Traffic.updates = NULL;
+        sdsfree(payload);
+
+        dispatch_total += t;
+        if (t > dispatch_max) dispatch_max = t;
+        batches++;
+        if (Bot.cron_callback) Bot.cron_callback(DbHandle);
+    }
+
+    /* Wait for the requests still being served. */
+    while (atomic_load(&botStats.active)) sleepUs(10000);
+    double elapsed = (ustime()-start)/1e6;
+
+    printf("Replay: %lld getUpdates replies, %llu requests in %.3f seconds "
+           "(%.1f requests/sec)\n", batches,
+           (unsigned long long)botStats.queries, elapsed,
+           elapsed > 0 ? botStats.queries/elapsed : 0);
+    printf("Replay: dispatch latency avg %.1f us, max %lld us\n",
+           batches ? (double)dispatch_total/batches : 0, dispatch_max);
+    if (Traffic.numlat) {
+        long long *l = Traffic.latency;
+        size_t n = Traffic.numlat;
+        qsort(l,n,sizeof(long long),cmpLongLong);
+        printf("Replay: request latency p50 %.1f ms, p90 %.1f ms, "
+               "p99 %.1f ms, max %.1f ms\n",
+               l[n*50/100]/1e3, l[n*90/100]/1e3, l[n*99/100]/1e3,
+               l[n-1]/1e3);
+    }
+    printf("Replay: %lld API calls (%lld in the recorded log)\n",
+           (long long)atomic_load(&Traffic.calls), recorded_calls);
+    exit(0);
+}
+
 /* =============================================================================
  * Bot main loop
  * ===========================================================================*/
@@ -837,19 +1463,37 @@ fmterr:
  * time we unblock, we check for completed requests (by the thread that
  * handles Yahoo Finance API calls). */
 void botMain(void) {
-    int64_t nextid = -100; /* Start getting the last 100 messages. */
+    int64_t nextid = botLoadOffset();
     int previd;
+    time_t last_release = time(NULL);
 
     botGetUsername(); // Will cache Bot.username as side effect.
+    if (Bot.replay_dir && !(Bot.flags & TB_FLAGS_NO_UPDATES)) {
+        botReplay();
+        return;
+    }
+    if (!(Bot.flags & TB_FLAGS_NO_UPDATES)) botResumeUpdates();
     while(1) {
-        previd = nextid;
-        nextid = botProcessUpdates(nextid,1);
-        /* We don't want to saturate all the CPU in a busy loop in case
-         * the above call fails and returns immediately (for networking
-         * errors for instance), so wait a bit at every cycle, but only
-         * if we didn't made any progresses with the ID. */
-        if (nextid == previd) usleep(100000);
+        if (Bot.flags & TB_FLAGS_NO_UPDATES) {
+            usleep(100000);
+        } else {
+            previd = nextid;
+            nextid = botProcessUpdates(nextid,1);
+            botCommitOffset(nextid);
+            /* We don't want to saturate all the CPU in a busy loop in
+             * case the above call fails and returns immediately (for
+             * networking errors for instance), so wait a bit at every
+             * cycle, but only if we didn't made any progresses with
+             * the ID. */
+            if (nextid == previd) usleep(100000);
+        }
         if (Bot.cron_callback) Bot.cron_callback(DbHandle);
+
+        /* Give back to the OS memory freed by the request threads. */
+        if (time(NULL)-last_release >= 60) {
+            xmallocRelease();
+            last_release = time(NULL);
+        }
     }
 }
 
@@ -882,10 +1526,16 @@ int startBot(char *createdb_query, int argc, char **argv, int flags, TBRequestCa
     Bot.debug = 0;
     Bot.verbose = 0;
     Bot.dbfile = "./mybot.sqlite";
+    Bot.arenas = XMALLOC_DEFAULT_ARENAS;
+    Bot.record_dir = NULL;
+    Bot.replay_dir = NULL;
+    Bot.replay_speed = 1;
     Bot.triggers = triggers;
+    Bot.matcher = NULL;
     Bot.apikey = NULL;
     Bot.req_callback = req_callback;
     Bot.cron_callback = cron_callback;
+    Bot.flags = flags;
 
     /* Parse options. */
     for (int j = 1; j < argc; j++) {
@@ -899,10 +1549,19 @@ int startBot(char *createdb_query, int argc, char **argv, int flags, TBRequestCa
             Bot.apikey = sdsnew(argv[++j]);
         } else if (!strcmp(argv[j],"--dbfile") && morearg) {
             Bot.dbfile = argv[++j];
+        } else if (!strcmp(argv[j],"--malloc-arenas") && morearg) {
+            Bot.arenas = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--record") && morearg) {
+            Bot.record_dir = argv[++j];
+        } else if (!strcmp(argv[j],"--replay") && morearg) {
+            Bot.replay_dir = argv[++j];
+        } else if (!strcmp(argv[j],"--replay-speed") && morearg) {
+            Bot.replay_speed = atof(argv[++j]);
         } else if (!(flags & TB_FLAGS_IGNORE_BAD_ARG)) {
             printf(
             "Usage: %s [--apikey <apikey>] [--debug] [--verbose] "
-            "[--dbfile <filename>]"
+            "[--dbfile <filename>] [--malloc-arenas <count>] "
+            "[--record <dir>] [--replay <dir>] [--replay-speed <factor>]"
             "\n",argv[0]);
             exit(1);
         }
@@ -910,9 +1569,16 @@ int startBot(char *createdb_query, int argc, char **argv, int flags, TBRequestCa
 
     /* Initializations. Note that we don't redefine the SQLite allocator,
      * since SQLite errors are always handled by Stonky anyway. */
+    xmallocInit(Bot.arenas);
     curl_global_init(CURL_GLOBAL_DEFAULT);
+    if (Bot.record_dir && Bot.replay_dir) {
+        printf("--record and --replay can't be used together.\n");
+        exit(1);
+    }
+    if (Bot.record_dir) trafficOpen(Bot.record_dir,0);
+    if (Bot.replay_dir) trafficOpen(Bot.replay_dir,1);
     if (Bot.apikey == NULL) readApiKeyFromFile();
-    if (Bot.apikey == NULL) {
+    if (Bot.apikey == NULL && !Bot.replay_dir) {
         printf("Provide a bot API key via --apikey or storing a file named "
                "apikey.txt in the bot working directory.\n");
         exit(1);
@@ -920,8 +1586,11 @@ int startBot(char *createdb_query, int argc, char **argv, int flags, TBRequestCa
     resetBotStats();
     DbHandle = dbInit(createdb_query);
     if (DbHandle == NULL) exit(1);
+    if (!sqlQuery(DbHandle,TB_CREATE_OFFSET_TABLE)) exit(1);
+    if (!sqlQuery(DbHandle,TB_CREATE_PENDING_TABLE)) exit(1);
     cJSON_Hooks jh = {.malloc_fn = xmalloc, .free_fn = xfree};
     cJSON_InitHooks(&jh);
+    if (triggers) Bot.matcher = triggerCompile(triggers);
 
     /* Enter the infinite loop handling the bot. */
     botMain();
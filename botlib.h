@@ -10,9 +10,14 @@
 #include "sds.h"
 #include "sqlite_wrap.h"
 #include "cJSON.h"
+#include "xmalloc.h"
 
 #define TB_FLAGS_NONE 0
 #define TB_FLAGS_IGNORE_BAD_ARG (1<<0)
+#define TB_FLAGS_NO_UPDATES (1<<1)  /* Don't poll Telegram: just call the
+                                       cron callback ten times per second.
+                                       For processes serving requests
+                                       received by another process. */
 
 /* This structure is passed to the thread processing a given user request,
  * it's up to the thread to free it once it is done. */
@@ -23,6 +28,8 @@ typedef struct BotRequest {
     sds from_username;  /* Username of the user sending the message. */
     int64_t target;     /* Target channel/user where to reply. */
     int64_t msg_id;     /* Message ID. */
+    int64_t update_id;  /* Telegram update carrying the message, 0 if the
+                           request doesn't come from an update. */
     sds *argv;          /* Request split to single words. */
     int argc;           /* Number of words. */
     int file_type;      /* TB_FILE_TYPE_* */
@@ -31,6 +38,8 @@ typedef struct BotRequest {
     sds file_name;      /* Original file name, if available. */
     sds file_mime;      /* MIME type, if available. */
     int64_t file_size;  /* Size of the file. */
+    int file_duration;  /* Duration in seconds of voice / audio files as
+                           reported by Telegram, or 0 if unknown. */
     int bot_mentioned;  /* True if the bot was explicitly mentioned. */
     sds *mentions;      /* List of mentioned usernames. NULL if there
                            are no mentions. */
@@ -64,12 +73,21 @@ typedef void (*TBCronCallback)(sqlite3 *dbhandle);
     "CREATE UNIQUE INDEX IF NOT EXISTS idx_kv_key ON KeyValue(key);" \
     "CREATE INDEX IF NOT EXISTS idx_ex_key ON KeyValue(expire);"
 
-/* Allocation. */
-void *xmalloc(size_t size);
-void *xrealloc(void *ptr, size_t size);
-void xfree(void *ptr);
+/* Allocation: see xmalloc.h. */
+
+/* Utils. */
+long long ustime(void);
+int strmatch(const char *pattern, int patternLen,
+             const char *string, int stringLen, int nocase);
+
+/* Triggers. */
+typedef struct triggerSet triggerSet;
+triggerSet *triggerCompile(char **triggers);
+int triggerMatch(triggerSet *ts, const char *s, size_t len);
+void triggerFree(triggerSet *ts);
 
 /* HTTP */
+sds makeHTTPURL(const char *url, char **optlist, int optnum);
 sds makeHTTPGETCallOpt(const char *url, int *resptr, char **optlist, int optnum);
 sds makeHTTPGETCall(const char *url, int *resptr);
 
@@ -83,9 +101,11 @@ int botEditMessageText(int64_t chat_id, int message_id, sds text);
 int botSendImage(int64_t target, char *filename);
 int botGetFile(BotRequest *br, const char *target_filename);
 char *botGetUsername(void);
+BotRequest *createBotRequest(void);
 void freeBotRequest(BotRequest *br);
 
 /* Database. */
+sqlite3 *dbInit(char *createdb_query);
 int kvSetLen(sqlite3 *dbhandle, const char *key, const char *value, size_t vlen, int64_t expire);
 int kvSet(sqlite3 *dbhandle, const char *key, const char *value, int64_t expire);
 sds kvGet(sqlite3 *dbhandle, const char *key);
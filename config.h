@@ -0,0 +1,88 @@
+#ifndef WHISPERBOT_CONFIG_H
+#define WHISPERBOT_CONFIG_H
+
+/* Configuration. */
+#define MAX_SECONDS 900
+#define MSG_LIMIT 4000
+#define TIMEOUT_BASE 60            /* Whisper runs are killed after */
+#define TIMEOUT_RTF_MARGIN 3.0     /* base + margin * expected seconds. */
+#define STALL_SECONDS 60           /* Kill whisper if silent this long */
+#define STALL_MIN_CPU 1.0          /* and using less CPU seconds than this. */
+#define WHISPER_RETRIES 2          /* Resume failed runs this many times. */
+#define WHISPER_PATH "/app/build/bin/whisper-cli"
+#define SHORT_AUDIO_THRESHOLD 1.5  /* Seconds. Below this, use DEFAULT_LANG. */
+#define DEFAULT_LANG "it"          /* Language for short audio. */
+
+/* Admission and model selection are based on the work in flight, in
+ * audio seconds and estimated compute seconds, see sched.c. */
+#define MODEL_BASE "/app/models/ggml-base.bin"
+#define MODEL_MEDIUM "/app/models/ggml-medium.bin"
+#define MAX_QUEUE 50            /* Max jobs in flight, just a safety limit. */
+#define MAX_QUEUE_AUDIO 3600    /* Max audio seconds in flight. */
+#define MEDIUM_MAX_COMPUTE 240  /* Use the base model above this backlog. */
+#define BASE_MAX_COMPUTE 360    /* Refuse jobs above this backlog. */
+#define SLA_SECONDS 300         /* Refuse jobs not expected to finish */
+#define SLA_RTF 1.0             /* within SLA_SECONDS + SLA_RTF * duration. */
+#define EDIT_INTERVAL_MS 500    /* Min ms between message edits. */
+
+/* Long jobs are transcribed in chunks, and between chunks the slot goes
+ * to the waiting job with the least audio left, see sched.c. */
+#define CHUNK_SECONDS 120       /* Audio seconds per chunk. */
+#define SCHED_AGING 1.0         /* Priority gained per second of waiting. */
+#define PROMPT_CHARS 200        /* Transcript tail passed to the next chunk
+                                   as prompt, to keep the context. */
+
+/* Before transcribing long audio with the medium model, the first seconds
+ * are transcribed with the base model and shown as a preview. */
+#define PREVIEW_MIN_SECONDS 40  /* Only for audio at least this long. */
+#define PREVIEW_SECONDS 8       /* Length of the preview. */
+
+/* Remote workers, see worker.c. Each worker runs as many whisper
+ * processes at once as the slots it advertises; the bot itself is a
+ * worker with LOCAL_SLOTS slots. */
+#define LOCAL_SLOTS 1
+#define MAX_WORKERS 16
+#define WORKER_PROBE_SECONDS 10     /* Probe workers down this often. */
+#define WORKER_CONNECT_MS 2000      /* Connection and greeting timeout. */
+#define WORKER_FAILOVERS 3          /* Move a job this many times. */
+#define WORKER_MAX_WAV_MB 64        /* Largest audio a worker accepts. */
+#define WORKER_BIND "127.0.0.1"     /* Default --worker-bind address. */
+
+/* Split deployment, see jobs.c: an ingest process queues the jobs in the
+ * database, and transcriber processes claim them with a lease. */
+#define JOB_LEASE_SECONDS 60        /* Reclaim jobs not renewed this long. */
+#define JOB_HEARTBEAT_SECONDS 10    /* Transcribers renew leases this often. */
+#define JOB_MAX_ATTEMPTS 3          /* Give up on jobs claimed this often. */
+
+/* Quotas in audio seconds. Buckets refill continuously, from empty to
+ * full in QUOTA_WINDOW seconds. The chat quota applies to groups. */
+#define QUOTA_WINDOW 3600
+#define USER_QUOTA 1800
+#define CHAT_QUOTA 3600
+#define QUOTA_PERSIST_SECONDS 60    /* Save quotas to the DB this often. */
+
+/* Completion time estimates shown to queued jobs, see eta.c. */
+#define ETA_RTF_BASE 0.1        /* Real time factors assumed before we */
+#define ETA_RTF_MEDIUM 0.4      /* learn them from actual jobs. */
+#define ETA_PRIOR_SECONDS 60    /* Weight of the above, audio seconds. */
+#define ETA_DECAY 0.98          /* Decay of old figures, per chunk. */
+#define ETA_REFRESH_MS 5000     /* Recompute the estimates this often. */
+#define ETA_MIN_CHANGE 30       /* Edit the status only if the estimate */
+#define ETA_CHANGE_RATIO 0.2    /* changes by both these seconds and
+                                   this fraction. */
+
+/* Intermediate audio files live in memory (memfd). The spool directory is
+ * only used if --spool is given or memfds are not available. */
+#define SPOOL_DIR "/dev/shm"
+#define SPOOL_MAX_MB 512        /* Refuse new jobs above this usage. */
+
+/* Audio analysis before queueing. Levels are dBFS. */
+#define SILENCE_RMS_DB -50.0    /* Quieter than this: no speech. */
+#define SPEECH_MIN_RATIO 0.05   /* Less energy than this in the speech band:
+                                   no speech. */
+#define QUIET_RMS_DB -30.0      /* Normalize audio quieter than this... */
+#define TARGET_RMS_DB -20.0     /* ...to this level... */
+#define MAX_GAIN_DB 30.0        /* ...with at most this gain, keeping the
+                                   peak below -1 dBFS. */
+
+#endif
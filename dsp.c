@@ -0,0 +1,664 @@
+/* ============================================================================
+ * Audio DSP kernels: sample format conversion, downmix to mono and a
+ * polyphase resampler, used to produce the 16 kHz mono PCM whisper wants
+ * without running ffmpeg, plus level analysis and gain.
+ *
+ * Every kernel has a scalar reference implementation, plus SSE2 and AVX2
+ * versions on x86-64 and a NEON version on ARM64. The best implementation
+ * the CPU supports is selected at runtime (AVX2 kernels are compiled with
+ * the target attribute, so no special build flags are needed), and can be
+ * forced with dspSetImpl(), which is how wbbench compares them.
+ * ==========================================================================*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "dsp.h"
+#include "xmalloc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DSP_X86
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DSP_NEON
+#endif
+
+#define S16_SCALE (1.0f/32768)
+#define RESAMPLER_HALF_TAPS 16      /* Per side, at the lowest rate. */
+#define RESAMPLER_ROLLOFF 0.92      /* Cutoff as fraction of Nyquist. */
+#define RESAMPLER_KAISER_BETA 8.6   /* About 90 dB of stopband. */
+#define CLIP_LEVEL 0.999f           /* Samples at or above are clipped. */
+#define SPEECH_TAPS 64              /* Speech band filter length. */
+#define SPEECH_LOW_HZ 300
+#define SPEECH_HIGH_HZ 3400
+#define SPEECH_DECIMATION 4         /* Filter one sample every N. */
+#define ANALYSIS_BLOCK 4096
+
+typedef struct dspKernels {
+    const char *name;
+    int (*supported)(void);
+    float (*dot)(const float *a, const float *b, int n);
+    void (*s16tof)(const int16_t *in, float *out, size_t n);
+    void (*stereo)(const int16_t *in, float *out, size_t frames);
+    void (*ftos16)(const float *in, int16_t *out, size_t n);
+    void (*stats)(const float *x, size_t n, float *sumsq, float *peak,
+                  float *clipped);
+} dspKernels;
+
+static int alwaysSupported(void) {
+    return 1;
+}
+
+/* ----------------------------- Scalar reference -------------------------- */
+
+static float dotScalar(const float *a, const float *b, int n) {
+    float s = 0;
+    for (int i = 0; i < n; i++) s += a[i]*b[i];
+    return s;
+}
+
+static void s16tofScalar(const int16_t *in, float *out, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = in[i]*S16_SCALE;
+}
+
+static void stereoScalar(const int16_t *in, float *out, size_t frames) {
+    for (size_t i = 0; i < frames; i++)
+        out[i] = ((int32_t)in[i*2]+in[i*2+1])*(S16_SCALE*0.5f);
+}
+
+static int16_t floatToS16(float x) {
+    float v = x*32768;
+    if (v >= 32767) return 32767;
+    if (v <= -32768) return -32768;
+    return (int16_t)(v >= 0 ? v+0.5f : v-0.5f);
+}
+
+static void ftos16Scalar(const float *in, int16_t *out, size_t n) {
+    for (size_t i = 0; i < n; i++) out[i] = floatToS16(in[i]);
+}
+
+/* Sum of squares, peak and number of clipped samples. The results are
+ * accumulated into the output arguments. */
+static void statsScalar(const float *x, size_t n, float *sumsq, float *peak,
+                        float *clipped)
+{
+    float s = 0, p = *peak, c = 0;
+    for (size_t i = 0; i < n; i++) {
+        float a = x[i] < 0 ? -x[i] : x[i];
+        s += x[i]*x[i];
+        if (a > p) p = a;
+        if (a >= CLIP_LEVEL) c++;
+    }
+    *sumsq += s;
+    *peak = p;
+    *clipped += c;
+}
+
+/* ---------------------------------- x86 ---------------------------------- */
+
+#ifdef DSP_X86
+static float dotSSE2(const float *a, const float *b, int n) {
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i+8 <= n; i += 8) {
+        s0 = _mm_add_ps(s0,_mm_mul_ps(_mm_loadu_ps(a+i),_mm_loadu_ps(b+i)));
+        s1 = _mm_add_ps(s1,_mm_mul_ps(_mm_loadu_ps(a+i+4),
+                                      _mm_loadu_ps(b+i+4)));
+    }
+    s0 = _mm_add_ps(s0,s1);
+    s0 = _mm_add_ps(s0,_mm_movehl_ps(s0,s0));
+    s0 = _mm_add_ss(s0,_mm_shuffle_ps(s0,s0,1));
+    float s = _mm_cvtss_f32(s0);
+    for (; i < n; i++) s += a[i]*b[i];
+    return s;
+}
+
+static void s16tofSSE2(const int16_t *in, float *out, size_t n) {
+    const __m128 scale = _mm_set1_ps(S16_SCALE);
+    size_t i = 0;
+    for (; i+8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(in+i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x,x),16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x,x),16);
+        _mm_storeu_ps(out+i,_mm_mul_ps(_mm_cvtepi32_ps(lo),scale));
+        _mm_storeu_ps(out+i+4,_mm_mul_ps(_mm_cvtepi32_ps(hi),scale));
+    }
+    s16tofScalar(in+i,out+i,n-i);
+}
+
+static void stereoSSE2(const int16_t *in, float *out, size_t frames) {
+    const __m128 scale = _mm_set1_ps(S16_SCALE*0.5f);
+    const __m128i ones = _mm_set1_epi16(1);
+    size_t i = 0;
+    for (; i+4 <= frames; i += 4) {
+        /* Multiply-add by one sums the left and right of each frame. */
+        __m128i x = _mm_loadu_si128((const __m128i*)(in+i*2));
+        __m128i sum = _mm_madd_epi16(x,ones);
+        _mm_storeu_ps(out+i,_mm_mul_ps(_mm_cvtepi32_ps(sum),scale));
+    }
+    stereoScalar(in+i*2,out+i,frames-i);
+}
+
+static void ftos16SSE2(const float *in, int16_t *out, size_t n) {
+    const __m128 scale = _mm_set1_ps(32768);
+    const __m128 max = _mm_set1_ps(32767), min = _mm_set1_ps(-32768);
+    size_t i = 0;
+    for (; i+8 <= n; i += 8) {
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(in+i),scale);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(in+i+4),scale);
+        a = _mm_min_ps(_mm_max_ps(a,min),max);
+        b = _mm_min_ps(_mm_max_ps(b,min),max);
+        __m128i p = _mm_packs_epi32(_mm_cvtps_epi32(a),_mm_cvtps_epi32(b));
+        _mm_storeu_si128((__m128i*)(out+i),p);
+    }
+    ftos16Scalar(in+i,out+i,n-i);
+}
+
+static void statsSSE2(const float *x, size_t n, float *sumsq, float *peak,
+                      float *clipped)
+{
+    const __m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 clip = _mm_set1_ps(CLIP_LEVEL), one = _mm_set1_ps(1);
+    __m128 s = _mm_setzero_ps(), p = _mm_set1_ps(*peak);
+    __m128 c = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i+4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(x+i);
+        __m128 a = _mm_and_ps(v,absmask);
+        s = _mm_add_ps(s,_mm_mul_ps(v,v));
+        p = _mm_max_ps(p,a);
+        c = _mm_add_ps(c,_mm_and_ps(_mm_cmpge_ps(a,clip),one));
+    }
+    float vs[4], vp[4], vc[4];
+    _mm_storeu_ps(vs,s);
+    _mm_storeu_ps(vp,p);
+    _mm_storeu_ps(vc,c);
+    for (int j = 0; j < 4; j++) {
+        *sumsq += vs[j];
+        if (vp[j] > *peak) *peak = vp[j];
+        *clipped += vc[j];
+    }
+    statsScalar(x+i,n-i,sumsq,peak,clipped);
+}
+
+static int avx2Supported(void) {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+#define AVX2 __attribute__((target("avx2,fma")))
+
+AVX2 static float dotAVX2(const float *a, const float *b, int n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i+16 <= n; i += 16) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i),_mm256_loadu_ps(b+i),s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i+8),_mm256_loadu_ps(b+i+8),
+                             s1);
+    }
+    for (; i+8 <= n; i += 8)
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a+i),_mm256_loadu_ps(b+i),s0);
+    s0 = _mm256_add_ps(s0,s1);
+    __m128 h = _mm_add_ps(_mm256_castps256_ps128(s0),
+                          _mm256_extractf128_ps(s0,1));
+    h = _mm_add_ps(h,_mm_movehl_ps(h,h));
+    h = _mm_add_ss(h,_mm_shuffle_ps(h,h,1));
+    float s = _mm_cvtss_f32(h);
+    for (; i < n; i++) s += a[i]*b[i];
+    return s;
+}
+
+AVX2 static void s16tofAVX2(const int16_t *in, float *out, size_t n) {
+    const __m256 scale = _mm256_set1_ps(S16_SCALE);
+    size_t i = 0;
+    for (; i+16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(in+i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(in+i+8));
+        __m256 fa = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(a));
+        __m256 fb = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(b));
+        _mm256_storeu_ps(out+i,_mm256_mul_ps(fa,scale));
+        _mm256_storeu_ps(out+i+8,_mm256_mul_ps(fb,scale));
+    }
+    s16tofScalar(in+i,out+i,n-i);
+}
+
+AVX2 static void stereoAVX2(const int16_t *in, float *out, size_t frames) {
+    const __m256 scale = _mm256_set1_ps(S16_SCALE*0.5f);
+    const __m256i ones = _mm256_set1_epi16(1);
+    size_t i = 0;
+    for (; i+8 <= frames; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(in+i*2));
+        __m256i sum = _mm256_madd_epi16(x,ones);
+        _mm256_storeu_ps(out+i,_mm256_mul_ps(_mm256_cvtepi32_ps(sum),scale));
+    }
+    stereoScalar(in+i*2,out+i,frames-i);
+}
+
+AVX2 static void ftos16AVX2(const float *in, int16_t *out, size_t n) {
+    const __m256 scale = _mm256_set1_ps(32768);
+    const __m256 max = _mm256_set1_ps(32767), min = _mm256_set1_ps(-32768);
+    size_t i = 0;
+    for (; i+16 <= n; i += 16) {
+        __m256 a = _mm256_mul_ps(_mm256_loadu_ps(in+i),scale);
+        __m256 b = _mm256_mul_ps(_mm256_loadu_ps(in+i+8),scale);
+        a = _mm256_min_ps(_mm256_max_ps(a,min),max);
+        b = _mm256_min_ps(_mm256_max_ps(b,min),max);
+        /* The pack works per 128 bit lane, so fix the order after. */
+        __m256i p = _mm256_packs_epi32(_mm256_cvtps_epi32(a),
+                                       _mm256_cvtps_epi32(b));
+        p = _mm256_permute4x64_epi64(p,0xd8);
+        _mm256_storeu_si256((__m256i*)(out+i),p);
+    }
+    ftos16Scalar(in+i,out+i,n-i);
+}
+
+AVX2 static void statsAVX2(const float *x, size_t n, float *sumsq,
+                           float *peak, float *clipped)
+{
+    const __m256 absmask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 clip = _mm256_set1_ps(CLIP_LEVEL), one = _mm256_set1_ps(1);
+    __m256 s = _mm256_setzero_ps(), p = _mm256_set1_ps(*peak);
+    __m256 c = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i+8 <= n; i += 8) {
+        __m256 v = _mm256_loadu_ps(x+i);
+        __m256 a = _mm256_and_ps(v,absmask);
+        s = _mm256_fmadd_ps(v,v,s);
+        p = _mm256_max_ps(p,a);
+        c = _mm256_add_ps(c,_mm256_and_ps(_mm256_cmp_ps(a,clip,_CMP_GE_OQ),
+                                          one));
+    }
+    float vs[8], vp[8], vc[8];
+    _mm256_storeu_ps(vs,s);
+    _mm256_storeu_ps(vp,p);
+    _mm256_storeu_ps(vc,c);
+    for (int j = 0; j < 8; j++) {
+        *sumsq += vs[j];
+        if (vp[j] > *peak) *peak = vp[j];
+        *clipped += vc[j];
+    }
+    statsScalar(x+i,n-i,sumsq,peak,clipped);
+}
+#endif
+
+/* ---------------------------------- NEON --------------------------------- */
+
+#ifdef DSP_NEON
+static float dotNEON(const float *a, const float *b, int n) {
+    float32x4_t s0 = vdupq_n_f32(0), s1 = vdupq_n_f32(0);
+    int i = 0;
+    for (; i+8 <= n; i += 8) {
+        s0 = vfmaq_f32(s0,vld1q_f32(a+i),vld1q_f32(b+i));
+        s1 = vfmaq_f32(s1,vld1q_f32(a+i+4),vld1q_f32(b+i+4));
+    }
+    float s = vaddvq_f32(vaddq_f32(s0,s1));
+    for (; i < n; i++) s += a[i]*b[i];
+    return s;
+}
+
+static void s16tofNEON(const int16_t *in, float *out, size_t n) {
+    size_t i = 0;
+    for (; i+8 <= n; i += 8) {
+        int16x8_t x = vld1q_s16(in+i);
+        float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(x)));
+        float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(x)));
+        vst1q_f32(out+i,vmulq_n_f32(lo,S16_SCALE));
+        vst1q_f32(out+i+4,vmulq_n_f32(hi,S16_SCALE));
+    }
+    s16tofScalar(in+i,out+i,n-i);
+}
+
+static void stereoNEON(const int16_t *in, float *out, size_t frames) {
+    size_t i = 0;
+    for (; i+4 <= frames; i += 4) {
+        int32x4_t sum = vpaddlq_s16(vld1q_s16(in+i*2));
+        vst1q_f32(out+i,vmulq_n_f32(vcvtq_f32_s32(sum),S16_SCALE*0.5f));
+    }
+    stereoScalar(in+i*2,out+i,frames-i);
+}
+
+static void ftos16NEON(const float *in, int16_t *out, size_t n) {
+    const float32x4_t max = vdupq_n_f32(32767), min = vdupq_n_f32(-32768);
+    size_t i = 0;
+    for (; i+8 <= n; i += 8) {
+        float32x4_t a = vmulq_n_f32(vld1q_f32(in+i),32768);
+        float32x4_t b = vmulq_n_f32(vld1q_f32(in+i+4),32768);
+        a = vminq_f32(vmaxq_f32(a,min),max);
+        b = vminq_f32(vmaxq_f32(b,min),max);
+        int16x8_t p = vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(a)),
+                                   vqmovn_s32(vcvtnq_s32_f32(b)));
+        vst1q_s16(out+i,p);
+    }
+    ftos16Scalar(in+i,out+i,n-i);
+}
+
+static void statsNEON(const float *x, size_t n, float *sumsq, float *peak,
+                      float *clipped)
+{
+    const float32x4_t clip = vdupq_n_f32(CLIP_LEVEL), one = vdupq_n_f32(1);
+    float32x4_t s = vdupq_n_f32(0), p = vdupq_n_f32(*peak);
+    float32x4_t c = vdupq_n_f32(0);
+    size_t i = 0;
+    for (; i+4 <= n; i += 4) {
+        float32x4_t v = vld1q_f32(x+i);
+        float32x4_t a = vabsq_f32(v);
+        s = vfmaq_f32(s,v,v);
+        p = vmaxq_f32(p,a);
+        c = vaddq_f32(c,vbslq_f32(vcgeq_f32(a,clip),one,vdupq_n_f32(0)));
+    }
+    *sumsq += vaddvq_f32(s);
+    *peak = vmaxvq_f32(p);
+    *clipped += vaddvq_f32(c);
+    statsScalar(x+i,n-i,sumsq,peak,clipped);
+}
+#endif
+
+/* ------------------------------- Dispatch -------------------------------- */
+
+/* Ordered from the slowest to the fastest. */
+static dspKernels Kernels[] = {
+    {"scalar", alwaysSupported, dotScalar, s16tofScalar, stereoScalar,
+     ftos16Scalar, statsScalar},
+#ifdef DSP_X86
+    {"sse2", alwaysSupported, dotSSE2, s16tofSSE2, stereoSSE2, ftos16SSE2,
+     statsSSE2},
+    {"avx2", avx2Supported, dotAVX2, s16tofAVX2, stereoAVX2, ftos16AVX2,
+     statsAVX2},
+#endif
+#ifdef DSP_NEON
+    {"neon", alwaysSupported, dotNEON, s16tofNEON, stereoNEON, ftos16NEON,
+     statsNEON},
+#endif
+};
+
+#define NUM_KERNELS (sizeof(Kernels)/sizeof(Kernels[0]))
+
+static dspKernels *K = NULL;
+static const char *SupportedImpls[NUM_KERNELS+1];
+static pthread_once_t KernelsOnce = PTHREAD_ONCE_INIT;
+
+static void dspInit(void) {
+    int n = 0;
+    for (size_t j = 0; j < NUM_KERNELS; j++) {
+        if (!Kernels[j].supported()) continue;
+        SupportedImpls[n++] = Kernels[j].name;
+        K = Kernels+j;
+    }
+    SupportedImpls[n] = NULL;
+}
+
+static dspKernels *kernels(void) {
+    pthread_once(&KernelsOnce,dspInit);
+    return K;
+}
+
+/* Name of the implementation in use. */
+const char *dspImplName(void) {
+    return kernels()->name;
+}
+
+/* NULL terminated list of the implementations this CPU supports. */
+const char **dspImpls(void) {
+    kernels();
+    return SupportedImpls;
+}
+
+/* Use the implementation 'name'. Not thread safe: meant for benchmarks and
+ * tests, before any processing. Returns 0 on success, -1 if the
+ * implementation is unknown or not supported by the CPU. */
+int dspSetImpl(const char *name) {
+    kernels();
+    for (size_t j = 0; j < NUM_KERNELS; j++) {
+        if (strcmp(Kernels[j].name,name) || !Kernels[j].supported())
+            continue;
+        K = Kernels+j;
+        return 0;
+    }
+    return -1;
+}
+
+/* ---------------------------- Format conversion -------------------------- */
+
+/* Convert 'n' int16 samples to floats in [-1, 1). */
+void dspS16ToFloat(const int16_t *in, float *out, size_t n) {
+    kernels()->s16tof(in,out,n);
+}
+
+/* Convert 'frames' int16 frames of 'channels' interleaved channels to mono
+ * floats, averaging the channels. */
+void dspS16ToMono(const int16_t *in, int channels, float *out,
+                  size_t frames)
+{
+    if (channels == 1) {
+        kernels()->s16tof(in,out,frames);
+    } else if (channels == 2) {
+        kernels()->stereo(in,out,frames);
+    } else {
+        float scale = S16_SCALE/channels;
+        for (size_t i = 0; i < frames; i++) {
+            int32_t sum = 0;
+            for (int c = 0; c < channels; c++) sum += in[i*channels+c];
+            out[i] = sum*scale;
+        }
+    }
+}
+
+/* Convert 'n' floats to int16 samples, rounding to nearest and clipping. */
+void dspFloatToS16(const float *in, int16_t *out, size_t n) {
+    kernels()->ftos16(in,out,n);
+}
+
+/* ------------------------------- Resampler ------------------------------- */
+
+static int gcd(int a, int b) {
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Zeroth order modified Bessel function, for the Kaiser window. */
+static double besselI0(double x) {
+    double sum = 1, term = 1;
+    for (int k = 1; k < 50; k++) {
+        term *= (x/(2*k))*(x/(2*k));
+        sum += term;
+        if (term < sum*1e-12) break;
+    }
+    return sum;
+}
+
+/* Create a resampler from 'in_rate' to 'out_rate' Hz. The low pass filter
+ * is a Kaiser windowed sinc designed at the upsampled rate, then split in
+ * 'up' phases, each stored reversed so that every output sample is a dot
+ * product of contiguous arrays. Returns NULL on invalid rates. */
+dspResampler *dspResamplerNew(int in_rate, int out_rate) {
+    if (in_rate <= 0 || out_rate <= 0) return NULL;
+    dspResampler *r = xmalloc(sizeof(*r));
+    memset(r,0,sizeof(*r));
+    int g = gcd(in_rate,out_rate);
+    r->in_rate = in_rate;
+    r->out_rate = out_rate;
+    r->up = out_rate/g;
+    r->down = in_rate/g;
+
+    /* When downsampling the cutoff is lower, so more taps are needed for
+     * the same transition band, measured in input samples. */
+    double factor = in_rate > out_rate ? (double)in_rate/out_rate : 1;
+    r->taps = 2*(int)ceil(RESAMPLER_HALF_TAPS*factor);
+    int n = r->taps*r->up;
+    int center = n/2;       /* On a tap, so that there is no delay. */
+    double fc = 0.5*RESAMPLER_ROLLOFF/(r->up*factor); /* Cycles/sample. */
+    double i0beta = besselI0(RESAMPLER_KAISER_BETA);
+
+    double *h = xmalloc(sizeof(double)*n);
+    for (int k = 0; k < n; k++) {
+        double x = k-center;
+        double sinc = x == 0 ? 1 : sin(2*M_PI*fc*x)/(2*M_PI*fc*x);
+        double w = x/center;    /* From -1 at k = 0 to almost 1. */
+        w = besselI0(RESAMPLER_KAISER_BETA*sqrt(1-w*w))/i0beta;
+        h[k] = 2*fc*sinc*w;
+    }
+
+    /* Split in phases, normalizing each to unity gain at DC. */
+    r->coef = xmalloc(sizeof(float)*n);
+    for (int p = 0; p < r->up; p++) {
+        double sum = 0;
+        for (int k = 0; k < r->taps; k++) sum += h[p+k*r->up];
+        for (int k = 0; k < r->taps; k++)
+            r->coef[p*r->taps+(r->taps-1-k)] = h[p+k*r->up]/sum;
+    }
+    xfree(h);
+
+    /* Start with 'taps' zeros of history, and the first output centered
+     * on the first input sample. */
+    r->bufcap = r->taps*2;
+    r->buf = xmalloc(sizeof(float)*r->bufcap);
+    memset(r->buf,0,sizeof(float)*r->taps);
+    r->buflen = r->taps;
+    r->pos = (uint64_t)center + (uint64_t)r->taps*r->up;
+    return r;
+}
+
+void dspResamplerFree(dspResampler *r) {
+    if (r == NULL) return;
+    xfree(r->coef);
+    xfree(r->buf);
+    xfree(r);
+}
+
+/* Upper bound of the samples produced by a dspResample() call with 'n'
+ * input samples, or by dspResampleFlush() if 'n' is zero. */
+size_t dspResampleMaxOut(dspResampler *r, size_t n) {
+    if (n == 0) n = r->taps;
+    return (r->buflen+n)*(uint64_t)r->up/r->down + 2;
+}
+
+/* Produce the output samples the buffered input allows, up to 'limit'. */
+static size_t resampleRun(dspResampler *r, float *out, uint64_t limit) {
+    dspKernels *k = kernels();
+    size_t produced = 0;
+    uint64_t pos = r->pos;
+    while (produced < limit) {
+        uint64_t last = pos/r->up;
+        if (last >= r->buflen) break;
+        const float *c = r->coef + (pos%r->up)*r->taps;
+        out[produced++] = k->dot(c,r->buf+last-r->taps+1,r->taps);
+        pos += r->down;
+    }
+
+    /* Discard the input no longer needed. */
+    size_t drop = pos/r->up-r->taps+1;
+    if (drop > r->buflen) drop = r->buflen;
+    memmove(r->buf,r->buf+drop,sizeof(float)*(r->buflen-drop));
+    r->buflen -= drop;
+    r->pos = pos-(uint64_t)drop*r->up;
+    r->out_total += produced;
+    return produced;
+}
+
+static void resampleAppend(dspResampler *r, const float *in, size_t n) {
+    if (r->buflen+n > r->bufcap) {
+        r->bufcap = r->buflen+n;
+        r->buf = xrealloc(r->buf,sizeof(float)*r->bufcap);
+    }
+    if (in) memcpy(r->buf+r->buflen,in,sizeof(float)*n);
+    else memset(r->buf+r->buflen,0,sizeof(float)*n);
+    r->buflen += n;
+}
+
+/* Feed 'n' input samples, writing the output to 'out', that must have
+ * room for dspResampleMaxOut(r,n) samples. Returns the number of output
+ * samples. */
+size_t dspResample(dspResampler *r, const float *in, size_t n, float *out) {
+    resampleAppend(r,in,n);
+    r->in_total += n;
+    return resampleRun(r,out,UINT64_MAX);
+}
+
+/* Emit the remaining output samples, once all the input was fed. The
+ * output has exactly ceil(input * out_rate / in_rate) samples overall. */
+size_t dspResampleFlush(dspResampler *r, float *out) {
+    uint64_t total = (r->in_total*r->up + r->down-1)/r->down;
+    if (r->out_total >= total) return 0;
+    resampleAppend(r,NULL,r->taps);
+    return resampleRun(r,out,total-r->out_total);
+}
+
+/* -------------------------------- Analysis ------------------------------- */
+
+static float SpeechFilter[SPEECH_TAPS];
+static pthread_once_t SpeechOnce = PTHREAD_ONCE_INIT;
+
+/* Band pass for the speech band at 16 kHz: the difference of two low
+ * pass windowed sincs. */
+static void speechFilterInit(void) {
+    double center = (SPEECH_TAPS-1)/2.0;
+    double lo = (double)SPEECH_LOW_HZ/16000, hi = (double)SPEECH_HIGH_HZ/16000;
+    for (int k = 0; k < SPEECH_TAPS; k++) {
+        double x = k-center;
+        double h = (sin(2*M_PI*hi*x)-sin(2*M_PI*lo*x))/(M_PI*x);
+        double w = 0.54-0.46*cos(2*M_PI*k/(SPEECH_TAPS-1));    /* Hamming */
+        SpeechFilter[k] = h*w;
+    }
+}
+
+/* Analyze 'n' samples of 16 kHz mono PCM: RMS and peak level, fraction of
+ * clipped samples, and fraction of the energy in the speech band, that is
+ * estimated on one sample every SPEECH_DECIMATION. */
+void dspAnalyze(const int16_t *pcm, size_t n, dspAnalysis *a) {
+    dspKernels *k = kernels();
+    pthread_once(&SpeechOnce,speechFilterInit);
+
+    /* The block is preceded by the last SPEECH_TAPS-1 samples. */
+    float buf[SPEECH_TAPS-1+ANALYSIS_BLOCK];
+    const int hist = SPEECH_TAPS-1;
+    double sumsq = 0, clipped = 0, band = 0, total = 0;
+    float peak = 0;
+    memset(buf,0,sizeof(float)*hist);
+
+    for (size_t off = 0; off < n; off += ANALYSIS_BLOCK) {
+        size_t len = n-off < ANALYSIS_BLOCK ? n-off : ANALYSIS_BLOCK;
+        float *x = buf+hist;
+        k->s16tof(pcm+off,x,len);
+
+        /* Accumulate block sums in float, the totals in double. */
+        float s = 0, c = 0;
+        k->stats(x,len,&s,&peak,&c);
+        sumsq += s;
+        clipped += c;
+
+        for (size_t j = 0; j < len; j += SPEECH_DECIMATION) {
+            float y = k->dot(SpeechFilter,x+j-hist,SPEECH_TAPS);
+            float v = x[(ssize_t)j-hist/2];
+            band += y*y;
+            total += v*v;
+        }
+        memmove(buf,buf+len,sizeof(float)*hist);
+    }
+
+    a->rms = n ? sqrt(sumsq/n) : 0;
+    a->peak = peak;
+    a->clip_ratio = n ? clipped/n : 0;
+    a->speech_ratio = total > 0 ? band/total : 0;
+    if (a->speech_ratio > 1) a->speech_ratio = 1;
+}
+
+/* Multiply 'n' samples by 'gain' in place, clipping. */
+void dspGain(int16_t *pcm, size_t n, float gain) {
+    dspKernels *k = kernels();
+    float buf[ANALYSIS_BLOCK];
+    for (size_t off = 0; off < n; off += ANALYSIS_BLOCK) {
+        size_t len = n-off < ANALYSIS_BLOCK ? n-off : ANALYSIS_BLOCK;
+        k->s16tof(pcm+off,buf,len);
+        for (size_t j = 0; j < len; j++) buf[j] *= gain;
+        k->ftos16(buf,pcm+off,len);
+    }
+}
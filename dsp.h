@@ -0,0 +1,48 @@
+#ifndef DSP_H
+#define DSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Polyphase resampler by the rational factor out_rate / in_rate. Input is
+ * fed in blocks of any size with dspResample(), then dspResampleFlush()
+ * emits the tail. */
+typedef struct dspResampler {
+    int in_rate, out_rate;
+    int up, down;           /* Rates ratio reduced: up / down. */
+    int taps;               /* Filter taps per phase. */
+    float *coef;            /* 'up' phases of 'taps' coefficients each. */
+    float *buf;             /* Input history plus the current block. */
+    size_t buflen, bufcap;
+    uint64_t pos;           /* Next output time, in upsampled samples,
+                               relative to buf[0]. */
+    uint64_t in_total, out_total;
+} dspResampler;
+
+dspResampler *dspResamplerNew(int in_rate, int out_rate);
+void dspResamplerFree(dspResampler *r);
+size_t dspResampleMaxOut(dspResampler *r, size_t n);
+size_t dspResample(dspResampler *r, const float *in, size_t n, float *out);
+size_t dspResampleFlush(dspResampler *r, float *out);
+
+void dspS16ToFloat(const int16_t *in, float *out, size_t n);
+void dspS16ToMono(const int16_t *in, int channels, float *out,
+                  size_t frames);
+void dspFloatToS16(const float *in, int16_t *out, size_t n);
+
+/* Levels of an audio buffer, see dspAnalyze(). Levels are linear, with
+ * 1.0 as full scale. */
+typedef struct dspAnalysis {
+    double rms, peak;
+    double clip_ratio;      /* Fraction of clipped samples. */
+    double speech_ratio;    /* Fraction of energy in the speech band. */
+} dspAnalysis;
+
+void dspAnalyze(const int16_t *pcm, size_t n, dspAnalysis *a);
+void dspGain(int16_t *pcm, size_t n, float gain);
+
+const char *dspImplName(void);
+int dspSetImpl(const char *name);
+const char **dspImpls(void);
+
+#endif
@@ -0,0 +1,89 @@
+/* ============================================================================
+ * Completion time estimation.
+ *
+ * The real time factor (processing seconds per audio second) of each model
+ * is learned from the chunks we transcribe, and persisted in the Rtf table
+ * keyed by model and number of cores. We keep decayed sums of audio and
+ * wall seconds, so the estimate is weighted by duration, follows changes
+ * of the machine load, and starts from a prior worth ETA_PRIOR_SECONDS of
+ * audio. Predictions are made by schedPredict() with these figures.
+ * ==========================================================================*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "botlib.h"
+#include "config.h"
+#include "sched.h"
+#include "eta.h"
+
+static pthread_mutex_t EtaLock = PTHREAD_MUTEX_INITIALIZER;
+static int EtaLoaded = 0;
+static double EtaAudio[SCHED_NUM_MODELS] = {
+    ETA_PRIOR_SECONDS, ETA_PRIOR_SECONDS
+};
+static double EtaWall[SCHED_NUM_MODELS] = {
+    ETA_PRIOR_SECONDS*ETA_RTF_BASE, ETA_PRIOR_SECONDS*ETA_RTF_MEDIUM
+};
+
+static int etaCores(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? cores : 1;
+}
+
+/* Load the figures learned by previous runs, if any. Only the first call
+ * does something. */
+void etaLoad(sqlite3 *db) {
+    pthread_mutex_lock(&EtaLock);
+    if (EtaLoaded) {
+        pthread_mutex_unlock(&EtaLock);
+        return;
+    }
+    EtaLoaded = 1;
+    for (int m = 0; m < SCHED_NUM_MODELS; m++) {
+        sqlRow row;
+        if (sqlSelectOneRow(db, &row,
+            "SELECT audio, wall FROM Rtf WHERE model=?s AND cores=?i",
+            schedModelName(m), (int64_t)etaCores()) != SQLITE_ROW) continue;
+        if (row.col[0].d > 0 && row.col[1].d > 0) {
+            EtaAudio[m] = row.col[0].d;
+            EtaWall[m] = row.col[1].d;
+        }
+        sqlEnd(&row);
+    }
+    pthread_mutex_unlock(&EtaLock);
+}
+
+/* Populate 'rtf' with the current real time factor estimate of each
+ * model. */
+void etaRtf(double *rtf) {
+    pthread_mutex_lock(&EtaLock);
+    for (int m = 0; m < SCHED_NUM_MODELS; m++)
+        rtf[m] = EtaWall[m] / EtaAudio[m];
+    pthread_mutex_unlock(&EtaLock);
+}
+
+/* Account 'wall' seconds spent transcribing 'audio' seconds with 'model',
+ * and persist the new figures. */
+void etaLearn(sqlite3 *db, int model, double audio, double wall) {
+    if (audio <= 0 || wall <= 0) return;
+    pthread_mutex_lock(&EtaLock);
+    EtaAudio[model] = EtaAudio[model]*ETA_DECAY + audio;
+    EtaWall[model] = EtaWall[model]*ETA_DECAY + wall;
+    double a = EtaAudio[model], w = EtaWall[model];
+    pthread_mutex_unlock(&EtaLock);
+
+    sqlQuery(db, "INSERT OR REPLACE INTO Rtf VALUES(?s,?i,?d,?d)",
+             schedModelName(model), (int64_t)etaCores(), a, w);
+}
+
+/* Format an estimate for the user. Minutes are rounded up: it's better
+ * to be done before than after what we said. */
+void etaFormat(char *buf, size_t len, double seconds) {
+    int minutes = (seconds + 59) / 60;
+    if (minutes <= 1)
+        snprintf(buf, len, "less than a minute");
+    else
+        snprintf(buf, len, "about %d minutes", minutes);
+}
@@ -0,0 +1,21 @@
+#ifndef ETA_H
+#define ETA_H
+
+#include <sqlite3.h>
+
+/* Learned real time factors, one row per model and number of cores, so
+ * that figures measured on a different machine are not mixed up. 'audio'
+ * and 'wall' are decayed sums of the seconds transcribed and spent. */
+#define ETA_CREATE_TABLE \
+    "CREATE TABLE IF NOT EXISTS Rtf(model TEXT, " \
+                                   "cores INT, " \
+                                   "audio REAL, " \
+                                   "wall REAL, " \
+                                   "PRIMARY KEY(model, cores));"
+
+void etaLoad(sqlite3 *db);
+void etaRtf(double *rtf);
+void etaLearn(sqlite3 *db, int model, double audio, double wall);
+void etaFormat(char *buf, size_t len, double seconds);
+
+#endif
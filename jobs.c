@@ -0,0 +1,240 @@
+/* ============================================================================
+ * Job table for the split deployment.
+ *
+ * Started with --ingest, the bot polls Telegram and, instead of serving
+ * the audio requests, checks the quotas and queues them in the Jobs table.
+ * Processes started with --transcriber never poll Telegram: they claim the
+ * queued jobs and serve them as the standalone bot would. A memory spike
+ * or a crash while decoding then only takes down a transcriber, and
+ * transcribers can be restarted, or added, without missing updates.
+ *
+ * A claim is a lease of JOB_LEASE_SECONDS, that the transcriber renews
+ * every JOB_HEARTBEAT_SECONDS for all its jobs at once. The ingest process
+ * queues again the jobs whose lease expired, since their transcriber is
+ * dead or stuck, up to JOB_MAX_ATTEMPTS claims. Finished jobs are removed
+ * by the ingest process as well, that refunds what was charged to the
+ * quotas and not served: quotas live in its memory, see quota.c.
+ * ==========================================================================*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "botlib.h"
+#include "config.h"
+#include "jobs.h"
+#include "quota.h"
+#include "sched.h"
+
+static pthread_once_t JobOwnerOnce = PTHREAD_ONCE_INIT;
+static char JobOwner[128];
+
+/* Leases are taken in the name of "host:pid". */
+static void jobOwnerInit(void) {
+    char host[64];
+    if (gethostname(host, sizeof(host)) == -1) strcpy(host, "unknown");
+    host[sizeof(host)-1] = '\0';
+    snprintf(JobOwner, sizeof(JobOwner), "%s:%d", host, (int)getpid());
+}
+
+static const char *jobOwner(void) {
+    pthread_once(&JobOwnerOnce, jobOwnerInit);
+    return JobOwner;
+}
+
+/* Return a copy of the text column 'c', or NULL if it is NULL. */
+static sds jobString(sqlCol *c) {
+    return c->s ? sdsnewlen(c->s, c->i) : NULL;
+}
+
+/* Queue the request 'br', for which 'charged' seconds were taken from the
+ * quotas, telling the user its position, or that we are too busy. The
+ * table has the limits of the standalone bot: SchedPolicy.max_queue jobs,
+ * and max_audio seconds of declared audio, queued or running. Returns the
+ * job ID, or 0 if the job was not queued. */
+int64_t jobEnqueue(sqlite3 *db, BotRequest *br, double charged) {
+    char *busy = "Too busy, try later.";
+    sqlRow row;
+    int64_t inflight = 0, queued = 0, audio = 0;
+    if (sqlSelectOneRow(db, &row, "SELECT COUNT(*), "
+            "IFNULL(SUM(state=?i),0), IFNULL(SUM(file_duration),0) "
+            "FROM Jobs WHERE state<=?i",
+            (int64_t)JOB_QUEUED, (int64_t)JOB_RUNNING) == SQLITE_ROW)
+    {
+        inflight = row.col[0].i;
+        queued = row.col[1].i;
+        audio = row.col[2].i;
+        sqlEnd(&row);
+    }
+    if (inflight >= SchedPolicy.max_queue ||
+        audio + br->file_duration > SchedPolicy.max_audio)
+    {
+        botSendMessage(br->target, busy, br->msg_id);
+        return 0;
+    }
+
+    /* The message is sent first, so that transcribers find its ID in the
+     * row and edit it. If the insert fails, it becomes the error. */
+    char msg[64];
+    int64_t chat_id = 0, msg_id = 0;
+    snprintf(msg, sizeof(msg), "Queued (%d).", (int)queued+1);
+    botSendMessageAndGetInfo(br->target, msg, br->msg_id, &chat_id, &msg_id);
+
+    double priority = br->file_duration + SchedPolicy.aging*time(NULL);
+    int64_t id = sqlInsert(db, "INSERT INTO Jobs VALUES(NULL,?i,NULL,0,0,?d,"
+                     "?d,0,?i,?i,?i,?s,?i,?s,?i,?i,?i,?s,?s,?s,?i,?i)",
+                     (int64_t)JOB_QUEUED, priority, charged, chat_id, msg_id,
+                     (int64_t)br->type, br->request, br->from,
+                     br->from_username, br->target, br->msg_id,
+                     (int64_t)br->file_type, br->file_id, br->file_name,
+                     br->file_mime, br->file_size,
+                     (int64_t)br->file_duration);
+    if (id == 0) {
+        if (msg_id) botEditMessageText(chat_id, msg_id, busy);
+        else botSendMessage(br->target, busy, br->msg_id);
+    }
+    return id;
+}
+
+/* Claim the queued job with the best priority. Returns the job, to be
+ * passed to jobComplete() once served, or NULL if there is none. */
+queuedJob *jobClaim(sqlite3 *db) {
+    sqlRow row;
+    if (sqlSelectOneRow(db, &row, "SELECT id, charged, status_chat, "
+            "status_msg, type, request, from_id, from_username, target, "
+            "msg_id, file_type, file_id, file_name, file_mime, file_size, "
+            "file_duration FROM Jobs WHERE state=?i ORDER BY priority "
+            "LIMIT 1", (int64_t)JOB_QUEUED) != SQLITE_ROW) return NULL;
+
+    queuedJob *qj = xmalloc(sizeof(*qj));
+    BotRequest *br = createBotRequest();
+    sqlCol *c = row.col;
+    qj->id = c[0].i;
+    qj->charged = c[1].d;
+    qj->status_chat = c[2].i;
+    qj->status_msg = c[3].i;
+    qj->br = br;
+    br->type = c[4].i;
+    br->request = c[5].s ? jobString(c+5) : sdsempty();
+    br->from = c[6].i;
+    br->from_username = jobString(c+7);
+    br->target = c[8].i;
+    br->msg_id = c[9].i;
+    br->file_type = c[10].i;
+    br->file_id = jobString(c+11);
+    br->file_name = jobString(c+12);
+    br->file_mime = jobString(c+13);
+    br->file_size = c[14].i;
+    br->file_duration = c[15].i;
+    br->argv = sdssplitargs(br->request, &br->argc);
+    sqlEnd(&row);
+
+    /* Another transcriber may have claimed it meanwhile: the update is
+     * conditional, and only one of them changes the row. */
+    sqlQuery(db, "UPDATE Jobs SET state=?i, owner=?s, lease=?i, "
+                 "attempts=attempts+1 WHERE id=?i AND state=?i",
+             (int64_t)JOB_RUNNING, jobOwner(),
+             (int64_t)time(NULL) + JOB_LEASE_SECONDS, qj->id,
+             (int64_t)JOB_QUEUED);
+    if (sqlite3_changes(db) != 1) {
+        freeBotRequest(br);
+        xfree(qj);
+        return NULL;
+    }
+    return qj;
+}
+
+/* Called from cron by transcribers: every JOB_HEARTBEAT_SECONDS renew the
+ * leases of the jobs we are serving. */
+void jobHeartbeat(sqlite3 *db) {
+    static time_t last = 0;
+    time_t now = time(NULL);
+    if (now - last < JOB_HEARTBEAT_SECONDS) return;
+    last = now;
+    sqlQuery(db, "UPDATE Jobs SET lease=?i WHERE owner=?s AND state=?i",
+             (int64_t)now + JOB_LEASE_SECONDS, jobOwner(),
+             (int64_t)JOB_RUNNING);
+}
+
+/* Mark the job 'qj' as served, with 'refund' seconds to give back to the
+ * quotas. If the lease was lost meanwhile the job belongs to someone else,
+ * and the row is left alone. */
+void jobComplete(sqlite3 *db, queuedJob *qj, double refund) {
+    sqlQuery(db, "UPDATE Jobs SET state=?i, refund=?d "
+                 "WHERE id=?i AND owner=?s AND state=?i",
+             (int64_t)JOB_DONE, refund, qj->id, jobOwner(),
+             (int64_t)JOB_RUNNING);
+}
+
+/* Called from cron by the ingest process: queue again the jobs whose lease
+ * expired, fail the ones claimed too many times, and remove the finished
+ * ones, refunding the quotas. */
+void jobReap(sqlite3 *db) {
+    int64_t now = time(NULL);
+    sqlQuery(db, "UPDATE Jobs SET state=?i, owner=NULL "
+                 "WHERE state=?i AND lease<?i AND attempts<?i",
+             (int64_t)JOB_QUEUED, (int64_t)JOB_RUNNING, now,
+             (int64_t)JOB_MAX_ATTEMPTS);
+    int reclaimed = sqlite3_changes(db);
+    if (reclaimed) printf("Reclaimed %d expired jobs\n", reclaimed);
+    sqlQuery(db, "UPDATE Jobs SET state=?i, refund=charged "
+                 "WHERE state=?i AND lease<?i",
+             (int64_t)JOB_FAILED, (int64_t)JOB_RUNNING, now);
+
+    /* Collect the finished jobs first, then remove them. */
+    sqlRow row;
+    int64_t *ids = NULL;
+    int n = 0;
+    sqlSelect(db, &row, "SELECT id, state, refund, from_id, target, "
+                        "status_chat, status_msg FROM Jobs WHERE state>=?i",
+              (int64_t)JOB_DONE);
+    while (sqlNextRow(&row)) {
+        sqlCol *c = row.col;
+        quotaGive(c[3].i, c[4].i, c[2].d);
+        if (c[1].i == JOB_FAILED) {
+            printf("Job %lld failed after %d attempts\n",
+                   (long long)c[0].i, JOB_MAX_ATTEMPTS);
+            botEditMessageText(c[5].i, c[6].i, "Transcription failed.");
+        }
+        ids = xrealloc(ids, sizeof(*ids)*(n+1));
+        ids[n++] = c[0].i;
+    }
+    for (int j = 0; j < n; j++)
+        sqlQuery(db, "DELETE FROM Jobs WHERE id=?i", ids[j]);
+    xfree(ids);
+}
+
+/* Reply to the /status command in the ingest process: the jobs in the
+ * table, and the state of the ones of 'user'. */
+sds jobReport(sqlite3 *db, int64_t user) {
+    sqlRow row;
+    int n = 0, pos = 0;
+    double audio = 0;
+    sds mine = sdsempty();
+    sqlSelect(db, &row, "SELECT state, from_id, file_duration FROM Jobs "
+                        "WHERE state<=?i ORDER BY state DESC, priority",
+              (int64_t)JOB_RUNNING);
+    while (sqlNextRow(&row)) {
+        int state = row.col[0].i, dur = row.col[2].i;
+        n++;
+        audio += dur;
+        if (state == JOB_QUEUED) pos++;
+        if (row.col[1].i != user) continue;
+        if (state == JOB_RUNNING)
+            mine = sdscatprintf(mine, "\nYour %d:%02d audio: transcribing.",
+                                dur / 60, dur % 60);
+        else
+            mine = sdscatprintf(mine, "\nYour %d:%02d audio: queued (%d).",
+                                dur / 60, dur % 60, pos);
+    }
+    sds s = sdscatprintf(sdsempty(), "%d job%s in flight, %d seconds of "
+                         "audio.", n, n == 1 ? "" : "s", (int)audio);
+    s = sdscatsds(s, mine);
+    sdsfree(mine);
+    return s;
+}
@@ -0,0 +1,60 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdint.h>
+#include <sqlite3.h>
+
+#include "botlib.h"
+
+#define JOB_QUEUED 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+#define JOB_FAILED 3
+
+/* The job table shared by the ingest and transcriber processes. Every row
+ * holds the request as received from Telegram, and the lease of the
+ * transcriber working on it, if any. 'priority' orders the queued jobs
+ * like schedPriority() does. WAL lets the processes read while one of
+ * them writes. */
+#define JOBS_CREATE_TABLE \
+    "PRAGMA journal_mode=WAL;" \
+    "CREATE TABLE IF NOT EXISTS Jobs(id INTEGER PRIMARY KEY, " \
+                                    "state INT, " \
+                                    "owner TEXT, " \
+                                    "lease INT, " \
+                                    "attempts INT, " \
+                                    "priority REAL, " \
+                                    "charged REAL, " \
+                                    "refund REAL, " \
+                                    "status_chat INT, " \
+                                    "status_msg INT, " \
+                                    "type INT, " \
+                                    "request TEXT, " \
+                                    "from_id INT, " \
+                                    "from_username TEXT, " \
+                                    "target INT, " \
+                                    "msg_id INT, " \
+                                    "file_type INT, " \
+                                    "file_id TEXT, " \
+                                    "file_name TEXT, " \
+                                    "file_mime TEXT, " \
+                                    "file_size INT, " \
+                                    "file_duration INT);" \
+    "CREATE INDEX IF NOT EXISTS idx_jobs_state ON Jobs(state, priority);"
+
+/* A job claimed by a transcriber. */
+typedef struct queuedJob {
+    int64_t id;
+    BotRequest *br;
+    double charged;             /* Seconds taken from the quotas. */
+    int64_t status_chat, status_msg;    /* "Queued" message to edit. */
+} queuedJob;
+
+int64_t jobEnqueue(sqlite3 *db, BotRequest *br, double charged);
+queuedJob *jobClaim(sqlite3 *db);
+void jobHeartbeat(sqlite3 *db);
+void jobComplete(sqlite3 *db, queuedJob *qj, double refund);
+void jobReap(sqlite3 *db);
+sds jobReport(sqlite3 *db, int64_t user);
+
+#endif
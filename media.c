@@ -0,0 +1,465 @@
+/* ============================================================================
+ * Media stages: running external tools, probing duration and converting
+ * audio to the format whisper wants.
+ * ==========================================================================*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "sds.h"
+#include "config.h"
+#include "media.h"
+#include "spawn.h"
+#include "probe.h"
+#include "dsp.h"
+#include "xmalloc.h"
+
+/* Accumulate the resource usage 'ru' of a reaped child into 'ps'. */
+void procStatsAdd(procStats *ps, const struct rusage *ru) {
+    ps->procs++;
+    ps->utime += ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+    ps->stime += ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+    if (ru->ru_maxrss > ps->maxrss) ps->maxrss = ru->ru_maxrss;
+    ps->nvcsw += ru->ru_nvcsw;
+    ps->nivcsw += ru->ru_nivcsw;
+}
+
+/* Run command with NULL-terminated args. Capture stdout in *out if not NULL.
+ * Stderr goes to /dev/null. If 'ps' is not NULL, the resource usage of the
+ * command is accumulated there. Returns 0 on success, -1 on error. */
+int runCommand(procStats *ps, sds *out, const char *cmd, ...) {
+    /* Build argv from varargs. */
+    va_list ap;
+    const char *argv[64];
+    int argc = 0;
+
+    argv[argc++] = cmd;
+    va_start(ap, cmd);
+    while (argc < 63 && (argv[argc] = va_arg(ap, const char *)) != NULL)
+        argc++;
+    va_end(ap);
+    argv[argc] = NULL;
+
+    /* Create pipe if output requested. The pipe is close-on-exec so that
+     * children started concurrently by other threads don't inherit the
+     * write side, keeping us from seeing EOF. */
+    int fd[2] = {-1, -1};
+    if (out && pipe2(fd, O_CLOEXEC) == -1) return -1;
+
+    childProc c;
+    if (spawnChild(&c, argv, out ? fd[1] : -1, -1) == -1) {
+        if (out) {
+            close(fd[0]);
+            close(fd[1]);
+        }
+        return -1;
+    }
+
+    /* Parent: read output if requested. */
+    if (out) {
+        close(fd[1]);
+        *out = sdsempty();
+        char buf[1024];
+        ssize_t n;
+        while ((n = read(fd[0], buf, sizeof(buf)-1)) > 0) {
+            buf[n] = '\0';
+            *out = sdscat(*out, buf);
+        }
+        close(fd[0]);
+    }
+
+    int status;
+    struct rusage ru;
+    if (spawnWait(&c, &status, &ru) == -1) status = -1;
+    else if (ps) procStatsAdd(ps, &ru);
+    if (!(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+        if (out) {
+            sdsfree(*out);
+            *out = NULL;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/* Return audio duration in seconds according to ffprobe, or -1 on error. */
+double ffprobeDuration(const char *path, procStats *ps) {
+    sds out;
+    if (runCommand(ps, &out, "ffprobe", "-i", path, "-show_entries",
+                   "format=duration", "-v", "quiet", "-of", "csv=p=0",
+                   NULL) != 0) return -1;
+    double dur = atof(out);
+    sdsfree(out);
+    return dur;
+}
+
+/* Return audio duration in seconds, or -1 on error. The container headers
+ * are parsed natively when possible, otherwise we ask ffprobe. */
+double getDuration(const char *path, procStats *ps) {
+    double dur = probeDuration(path);
+    return dur >= 0 ? dur : ffprobeDuration(path, ps);
+}
+
+/* Populate 'h' with a 16 kHz mono 16 bit PCM WAV header for 'samples'
+ * samples. */
+static void wavHeader(unsigned char *h, uint32_t samples) {
+    uint32_t datalen = samples*2, riff = datalen+36, fmtlen = 16;
+    uint32_t rate = 16000, byterate = rate*2;
+    uint16_t pcm = 1, channels = 1, align = 2, bits = 16;
+    memcpy(h, "RIFF", 4); memcpy(h+4, &riff, 4);
+    memcpy(h+8, "WAVEfmt ", 8); memcpy(h+16, &fmtlen, 4);
+    memcpy(h+20, &pcm, 2); memcpy(h+22, &channels, 2);
+    memcpy(h+24, &rate, 4); memcpy(h+28, &byterate, 4);
+    memcpy(h+32, &align, 2); memcpy(h+34, &bits, 2);
+    memcpy(h+36, "data", 4); memcpy(h+40, &datalen, 4);
+}
+
+/* Write a 16 kHz mono 16 bit PCM WAV header for 'samples' samples. */
+static int writeWavHeader(FILE *fp, uint32_t samples) {
+    unsigned char h[44];
+    wavHeader(h, samples);
+    return fwrite(h, 1, 44, fp) == 44 ? 0 : -1;
+}
+
+/* Find the PCM format and the data chunk of a WAV file, leaving 'fp' at
+ * the start of the samples. Returns 0 if the file is 16 bit PCM. */
+static int readWavHeader(FILE *fp, int *channels, int *rate, long *datalen) {
+    unsigned char h[24];
+    int fmt_ok = 0;
+    if (fread(h, 1, 12, fp) != 12 || memcmp(h, "RIFF", 4) ||
+        memcmp(h+8, "WAVE", 4)) return -1;
+    while (fread(h, 1, 8, fp) == 8) {
+        uint32_t len;
+        memcpy(&len, h+4, 4);
+        if (!memcmp(h, "fmt ", 4)) {
+            uint16_t tag, ch, bits;
+            uint32_t sr;
+            if (len < 16 || fread(h, 1, 16, fp) != 16) return -1;
+            memcpy(&tag, h, 2); memcpy(&ch, h+2, 2);
+            memcpy(&sr, h+4, 4); memcpy(&bits, h+14, 2);
+            /* Plain PCM, or WAVE_FORMAT_EXTENSIBLE that we assume PCM. */
+            fmt_ok = (tag == 1 || tag == 0xfffe) && bits == 16 &&
+                     ch >= 1 && ch <= 8 && sr >= 1000 && sr <= 384000;
+            *channels = ch;
+            *rate = sr;
+            len -= 16;
+        } else if (!memcmp(h, "data", 4)) {
+            if (!fmt_ok) return -1;
+            *datalen = len == 0xffffffff ? LONG_MAX : (long)len;
+            return 0;
+        }
+        if (fseek(fp, len + (len & 1), SEEK_CUR) == -1) return -1;
+    }
+    return -1;
+}
+
+/* Return a WAV file with 'duration' seconds of the 16 kHz mono WAV file
+ * 'path', as written by toWav(), starting at 'offset' seconds, or up to
+ * the end if 'duration' is 0. Returns NULL on error. */
+sds wavSlice(const char *path, double offset, double duration) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return NULL;
+    int channels = 0, rate = 0;
+    long datalen;
+    if (readWavHeader(fp, &channels, &rate, &datalen) == -1 ||
+        channels != 1 || rate != 16000 ||
+        fseek(fp, (long)(offset*16000)*2, SEEK_CUR) == -1)
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    long left = duration > 0 ? (long)(duration*16000)*2 : datalen;
+    sds wav = sdsnewlen(NULL, 44);
+    char buf[65536];
+    while (left > 0) {
+        size_t n = left < (long)sizeof(buf) ? (size_t)left : sizeof(buf);
+        if ((n = fread(buf, 1, n, fp)) == 0) break;
+        wav = sdscatlen(wav, buf, n);
+        left -= n;
+    }
+    fclose(fp);
+    wavHeader((unsigned char *)wav, (sdslen(wav) - 44) / 2);
+    return wav;
+}
+
+#define WAV_BLOCK_FRAMES 16384
+
+/* Convert a 16 bit PCM WAV file to 16 kHz mono in process, with the
+ * kernels of dsp.c, padding to 'min_samples'. Returns 0 on success, -1 on
+ * error, 1 if the input is not a WAV file we can convert. */
+static int convertWav(const char *in, const char *out, uint32_t min_samples) {
+    FILE *ifp = fopen(in, "r");
+    if (ifp == NULL) return -1;
+    int channels = 1, rate = 0;
+    long datalen;
+    if (readWavHeader(ifp, &channels, &rate, &datalen) == -1) {
+        fclose(ifp);
+        return 1;
+    }
+
+    FILE *ofp = fopen(out, "w");
+    if (ofp == NULL) {
+        fclose(ifp);
+        return -1;
+    }
+
+    dspResampler *rs = rate != 16000 ? dspResamplerNew(rate, 16000) : NULL;
+    size_t maxout = rs ? dspResampleMaxOut(rs, WAV_BLOCK_FRAMES) :
+                         WAV_BLOCK_FRAMES;
+    int16_t *ibuf = xmalloc(sizeof(int16_t)*WAV_BLOCK_FRAMES*channels);
+    float *mono = xmalloc(sizeof(float)*WAV_BLOCK_FRAMES);
+    float *res = xmalloc(sizeof(float)*maxout);
+    int16_t *obuf = xmalloc(sizeof(int16_t)*maxout);
+    uint32_t samples = 0;
+    int retval = writeWavHeader(ofp, 0);
+
+    /* Convert block by block, then flush the resampler tail. */
+    long left = datalen / (2*channels);
+    int flushed = 0;
+    while (retval == 0 && !flushed) {
+        size_t n = 0, frames = 0;
+        if (left > 0) {
+            frames = left < WAV_BLOCK_FRAMES ? left : WAV_BLOCK_FRAMES;
+            frames = fread(ibuf, 2*channels, frames, ifp);
+            left = frames ? left-frames : 0;
+        }
+        if (frames) {
+            dspS16ToMono(ibuf, channels, mono, frames);
+            n = rs ? dspResample(rs, mono, frames, res) : frames;
+        } else {
+            n = rs ? dspResampleFlush(rs, res) : 0;
+            flushed = 1;
+        }
+        dspFloatToS16(rs ? res : mono, obuf, n);
+        if (fwrite(obuf, 2, n, ofp) != n) retval = -1;
+        samples += n;
+    }
+
+    /* Pad short audio with silence. */
+    static const int16_t zero[1024];
+    while (retval == 0 && samples < min_samples) {
+        size_t n = min_samples-samples < 1024 ? min_samples-samples : 1024;
+        if (fwrite(zero, 2, n, ofp) != n) retval = -1;
+        samples += n;
+    }
+
+    if (retval == 0 && (fseek(ofp, 0, SEEK_SET) == -1 ||
+                        writeWavHeader(ofp, samples) == -1)) retval = -1;
+    if (fclose(ofp) != 0) retval = -1;
+    fclose(ifp);
+    dspResamplerFree(rs);
+    xfree(ibuf);
+    xfree(mono);
+    xfree(res);
+    xfree(obuf);
+    return retval;
+}
+
+/* Convert to 16khz mono WAV. For short audio, pad to 1.5s with silence.
+ * Whisper fails on audio < 1s. PCM WAV files are converted in process,
+ * everything else with ffmpeg. The output format is given explicitly
+ * since scratch file paths have no extension. */
+int toWav(const char *in, const char *out, double duration, procStats *ps) {
+    int short_audio = duration < SHORT_AUDIO_THRESHOLD;
+    int retval = convertWav(in, out,
+                            short_audio ? SHORT_AUDIO_THRESHOLD*16000 : 0);
+    if (retval != 1) return retval;
+
+    if (short_audio) {
+        /* Pad with silence. */
+        char af[64];
+        snprintf(af, sizeof(af), "apad=whole_dur=%.1f", SHORT_AUDIO_THRESHOLD);
+        return runCommand(ps, NULL, "ffmpeg", "-y", "-i", in, "-af", af,
+                          "-ar", "16000", "-ac", "1", "-c:a", "pcm_s16le",
+                          "-f", "wav", out, NULL);
+    }
+    return runCommand(ps, NULL, "ffmpeg", "-y", "-i", in,
+                      "-ar", "16000", "-ac", "1", "-c:a", "pcm_s16le",
+                      "-f", "wav", out, NULL);
+}
+
+static double toDB(double level) {
+    return level > 0 ? 20*log10(level) : -120;
+}
+
+/* Analyze the 16 kHz mono WAV file 'wav', as produced by toWav(), before
+ * the job is queued, filling 'al'. Quiet audio is normalized in place, so
+ * that whisper, especially the base model, is less likely to hallucinate.
+ * Returns 1 if the audio is clearly empty, 0 otherwise, -1 on error. */
+int checkAudio(const char *wav, audioLevels *al) {
+    memset(al, 0, sizeof(*al));
+    FILE *fp = fopen(wav, "r+");
+    if (fp == NULL) return -1;
+
+    int channels = 1, rate = 0, retval = -1;
+    long datalen;
+    struct stat st;
+    if (readWavHeader(fp, &channels, &rate, &datalen) == -1 ||
+        channels != 1 || rate != 16000 || fstat(fileno(fp), &st) == -1)
+        goto done;
+
+    long off = ftell(fp);
+    if (datalen > st.st_size-off) datalen = st.st_size-off;
+    size_t samples = datalen/2;
+    if (samples == 0) {
+        retval = 1;
+        goto done;
+    }
+    unsigned char *map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE,
+                              MAP_SHARED, fileno(fp), 0);
+    if (map == MAP_FAILED) goto done;
+    int16_t *pcm = (int16_t*)(map+off);
+
+    dspAnalysis a;
+    dspAnalyze(pcm, samples, &a);
+    al->rms_db = toDB(a.rms);
+    al->peak_db = toDB(a.peak);
+    al->clip_ratio = a.clip_ratio;
+    al->speech_ratio = a.speech_ratio;
+
+    if (al->rms_db < SILENCE_RMS_DB || al->speech_ratio < SPEECH_MIN_RATIO) {
+        retval = 1;
+    } else {
+        if (al->rms_db < QUIET_RMS_DB) {
+            double gain = TARGET_RMS_DB - al->rms_db;
+            if (gain > -1 - al->peak_db) gain = -1 - al->peak_db;
+            if (gain > MAX_GAIN_DB) gain = MAX_GAIN_DB;
+            if (gain > 0) {
+                dspGain(pcm, samples, pow(10, gain/20));
+                al->gain_db = gain;
+            }
+        }
+        retval = 0;
+    }
+    munmap(map, st.st_size);
+
+done:
+    fclose(fp);
+    return retval;
+}
+
+/* ============================================================================
+ * Scratch files.
+ *
+ * Downloaded and converted audio is kept in anonymous memfds, so nothing
+ * touches the disk and nothing is left behind if we die: the memory goes
+ * away with the last file descriptor. Children get the /proc/<pid>/fd/<fd>
+ * path, that reopens the same file (the fd itself is close-on-exec).
+ * If memfds are not available, or a spool directory was configured, files
+ * are created there instead, and stale files of dead processes are
+ * removed at startup.
+ * ==========================================================================*/
+
+static const char *ScratchSpool = NULL;     /* NULL: use memfds. */
+static atomic_llong ScratchBytes = 0;
+
+/* Remove the files left in the spool by processes that no longer exist. */
+static void scratchCleanSpool(const char *spool) {
+    DIR *dir = opendir(spool);
+    if (dir == NULL) return;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        int pid;
+        if (sscanf(de->d_name, "wb_%d_", &pid) != 1) continue;
+        if (kill(pid, 0) == 0 || errno != ESRCH) continue;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", spool, de->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+/* Select where scratch files are stored: in memfds if 'spool' is NULL
+ * and they are supported, otherwise in 'spool' (or SPOOL_DIR).
+ * Returns 0 if memfds are used, 1 if the spool is used. */
+int scratchInit(const char *spool) {
+#ifdef MFD_CLOEXEC
+    if (spool == NULL) {
+        int fd = memfd_create("wb_probe", MFD_CLOEXEC);
+        if (fd != -1) {
+            close(fd);
+            ScratchSpool = NULL;
+            return 0;
+        }
+    }
+#endif
+    ScratchSpool = spool ? spool : SPOOL_DIR;
+    scratchCleanSpool(ScratchSpool);
+    return 1;
+}
+
+/* Create an empty scratch file. 'name' is only used to make the file
+ * recognizable in /proc and in the spool. Returns 0 on success, -1 on
+ * error. */
+int scratchCreate(scratchFile *sf, const char *name) {
+    sf->fd = -1;
+    sf->size = 0;
+    sf->path[0] = '\0';
+
+#ifdef MFD_CLOEXEC
+    if (ScratchSpool == NULL) {
+        char mname[128];
+        snprintf(mname, sizeof(mname), "wb_%s", name);
+        sf->fd = memfd_create(mname, MFD_CLOEXEC);
+        if (sf->fd == -1) return -1;
+        snprintf(sf->path, sizeof(sf->path), "/proc/%d/fd/%d",
+                 (int)getpid(), sf->fd);
+        return 0;
+    }
+#endif
+
+    const char *spool = ScratchSpool ? ScratchSpool : SPOOL_DIR;
+    snprintf(sf->path, sizeof(sf->path), "%s/wb_%d_%s", spool,
+             (int)getpid(), name);
+    int fd = open(sf->path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    if (fd == -1) {
+        sf->path[0] = '\0';
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Update the accounting of scratch memory after the file was written. */
+void scratchAccount(scratchFile *sf) {
+    struct stat st;
+    if (sf->path[0] == '\0') return;
+    if ((sf->fd != -1 ? fstat(sf->fd, &st) : stat(sf->path, &st)) == -1)
+        return;
+    atomic_fetch_add(&ScratchBytes, (long long)st.st_size - sf->size);
+    sf->size = st.st_size;
+}
+
+/* Free the file. Safe to call multiple times, or if scratchCreate()
+ * failed. */
+void scratchRelease(scratchFile *sf) {
+    if (sf->path[0] == '\0') return;
+    if (sf->fd != -1) close(sf->fd);
+    else unlink(sf->path);
+    atomic_fetch_sub(&ScratchBytes, sf->size);
+    sf->fd = -1;
+    sf->size = 0;
+    sf->path[0] = '\0';
+}
+
+/* Bytes currently used by scratch files. */
+long long scratchBytes(void) {
+    return atomic_load(&ScratchBytes);
+}
@@ -0,0 +1,45 @@
+#ifndef MEDIA_H
+#define MEDIA_H
+
+#include <sys/resource.h>
+#include "sds.h"
+
+/* Resource usage of the child processes run for a stage, as reported by
+ * wait4(). Figures of multiple processes are accumulated. */
+typedef struct procStats {
+    int procs;              /* Number of processes accounted. */
+    double utime, stime;    /* User and system CPU seconds. */
+    long maxrss;            /* Peak RSS of the biggest process, kilobytes. */
+    long nvcsw, nivcsw;     /* Voluntary and involuntary context switches. */
+} procStats;
+
+/* An intermediate audio file, kept in a memfd or in the spool directory.
+ * Either way 'path' can be opened by us and by the child processes. */
+typedef struct scratchFile {
+    int fd;                 /* The memfd, or -1 if in the spool. */
+    long long size;         /* Bytes accounted by scratchAccount(). */
+    char path[256];         /* Empty if not created or released. */
+} scratchFile;
+
+/* Levels measured by checkAudio(), in dBFS. */
+typedef struct audioLevels {
+    double rms_db, peak_db;
+    double clip_ratio;      /* Fraction of clipped samples. */
+    double speech_ratio;    /* Fraction of energy in the speech band. */
+    double gain_db;         /* Gain applied by normalization, or zero. */
+} audioLevels;
+
+void procStatsAdd(procStats *ps, const struct rusage *ru);
+int runCommand(procStats *ps, sds *out, const char *cmd, ...);
+double ffprobeDuration(const char *path, procStats *ps);
+double getDuration(const char *path, procStats *ps);
+int toWav(const char *in, const char *out, double duration, procStats *ps);
+sds wavSlice(const char *path, double offset, double duration);
+int checkAudio(const char *wav, audioLevels *al);
+int scratchInit(const char *spool);
+int scratchCreate(scratchFile *sf, const char *name);
+void scratchAccount(scratchFile *sf);
+void scratchRelease(scratchFile *sf);
+long long scratchBytes(void);
+
+#endif
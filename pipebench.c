@@ -0,0 +1,262 @@
+/* Pipeline benchmark: runs every audio file of a reference corpus through
+ * each stage of the pipeline the bot uses (duration probe, with ffprobe and
+ * with the native parser, conversion to 16 kHz PCM, padding of short clips,
+ * transcription with each model), reporting wall time, CPU time and peak
+ * RSS per stage and per format.
+ *
+ * Usage: ./pipebench [--no-transcribe] [--model <base|medium>]
+ *                    [--whisper <path>] <corpus dir>
+ *
+ * Each stage runs in a forked process that is reaped with wait4(), so the
+ * CPU time and peak RSS include the external tools (ffprobe, ffmpeg,
+ * whisper-cli) the stage runs. The native probe runs in process instead,
+ * since that's how the bot uses it: its peak RSS is not reported, and a
+ * warning is printed when it disagrees with ffprobe by more than 0.5
+ * seconds. The format is the file extension. Output
+ * is tab separated, one line per stage and format, plus an "all" line
+ * per stage. */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "sds.h"
+#include "xmalloc.h"
+#include "config.h"
+#include "media.h"
+#include "probe.h"
+
+#define STAGE_PROBE 0
+#define STAGE_PROBE_NATIVE 1
+#define STAGE_CONVERT 2
+#define STAGE_PAD 3
+#define STAGE_TRANSCRIBE_BASE 4
+#define STAGE_TRANSCRIBE_MEDIUM 5
+#define NUM_STAGES 6
+
+const char *StageNames[NUM_STAGES] = {
+    "probe", "probe-native", "convert", "pad", "transcribe-base",
+    "transcribe-medium"
+};
+
+/* Accumulated figures for a (stage, format) pair. */
+typedef struct stageStats {
+    int stage;
+    char format[16];
+    int files, failed;
+    double audio;           /* Audio seconds processed. */
+    double wall, cpu;       /* Seconds. */
+    long maxrss;            /* Peak RSS, kilobytes. */
+} stageStats;
+
+stageStats *Stats = NULL;
+int NumStats = 0;
+const char *WhisperPath = WHISPER_PATH;
+
+long long ustime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+stageStats *getStats(int stage, const char *format) {
+    for (int j = 0; j < NumStats; j++)
+        if (Stats[j].stage == stage && !strcmp(Stats[j].format,format))
+            return Stats+j;
+    Stats = xrealloc(Stats,sizeof(stageStats)*(NumStats+1));
+    stageStats *st = Stats+NumStats++;
+    memset(st,0,sizeof(*st));
+    st->stage = stage;
+    snprintf(st->format,sizeof(st->format),"%s",format);
+    return st;
+}
+
+double cpuSeconds(struct rusage *ru) {
+    return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec/1e6 +
+           ru->ru_stime.tv_sec + ru->ru_stime.tv_usec/1e6;
+}
+
+/* Run the native probe in process. Return 1 if it succeeded. */
+int runNativeProbe(const char *format, const char *in, double duration) {
+    struct rusage ru0, ru1;
+    getrusage(RUSAGE_SELF,&ru0);
+    long long start = ustime();
+    double dur = probeDuration(in);
+    long long end = ustime();
+    getrusage(RUSAGE_SELF,&ru1);
+
+    if (dur >= 0 && (dur < duration-0.5 || dur > duration+0.5))
+        fprintf(stderr,"%s: native probe %.2fs, ffprobe %.2fs\n",
+                in, dur, duration);
+
+    stageStats *st = getStats(STAGE_PROBE_NATIVE,format);
+    st->files++;
+    if (dur < 0) st->failed++;
+    st->audio += duration;
+    st->wall += (end-start)/1e6;
+    st->cpu += cpuSeconds(&ru1)-cpuSeconds(&ru0);
+    return dur >= 0;
+}
+
+/* Run the specified stage in a child process and account its resource
+ * usage. Return 1 if the stage succeeded. */
+int runStage(int stage, const char *format, const char *in, const char *wav,
+             double duration)
+{
+    if (stage == STAGE_PROBE_NATIVE)
+        return runNativeProbe(format,in,duration);
+
+    long long start = ustime();
+    pid_t pid = fork();
+    if (pid == -1) return 0;
+    if (pid == 0) {
+        int ok = 0;
+        switch(stage) {
+        case STAGE_PROBE:
+            ok = ffprobeDuration(in,NULL) >= 0;
+            break;
+        case STAGE_CONVERT:
+            /* Never pad here: padding is measured on its own. */
+            ok = toWav(in,wav,duration < SHORT_AUDIO_THRESHOLD ?
+                              SHORT_AUDIO_THRESHOLD : duration,NULL) == 0;
+            break;
+        case STAGE_PAD:
+            ok = toWav(in,wav,0,NULL) == 0;
+            break;
+        case STAGE_TRANSCRIBE_BASE:
+        case STAGE_TRANSCRIBE_MEDIUM:
+            ok = runCommand(NULL,NULL,WhisperPath,
+                    "-m", stage == STAGE_TRANSCRIBE_BASE ? MODEL_BASE :
+                                                           MODEL_MEDIUM,
+                    "-f", wav, "-np", "-nt", NULL) == 0;
+            break;
+        }
+        _exit(ok ? 0 : 1);
+    }
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid,&status,0,&ru) == -1) return 0;
+    int ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    stageStats *st = getStats(stage,format);
+    st->files++;
+    if (!ok) st->failed++;
+    st->audio += duration;
+    st->wall += (ustime()-start)/1e6;
+    st->cpu += cpuSeconds(&ru);
+    if (ru.ru_maxrss > st->maxrss) st->maxrss = ru.ru_maxrss;
+    return ok;
+}
+
+void benchFile(const char *path, const char *format, int *stages) {
+    char wav[64];
+    snprintf(wav,sizeof(wav),"/tmp/pipebench_%d.wav",(int)getpid());
+
+    /* The duration is needed by the other stages, so get it outside the
+     * measured stage as well. We use the ffprobe figure as reference for
+     * the native probe. */
+    double duration = ffprobeDuration(path,NULL);
+    if (duration < 0) {
+        fprintf(stderr,"Skipping %s: can't read duration\n", path);
+        return;
+    }
+    runStage(STAGE_PROBE,format,path,wav,duration);
+    runStage(STAGE_PROBE_NATIVE,format,path,wav,duration);
+    runStage(STAGE_PAD,format,path,wav,duration);
+    if (runStage(STAGE_CONVERT,format,path,wav,duration)) {
+        for (int s = STAGE_TRANSCRIBE_BASE; s < NUM_STAGES; s++)
+            if (stages[s]) runStage(s,format,path,wav,duration);
+    }
+    unlink(wav);
+}
+
+void printStats(stageStats *st) {
+    printf("%s\t%s\t%d\t%d\t%.1f\t%.6f\t%.6f\t%ld\n",
+           StageNames[st->stage], st->format, st->files, st->failed,
+           st->audio, st->wall, st->cpu, st->maxrss);
+}
+
+int main(int argc, char **argv) {
+    const char *dirname = NULL;
+    int stages[NUM_STAGES] = {1,1,1,1,1,1};
+    int models_given = 0;
+
+    for (int j = 1; j < argc; j++) {
+        int morearg = argc-j-1;
+        if (!strcmp(argv[j],"--no-transcribe")) {
+            stages[STAGE_TRANSCRIBE_BASE] = 0;
+            stages[STAGE_TRANSCRIBE_MEDIUM] = 0;
+        } else if (!strcmp(argv[j],"--model") && morearg) {
+            if (!models_given) {
+                stages[STAGE_TRANSCRIBE_BASE] = 0;
+                stages[STAGE_TRANSCRIBE_MEDIUM] = 0;
+                models_given = 1;
+            }
+            j++;
+            if (!strcmp(argv[j],"base")) stages[STAGE_TRANSCRIBE_BASE] = 1;
+            else if (!strcmp(argv[j],"medium"))
+                stages[STAGE_TRANSCRIBE_MEDIUM] = 1;
+        } else if (!strcmp(argv[j],"--whisper") && morearg) {
+            WhisperPath = argv[++j];
+        } else if (argv[j][0] != '-' && dirname == NULL) {
+            dirname = argv[j];
+        } else {
+            dirname = NULL;
+            break;
+        }
+    }
+    if (dirname == NULL) {
+        fprintf(stderr,"Usage: %s [--no-transcribe] [--model <base|medium>] "
+                       "[--whisper <path>] <corpus dir>\n", argv[0]);
+        exit(1);
+    }
+
+    DIR *dir = opendir(dirname);
+    if (dir == NULL) {
+        perror("Opening the corpus directory");
+        exit(1);
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char *ext = strrchr(de->d_name,'.');
+        char format[16];
+        snprintf(format,sizeof(format),"%s",ext ? ext+1 : "none");
+        for (char *p = format; *p; p++) *p = tolower(*p);
+        sds path = sdscatprintf(sdsempty(),"%s/%s",dirname,de->d_name);
+        benchFile(path,format,stages);
+        sdsfree(path);
+    }
+    closedir(dir);
+
+    printf("stage\tformat\tfiles\tfailed\taudio_s\twall_s\tcpu_s\t"
+           "peak_rss_kb\n");
+    for (int s = 0; s < NUM_STAGES; s++) {
+        stageStats all = {.stage = s, .format = "all"};
+        int found = 0;
+        for (int j = 0; j < NumStats; j++) {
+            stageStats *st = Stats+j;
+            if (st->stage != s) continue;
+            printStats(st);
+            all.files += st->files;
+            all.failed += st->failed;
+            all.audio += st->audio;
+            all.wall += st->wall;
+            all.cpu += st->cpu;
+            if (st->maxrss > all.maxrss) all.maxrss = st->maxrss;
+            found = 1;
+        }
+        if (found) printStats(&all);
+    }
+    return 0;
+}
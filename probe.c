@@ -0,0 +1,404 @@
+/* ============================================================================
+ * Native duration probe.
+ *
+ * For the formats we actually receive the duration is available in the
+ * container headers, so there is no need to start ffprobe just to read
+ * one number. We only read the few bytes needed:
+ *
+ *  WAV:  data chunk size / byte rate from the fmt chunk.
+ *  FLAC: total samples / sample rate from STREAMINFO.
+ *  Ogg:  granule position of the last page, Opus and Vorbis.
+ *  MP4:  duration / timescale from mvhd (or the first mdhd).
+ *  MP3:  frame count from the Xing/Info or VBRI header, otherwise the
+ *        audio size / bitrate, if frames sampled across the file agree.
+ *
+ * Anything else, or any inconsistency, returns -1 so that the caller can
+ * fall back to ffprobe.
+ * ==========================================================================*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include "probe.h"
+
+#define RD16LE(p) ((uint32_t)(p)[0] | (uint32_t)(p)[1]<<8)
+#define RD32LE(p) (RD16LE(p) | (uint32_t)(p)[2]<<16 | (uint32_t)(p)[3]<<24)
+#define RD64LE(p) ((uint64_t)RD32LE(p) | (uint64_t)RD32LE((p)+4)<<32)
+#define RD32BE(p) ((uint32_t)(p)[0]<<24 | (uint32_t)(p)[1]<<16 | \
+                   (uint32_t)(p)[2]<<8 | (uint32_t)(p)[3])
+#define RD64BE(p) ((uint64_t)RD32BE(p)<<32 | (uint64_t)RD32BE((p)+4))
+
+/* Read exactly 'len' bytes at 'off'. Returns 0 on success, -1 on short
+ * read or error. */
+static int readAt(int fd, void *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, (char*)buf+done, len-done, off+done);
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/* Size of the ID3v2 tag at 'off', including its header, or 0 if there is
+ * no tag. */
+static off_t id3Size(int fd, off_t off) {
+    unsigned char h[10];
+    if (readAt(fd, h, 10, off) == -1 || memcmp(h, "ID3", 3)) return 0;
+    off_t size = (h[6]&0x7f)<<21 | (h[7]&0x7f)<<14 | (h[8]&0x7f)<<7 |
+                 (h[9]&0x7f);
+    return 10 + size + ((h[5] & 0x10) ? 10 : 0);
+}
+
+/* ---------------------------------- WAV ---------------------------------- */
+
+static double probeWav(int fd, off_t filesize) {
+    unsigned char h[16];
+    off_t off = 12;
+    uint32_t byterate = 0;
+
+    while (readAt(fd, h, 8, off) == 0) {
+        uint32_t len = RD32LE(h+4);
+        if (!memcmp(h, "fmt ", 4)) {
+            if (len < 16 || readAt(fd, h, 16, off+8) == -1) return -1;
+            byterate = RD32LE(h+8);
+        } else if (!memcmp(h, "data", 4)) {
+            if (byterate == 0) return -1;
+            /* Streamed WAVs may have a bogus size: trust the file. */
+            if (len == 0 || len == 0xffffffff || off+8+len > filesize)
+                len = filesize-off-8;
+            return (double)len / byterate;
+        }
+        off += 8 + len + (len & 1);
+    }
+    return -1;
+}
+
+/* ---------------------------------- FLAC --------------------------------- */
+
+static double probeFlac(int fd, off_t off) {
+    unsigned char b[4+34];
+    /* STREAMINFO is mandatory and always the first metadata block. */
+    if (readAt(fd, b, sizeof(b), off+4) == -1 || (b[0] & 0x7f) != 0)
+        return -1;
+    unsigned char *si = b+4;
+    uint32_t rate = si[10]<<12 | si[11]<<4 | si[12]>>4;
+    uint64_t samples = (uint64_t)(si[13]&0x0f)<<32 | RD32BE(si+14);
+    if (rate == 0 || samples == 0) return -1;
+    return (double)samples / rate;
+}
+
+/* ---------------------------------- Ogg ---------------------------------- */
+
+#define OGG_TAIL 65536  /* An Ogg page is at most 65307 bytes. */
+
+static double probeOgg(int fd, off_t filesize) {
+    /* The first page has the codec identification header. */
+    unsigned char h[27+255+32];
+    if (readAt(fd, h, 27, 0) == -1) return -1;
+    uint32_t serial = RD32LE(h+14);
+    int nseg = h[26];
+    if (readAt(fd, h+27, nseg+19, 27) == -1) return -1;
+    unsigned char *pkt = h+27+nseg;
+
+    uint32_t rate;
+    uint64_t preskip = 0;
+    if (!memcmp(pkt, "OpusHead", 8)) {
+        rate = 48000;   /* Opus granules are always at 48 kHz. */
+        preskip = RD16LE(pkt+10);
+    } else if (!memcmp(pkt, "\x01vorbis", 7)) {
+        rate = RD32LE(pkt+12);
+    } else {
+        return -1;
+    }
+    if (rate == 0) return -1;
+
+    /* Find the last page of the same stream with a granule position. */
+    unsigned char tail[OGG_TAIL];
+    off_t start = filesize > OGG_TAIL ? filesize-OGG_TAIL : 0;
+    size_t len = filesize-start;
+    if (readAt(fd, tail, len, start) == -1) return -1;
+    for (ssize_t j = (ssize_t)len-27; j >= 0; j--) {
+        unsigned char *p = tail+j;
+        if (memcmp(p, "OggS", 4) || p[4] != 0 || RD32LE(p+14) != serial)
+            continue;
+        uint64_t granule = RD64LE(p+6);
+        if (granule == UINT64_MAX) continue;
+        if (granule < preskip) return -1;
+        return (double)(granule-preskip) / rate;
+    }
+    return -1;
+}
+
+/* ---------------------------------- MP4 ---------------------------------- */
+
+/* Find the box 'type' among the boxes between 'off' and 'end'. On success
+ * the payload range is stored in *pstart / *pend and 0 is returned. */
+static int mp4FindBox(int fd, off_t off, off_t end, const char *type,
+                      off_t *pstart, off_t *pend)
+{
+    unsigned char h[16];
+    while (off+8 <= end) {
+        if (readAt(fd, h, 8, off) == -1) return -1;
+        uint64_t size = RD32BE(h);
+        off_t hlen = 8;
+        if (size == 1) {
+            if (readAt(fd, h+8, 8, off+8) == -1) return -1;
+            size = RD64BE(h+8);
+            hlen = 16;
+        } else if (size == 0) {
+            size = end-off;
+        }
+        if (size < (uint64_t)hlen || off+(off_t)size > end) return -1;
+        if (!memcmp(h+4, type, 4)) {
+            *pstart = off+hlen;
+            *pend = off+size;
+            return 0;
+        }
+        off += size;
+    }
+    return -1;
+}
+
+/* Parse a mvhd or mdhd payload: both start with version and flags, two
+ * timestamps, then timescale and duration. */
+static double mp4HeaderDuration(int fd, off_t off) {
+    unsigned char b[32];
+    if (readAt(fd, b, 32, off) == -1) return -1;
+    uint32_t timescale;
+    uint64_t duration;
+    if (b[0] == 1) {
+        timescale = RD32BE(b+20);
+        duration = RD64BE(b+24);
+    } else {
+        timescale = RD32BE(b+12);
+        duration = RD32BE(b+16);
+    }
+    if (timescale == 0 || duration == 0 || duration == UINT32_MAX ||
+        duration == UINT64_MAX) return -1;
+    return (double)duration / timescale;
+}
+
+static double probeMp4(int fd, off_t filesize) {
+    off_t moov, moov_end, s, e;
+    if (mp4FindBox(fd, 0, filesize, "moov", &moov, &moov_end) == -1)
+        return -1;
+    if (mp4FindBox(fd, moov, moov_end, "mvhd", &s, &e) == 0) {
+        double dur = mp4HeaderDuration(fd, s);
+        if (dur > 0) return dur;
+    }
+    /* Fragmented or odd files may have no movie duration: use the media
+     * header of the first track. */
+    if (mp4FindBox(fd, moov, moov_end, "trak", &s, &e) == -1 ||
+        mp4FindBox(fd, s, e, "mdia", &s, &e) == -1 ||
+        mp4FindBox(fd, s, e, "mdhd", &s, &e) == -1) return -1;
+    return mp4HeaderDuration(fd, s);
+}
+
+/* ---------------------------------- MP3 ---------------------------------- */
+
+static const uint16_t Mp3Bitrates[2][3][16] = {
+    { /* MPEG 1: layer 1, 2, 3. */
+        {0,32,64,96,128,160,192,224,256,288,320,352,384,416,448,0},
+        {0,32,48,56,64,80,96,112,128,160,192,224,256,320,384,0},
+        {0,32,40,48,56,64,80,96,112,128,160,192,224,256,320,0},
+    },
+    { /* MPEG 2 and 2.5: layer 1, 2, 3. */
+        {0,32,48,56,64,80,96,112,128,144,160,176,192,224,256,0},
+        {0,8,16,24,32,40,48,56,64,80,96,112,128,144,160,0},
+        {0,8,16,24,32,40,48,56,64,80,96,112,128,144,160,0},
+    }
+};
+
+static const uint16_t Mp3Rates[3][3] = {
+    {44100,48000,32000},    /* MPEG 1 */
+    {22050,24000,16000},    /* MPEG 2 */
+    {11025,12000,8000},     /* MPEG 2.5 */
+};
+
+typedef struct mp3Frame {
+    int mpeg;           /* 0: MPEG 1, 1: MPEG 2, 2: MPEG 2.5. */
+    int layer;          /* 0, 1, 2 for layer 1, 2, 3. */
+    int mono;
+    uint32_t rate;
+    uint32_t br;        /* Bitrate in bits per second. */
+    uint32_t samples;   /* Samples per frame. */
+    uint32_t len;       /* Frame length in bytes. */
+} mp3Frame;
+
+/* Parse a frame header. Returns 0 if valid. */
+static int mp3ParseHeader(const unsigned char *h, mp3Frame *f) {
+    if (h[0] != 0xff || (h[1] & 0xe0) != 0xe0) return -1;
+    int ver = (h[1]>>3) & 3, layer = (h[1]>>1) & 3;
+    int bri = h[2]>>4, sri = (h[2]>>2) & 3, pad = (h[2]>>1) & 1;
+    if (ver == 1 || layer == 0 || bri == 0 || bri == 15 || sri == 3)
+        return -1;
+
+    f->mpeg = ver == 3 ? 0 : (ver == 2 ? 1 : 2);
+    f->layer = 3-layer;
+    f->mono = (h[3]>>6) == 3;
+    f->rate = Mp3Rates[f->mpeg][sri];
+    uint32_t br = Mp3Bitrates[f->mpeg ? 1 : 0][f->layer][bri] * 1000;
+    f->br = br;
+    if (f->layer == 0) {
+        f->samples = 384;
+        f->len = (12*br/f->rate + pad) * 4;
+    } else if (f->layer == 1 || f->mpeg == 0) {
+        f->samples = 1152;
+        f->len = 144*br/f->rate + pad;
+    } else {
+        f->samples = 576;
+        f->len = 72*br/f->rate + pad;
+    }
+    return 0;
+}
+
+/* Frame count from the Xing/Info or VBRI header of the first frame, or 0
+ * if there is none. */
+static uint32_t mp3HeaderFrames(int fd, off_t off, mp3Frame *f) {
+    unsigned char b[18];
+    int side = f->mpeg == 0 ? (f->mono ? 17 : 32) : (f->mono ? 9 : 17);
+    if (readAt(fd, b, 12, off+4+side) == 0 &&
+        (!memcmp(b, "Xing", 4) || !memcmp(b, "Info", 4)) &&
+        (RD32BE(b+4) & 1)) return RD32BE(b+8);
+    if (readAt(fd, b, 18, off+36) == 0 && !memcmp(b, "VBRI", 4))
+        return RD32BE(b+14);
+    return 0;
+}
+
+/* True if 'a' and 'b' are frames of the same CBR stream. */
+static int mp3SameStream(const mp3Frame *a, const mp3Frame *b) {
+    return a->mpeg == b->mpeg && a->layer == b->layer &&
+           a->rate == b->rate && a->br == b->br;
+}
+
+/* True if there is a valid frame header at 'off' compatible with 'f'. */
+static int mp3FrameAt(int fd, off_t off, mp3Frame *f) {
+    unsigned char h[4];
+    mp3Frame next;
+    return readAt(fd, h, 4, off) == 0 && mp3ParseHeader(h, &next) == 0 &&
+           next.mpeg == f->mpeg && next.layer == f->layer &&
+           next.rate == f->rate;
+}
+
+/* Return where the audio ends: before the ID3v1 tag and the APE tag at
+ * the end of the file, if any. */
+static off_t mp3AudioEnd(int fd, off_t filesize) {
+    unsigned char b[32];
+    off_t end = filesize;
+    if (end >= 128 && readAt(fd, b, 3, end-128) == 0 &&
+        !memcmp(b, "TAG", 3)) end -= 128;
+    if (end >= 32 && readAt(fd, b, 32, end-32) == 0 &&
+        !memcmp(b, "APETAGEX", 8))
+    {
+        /* The size in the footer doesn't count the header. */
+        end -= RD32LE(b+12) + ((RD32LE(b+20) & 0x80000000) ? 32 : 0);
+    }
+    return end;
+}
+
+/* Look for frames of the stream of 'f' in the bytes from 'pos' to 'end'.
+ * The first frame found must be followed by MP3_SAMPLE_FRAMES-1 more or,
+ * if 'toend' is true, by frames up to 'end', the last one possibly
+ * truncated. Returns the offset of the first frame, or -1. */
+#define MP3_SAMPLE_FRAMES 3
+#define MP3_SAMPLE_BYTES 8192
+static off_t mp3Sample(int fd, off_t pos, off_t end, const mp3Frame *f,
+                       int toend)
+{
+    unsigned char buf[MP3_SAMPLE_BYTES];
+    size_t n = end-pos < MP3_SAMPLE_BYTES ? end-pos : MP3_SAMPLE_BYTES;
+    if (readAt(fd, buf, n, pos) == -1) return -1;
+
+    for (size_t i = 0; i+4 <= n; i++) {
+        size_t j = i;
+        int frames = 0;
+        mp3Frame cur;
+        while (j+4 <= n && mp3ParseHeader(buf+j, &cur) == 0 &&
+               mp3SameStream(f, &cur))
+        {
+            frames++;
+            j += cur.len;
+        }
+        if (toend ? frames && j+4 > n : frames >= MP3_SAMPLE_FRAMES)
+            return pos+i;
+    }
+    return -1;
+}
+
+/* MP3 is also what we try for anything we don't recognize, so the file
+ * must start with a frame, right after the ID3v2 tag if any, followed by
+ * another one.
+ *
+ * Without a VBR header the stream should be CBR, and the duration is the
+ * size of the audio over the bitrate. Reading every frame header would
+ * read the whole file, so this is checked on samples instead: the frames
+ * at a few points in the middle, and the last ones, that must reach the
+ * end of the audio, must have the first frame bitrate, and be where a
+ * frame of that bitrate falls (padding keeps frames within a slot of
+ * it). A VBR file without header, or junk in or after the audio, returns
+ * -1. */
+static double probeMp3(int fd, off_t off, off_t filesize) {
+    unsigned char h[4];
+    mp3Frame f;
+    if (readAt(fd, h, 4, off) == -1 || mp3ParseHeader(h, &f) == -1 ||
+        !mp3FrameAt(fd, off+f.len, &f)) return -1;
+
+    uint32_t frames = mp3HeaderFrames(fd, off, &f);
+    if (frames) return (double)frames * f.samples / f.rate;
+
+    off_t end = mp3AudioEnd(fd, filesize);
+    if (end <= off) return -1;
+    double avglen = (double)f.samples/8 * f.br / f.rate;
+    off_t tail = end-off > MP3_SAMPLE_BYTES ? end-MP3_SAMPLE_BYTES : off;
+    for (int k = 1; k <= 4; k++) {
+        off_t pos = k < 4 ? off + (tail-off)/4*k : tail;
+        off_t at = mp3Sample(fd, pos, end, &f, k == 4);
+        if (at == -1) return -1;
+        double frames = (at-off) / avglen;
+        if (fabs(frames-round(frames)) * avglen > 4) return -1;
+    }
+    return (double)(end-off) * 8 / f.br;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Return the duration in seconds of the audio file at 'path', or -1 if the
+ * format is not supported or the headers can't be trusted. */
+double probeDuration(const char *path) {
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd == -1) return -1;
+
+    double dur = -1;
+    struct stat st;
+    unsigned char h[12];
+    if (fstat(fd, &st) == -1 || readAt(fd, h, 12, 0) == -1) goto done;
+
+    if (!memcmp(h, "RIFF", 4) && !memcmp(h+8, "WAVE", 4)) {
+        dur = probeWav(fd, st.st_size);
+    } else if (!memcmp(h, "OggS", 4)) {
+        dur = probeOgg(fd, st.st_size);
+    } else if (!memcmp(h+4, "ftyp", 4)) {
+        dur = probeMp4(fd, st.st_size);
+    } else {
+        /* FLAC and MP3 may start with an ID3v2 tag. */
+        off_t off = id3Size(fd, 0);
+        if (readAt(fd, h, 4, off) == -1) goto done;
+        if (!memcmp(h, "fLaC", 4))
+            dur = probeFlac(fd, off);
+        else
+            dur = probeMp3(fd, off, st.st_size);
+    }
+
+done:
+    close(fd);
+    if (!isfinite(dur) || dur < 0) return -1;
+    return dur;
+}
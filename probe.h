@@ -0,0 +1,6 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+double probeDuration(const char *path);
+
+#endif
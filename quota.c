@@ -0,0 +1,237 @@
+/* ============================================================================
+ * Per-user and per-chat quotas.
+ *
+ * Every user, and every group chat, has a token bucket of audio seconds,
+ * holding at most USER_QUOTA / CHAT_QUOTA seconds and refilled at a rate
+ * that fills it in QUOTA_WINDOW seconds. Buckets live in memory, so checking
+ * a request costs no database access: they are loaded once at startup and
+ * written back periodically by quotaPersist(). Buckets that are full again
+ * are the same as buckets never used, so they are dropped, both from memory
+ * and from the database.
+ * ==========================================================================*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "botlib.h"
+#include "config.h"
+#include "quota.h"
+
+#define QUOTA_TABLE_SIZE 4096
+
+typedef struct quotaBucket {
+    int kind;               /* QUOTA_USER or QUOTA_CHAT. */
+    int64_t id;
+    double tokens;          /* Audio seconds available. Can be negative. */
+    double updated;         /* Unix time of the last refill. */
+    int dirty;              /* Changed since the last quotaPersist(). */
+    struct quotaBucket *next;
+} quotaBucket;
+
+static pthread_mutex_t QuotaLock = PTHREAD_MUTEX_INITIALIZER;
+static quotaBucket *QuotaTable[QUOTA_TABLE_SIZE];
+static int QuotaLoaded = 0;
+static const double QuotaSize[2] = {USER_QUOTA, CHAT_QUOTA};
+
+static double quotaNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double quotaRate(int kind) {
+    return QuotaSize[kind] / QUOTA_WINDOW;
+}
+
+static unsigned int quotaHash(int kind, int64_t id) {
+    uint64_t h = (uint64_t)id * 0x9e3779b97f4a7c15ULL + kind;
+    return (h >> 32) % QUOTA_TABLE_SIZE;
+}
+
+/* Return the bucket of the user or chat 'id', creating a full one if it
+ * does not exist. The bucket is refilled up to 'now'. Must be called with
+ * QuotaLock held. */
+static quotaBucket *quotaGet(int kind, int64_t id, double now) {
+    unsigned int h = quotaHash(kind, id);
+    quotaBucket *b = QuotaTable[h];
+    while (b && (b->kind != kind || b->id != id)) b = b->next;
+    if (b == NULL) {
+        b = xmalloc(sizeof(*b));
+        b->kind = kind;
+        b->id = id;
+        b->tokens = QuotaSize[kind];
+        b->updated = now;
+        b->dirty = 0;
+        b->next = QuotaTable[h];
+        QuotaTable[h] = b;
+    }
+    if (now > b->updated) {
+        b->tokens += (now - b->updated) * quotaRate(kind);
+        if (b->tokens > QuotaSize[kind]) b->tokens = QuotaSize[kind];
+        b->updated = now;
+    }
+    return b;
+}
+
+/* Load the buckets saved by previous runs. Only the first call does
+ * something. */
+void quotaLoad(sqlite3 *db) {
+    pthread_mutex_lock(&QuotaLock);
+    if (QuotaLoaded) {
+        pthread_mutex_unlock(&QuotaLock);
+        return;
+    }
+    QuotaLoaded = 1;
+
+    sqlRow row;
+    double now = quotaNow();
+    sqlSelect(db, &row, "SELECT kind, id, tokens, updated FROM Quota");
+    while (sqlNextRow(&row)) {
+        int kind = row.col[0].i;
+        if (kind != QUOTA_USER && kind != QUOTA_CHAT) continue;
+        quotaBucket *b = quotaGet(kind, row.col[1].i, row.col[3].i);
+        b->tokens = row.col[2].d;
+        quotaGet(kind, b->id, now);
+    }
+    pthread_mutex_unlock(&QuotaLock);
+}
+
+/* Transcribers don't own the quotas, the ingest process does: reload the
+ * buckets of 'user' and 'chat' as it last persisted them, so that
+ * quotaTake() checks against them. A bucket not in the table is full. */
+void quotaRefresh(sqlite3 *db, int64_t user, int64_t chat) {
+    for (int kind = QUOTA_USER; kind <= QUOTA_CHAT; kind++) {
+        if (kind == QUOTA_CHAT && chat == user) break;
+        int64_t id = kind == QUOTA_USER ? user : chat;
+        double now = quotaNow(), tokens = QuotaSize[kind], updated = now;
+        sqlRow row;
+        if (sqlSelectOneRow(db, &row, "SELECT tokens, updated FROM Quota "
+                "WHERE kind=?i AND id=?i", (int64_t)kind, id) == SQLITE_ROW)
+        {
+            tokens = row.col[0].d;
+            updated = row.col[1].i;
+            sqlEnd(&row);
+        }
+        pthread_mutex_lock(&QuotaLock);
+        quotaBucket *b = quotaGet(kind, id, now);
+        b->tokens = tokens;
+        b->updated = updated;
+        quotaGet(kind, id, now);
+        pthread_mutex_unlock(&QuotaLock);
+    }
+}
+
+/* Try to take 'seconds' of audio from the quota of 'user' and of the
+ * group chat 'chat' (ignored for private chats, where it is the user).
+ * If 'seconds' is 0, the duration is not known yet: the request is
+ * accepted if the quotas are not exhausted, and should be checked again
+ * with the real duration once known.
+ *
+ * Returns 1 if the request is within quota, and the seconds were taken.
+ * Otherwise 0 is returned, nothing is taken, and the quota that would
+ * be exceeded (QUOTA_USER / QUOTA_CHAT) and the time when the request
+ * would fit are returned by reference. */
+int quotaTake(int64_t user, int64_t chat, double seconds, int *kind,
+              time_t *reset)
+{
+    pthread_mutex_lock(&QuotaLock);
+    double now = quotaNow(), when = 0;
+    quotaBucket *b[2];
+    int n = 0;
+    b[n++] = quotaGet(QUOTA_USER, user, now);
+    if (chat != user) b[n++] = quotaGet(QUOTA_CHAT, chat, now);
+
+    for (int j = 0; j < n; j++) {
+        /* Files longer than the bucket size can't wait for more than a
+         * full bucket. */
+        double need = seconds > 0 ? seconds : 1;
+        if (need > QuotaSize[b[j]->kind]) need = QuotaSize[b[j]->kind];
+        if (b[j]->tokens >= need) continue;
+        double t = now + (need - b[j]->tokens) / quotaRate(b[j]->kind);
+        if (t > when) {
+            when = t;
+            *kind = b[j]->kind;
+        }
+    }
+    if (when == 0) {
+        for (int j = 0; j < n; j++) {
+            b[j]->tokens -= seconds;
+            b[j]->dirty = 1;
+        }
+    }
+    pthread_mutex_unlock(&QuotaLock);
+    if (when) *reset = when + 1;
+    return when == 0;
+}
+
+/* Give back 'seconds' to the quotas of 'user' and 'chat', for requests
+ * charged with quotaTake() and then not served. Negative values charge
+ * more, when the audio turned out to be longer than declared. */
+void quotaGive(int64_t user, int64_t chat, double seconds) {
+    if (seconds == 0) return;
+    pthread_mutex_lock(&QuotaLock);
+    double now = quotaNow();
+    for (int kind = QUOTA_USER; kind <= QUOTA_CHAT; kind++) {
+        if (kind == QUOTA_CHAT && chat == user) break;
+        int64_t id = kind == QUOTA_USER ? user : chat;
+        quotaBucket *b = quotaGet(kind, id, now);
+        b->tokens += seconds;
+        if (b->tokens > QuotaSize[kind]) b->tokens = QuotaSize[kind];
+        b->dirty = 1;
+    }
+    pthread_mutex_unlock(&QuotaLock);
+}
+
+/* Called from cron: every QUOTA_PERSIST_SECONDS write the buckets changed
+ * since the last call in a single transaction, and drop the full ones. */
+void quotaPersist(sqlite3 *db) {
+    static double last = 0;
+    double now = quotaNow();
+    if (now - last < QUOTA_PERSIST_SECONDS) return;
+    last = now;
+
+    /* Collect the changes with the lock held, write them without. */
+    quotaBucket *changed = NULL;
+    pthread_mutex_lock(&QuotaLock);
+    for (int h = 0; h < QUOTA_TABLE_SIZE; h++) {
+        quotaBucket **bp = &QuotaTable[h];
+        while (*bp) {
+            quotaBucket *b = *bp;
+            if (b->updated < now) quotaGet(b->kind, b->id, now);
+            int full = b->tokens >= QuotaSize[b->kind];
+            if (b->dirty || full) {
+                quotaBucket *c = xmalloc(sizeof(*c));
+                *c = *b;
+                c->dirty = full;    /* Reused as "delete" flag. */
+                c->next = changed;
+                changed = c;
+                b->dirty = 0;
+            }
+            if (full) {
+                *bp = b->next;
+                xfree(b);
+            } else {
+                bp = &b->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&QuotaLock);
+    if (changed == NULL) return;
+
+    sqlQuery(db, "BEGIN");
+    while (changed) {
+        quotaBucket *c = changed;
+        if (c->dirty)
+            sqlQuery(db, "DELETE FROM Quota WHERE kind=?i AND id=?i",
+                     (int64_t)c->kind, c->id);
+        else
+            sqlQuery(db, "INSERT OR REPLACE INTO Quota VALUES(?i,?i,?d,?i)",
+                     (int64_t)c->kind, c->id, c->tokens, (int64_t)c->updated);
+        changed = c->next;
+        xfree(c);
+    }
+    sqlQuery(db, "COMMIT");
+}
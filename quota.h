@@ -0,0 +1,25 @@
+#ifndef QUOTA_H
+#define QUOTA_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sqlite3.h>
+
+#define QUOTA_USER 0
+#define QUOTA_CHAT 1
+
+#define QUOTA_CREATE_TABLE \
+    "CREATE TABLE IF NOT EXISTS Quota(kind INT, " \
+                                     "id INT, " \
+                                     "tokens REAL, " \
+                                     "updated INT, " \
+                                     "PRIMARY KEY(kind, id));"
+
+void quotaLoad(sqlite3 *db);
+void quotaRefresh(sqlite3 *db, int64_t user, int64_t chat);
+int quotaTake(int64_t user, int64_t chat, double seconds, int *kind,
+              time_t *reset);
+void quotaGive(int64_t user, int64_t chat, double seconds);
+void quotaPersist(sqlite3 *db);
+
+#endif
@@ -0,0 +1,245 @@
+/* ============================================================================
+ * Bounded lock-free MPMC queue with priority classes.
+ *
+ * Every class is a ring of cells as in Dmitry Vyukov's bounded MPMC queue:
+ * each cell has a sequence number telling if it is free for the producer
+ * at a given position, or holds the item for the consumer at that
+ * position. Producers and consumers claim positions with a CAS on the
+ * enqueue / dequeue counters, then write or read the cell and publish it
+ * advancing its sequence number, so there are no locks on the fast path
+ * and a thread stalled in the middle only delays the position it claimed.
+ *
+ * Consumers take from the lowest class that is not empty: priority is
+ * strict, and a class can starve while the ones above it are busy. A
+ * consumer with its own policy across classes can look at their heads
+ * with ringPeek() and pop the one it chooses with ringPopClass(), as long
+ * as it is the only consumer, like the slot layer of whisperbot.c.
+ *
+ * The depth is a counter per class incremented when a producer claims a
+ * position, and decremented after the item was read: it never undercounts
+ * the items in the ring, and it is exact whenever no push or pop is in
+ * progress, unlike enqueue minus dequeue positions read at different
+ * times.
+ *
+ * ringPop() sleeps on a condition variable when the ring is still empty
+ * after yielding the CPU a few times, so that handoffs at a steady rate
+ * don't pay a sleep and a wakeup for every item. To not lose wakeups the
+ * consumer announces itself in 'sleepers' and checks the ring again before
+ * waiting, both under the mutex, while producers check 'sleepers' after
+ * publishing the item and signal under the same mutex: with full fences
+ * on both sides, either the consumer sees the item, or the producer sees
+ * the sleeper and signals it after it started waiting. Producers never
+ * take the mutex when nobody sleeps.
+ * ==========================================================================*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "ring.h"
+#include "xmalloc.h"
+
+#define RING_PAD 64             /* Keep hot counters on their own lines. */
+#define RING_SPINS 16           /* Tries before sleeping in ringPop(). */
+
+typedef struct ringCell {
+    atomic_size_t seq;
+    void *data;
+} ringCell;
+
+typedef struct ringClass {
+    ringCell *cells;
+    size_t mask;
+    char pad0[RING_PAD];
+    atomic_size_t enq;          /* Next position to push. */
+    char pad1[RING_PAD];
+    atomic_size_t deq;          /* Next position to pop. */
+    char pad2[RING_PAD];
+    atomic_size_t count;        /* Depth, see the top comment. */
+    char pad3[RING_PAD];
+} ringClass;
+
+struct ring {
+    int classes;
+    ringClass *class;
+    atomic_int sleepers;        /* Consumers in ringPop() about to wait. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/* Create a ring with 'classes' priority classes, each holding up to
+ * 'capacity' items, rounded up to a power of two. */
+ring *ringNew(int classes, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size *= 2;
+
+    ring *r = xmalloc(sizeof(*r));
+    r->classes = classes;
+    r->class = xmalloc(sizeof(ringClass)*classes);
+    for (int c = 0; c < classes; c++) {
+        ringClass *rc = r->class+c;
+        rc->cells = xmalloc(sizeof(ringCell)*size);
+        rc->mask = size-1;
+        for (size_t j = 0; j < size; j++)
+            atomic_init(&rc->cells[j].seq, j);
+        atomic_init(&rc->enq, 0);
+        atomic_init(&rc->deq, 0);
+        atomic_init(&rc->count, 0);
+    }
+    atomic_init(&r->sleepers, 0);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    return r;
+}
+
+/* Free the ring. Items still queued are not freed. */
+void ringFree(ring *r) {
+    for (int c = 0; c < r->classes; c++) xfree(r->class[c].cells);
+    xfree(r->class);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    xfree(r);
+}
+
+/* Queue 'item', that must not be NULL, in 'class'. Returns 0 on success,
+ * -1 if the class is full. Never blocks. */
+int ringPush(ring *r, int class, void *item) {
+    ringClass *rc = r->class+class;
+    ringCell *cell;
+    size_t pos = atomic_load_explicit(&rc->enq, memory_order_relaxed);
+    while (1) {
+        cell = rc->cells + (pos & rc->mask);
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&rc->enq, &pos, pos+1,
+                    memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (dif < 0) {
+            return -1;  /* The consumer of the previous lap is behind. */
+        } else {
+            pos = atomic_load_explicit(&rc->enq, memory_order_relaxed);
+        }
+    }
+    atomic_fetch_add_explicit(&rc->count, 1, memory_order_relaxed);
+    cell->data = item;
+    atomic_store_explicit(&cell->seq, pos+1, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&r->sleepers, memory_order_relaxed)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_signal(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+    return 0;
+}
+
+/* Pop an item from 'rc', or return NULL if it is empty. */
+static void *ringClassPop(ringClass *rc) {
+    ringCell *cell;
+    size_t pos = atomic_load_explicit(&rc->deq, memory_order_relaxed);
+    while (1) {
+        cell = rc->cells + (pos & rc->mask);
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&rc->deq, &pos, pos+1,
+                    memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&rc->deq, memory_order_relaxed);
+        }
+    }
+    void *item = cell->data;
+    atomic_store_explicit(&cell->seq, pos+rc->mask+1, memory_order_release);
+    atomic_fetch_sub_explicit(&rc->count, 1, memory_order_relaxed);
+    return item;
+}
+
+/* Return the first item of 'class' without popping it, or NULL if it is
+ * empty. Only stable if the caller is the only consumer. */
+void *ringPeek(ring *r, int class) {
+    ringClass *rc = r->class+class;
+    size_t pos = atomic_load_explicit(&rc->deq, memory_order_relaxed);
+    ringCell *cell = rc->cells + (pos & rc->mask);
+    size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    return seq == pos+1 ? cell->data : NULL;
+}
+
+/* Pop the first item of 'class', or return NULL if it is empty. */
+void *ringPopClass(ring *r, int class) {
+    return ringClassPop(r->class+class);
+}
+
+/* Pop the first item of the highest priority class that has one, storing
+ * the class in '*class' if not NULL. Returns NULL if the ring is empty.
+ * Never blocks. */
+void *ringTryPop(ring *r, int *class) {
+    for (int c = 0; c < r->classes; c++) {
+        void *item = ringClassPop(r->class+c);
+        if (item) {
+            if (class) *class = c;
+            return item;
+        }
+    }
+    return NULL;
+}
+
+/* Like ringTryPop(), but if the ring is empty wait up to 'timeout_ms'
+ * milliseconds for an item, or forever if it is -1. Returns NULL on
+ * timeout. */
+void *ringPop(ring *r, int *class, int timeout_ms) {
+    /* Give producers a chance first: sleeping makes them signal. */
+    void *item;
+    for (int j = 0; j < RING_SPINS; j++) {
+        if ((item = ringTryPop(r, class)) != NULL) return item;
+        sched_yield();
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (timeout_ms > 0) {
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&r->lock);
+    atomic_fetch_add_explicit(&r->sleepers, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    while ((item = ringTryPop(r, class)) == NULL) {
+        if (timeout_ms == -1) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        } else if (pthread_cond_timedwait(&r->cond, &r->lock, &ts) ==
+                   ETIMEDOUT)
+        {
+            item = ringTryPop(r, class);
+            break;
+        }
+    }
+    atomic_fetch_sub_explicit(&r->sleepers, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&r->lock);
+    return item;
+}
+
+/* Items queued in 'class', see the top comment. */
+size_t ringClassDepth(ring *r, int class) {
+    return atomic_load_explicit(&r->class[class].count,
+                                memory_order_relaxed);
+}
+
+/* Items queued in all the classes. */
+size_t ringDepth(ring *r) {
+    size_t n = 0;
+    for (int c = 0; c < r->classes; c++) n += ringClassDepth(r, c);
+    return n;
+}
@@ -0,0 +1,20 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+
+/* Bounded lock-free MPMC queue of pointers with priority classes, see
+ * ring.c. Class 0 has the highest priority. */
+typedef struct ring ring;
+
+ring *ringNew(int classes, size_t capacity);
+void ringFree(ring *r);
+int ringPush(ring *r, int class, void *item);
+void *ringTryPop(ring *r, int *class);
+void *ringPeek(ring *r, int class);
+void *ringPopClass(ring *r, int class);
+void *ringPop(ring *r, int *class, int timeout_ms);
+size_t ringDepth(ring *r);
+size_t ringClassDepth(ring *r, int class);
+
+#endif
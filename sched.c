@@ -0,0 +1,175 @@
+/* ============================================================================
+ * Scheduling policy. See sched.h.
+ * ==========================================================================*/
+
+#include "sched.h"
+#include "config.h"
+
+/* The policy used by the bot. The simulator creates its own ones. */
+schedPolicy SchedPolicy = {
+    .max_queue = MAX_QUEUE,
+    .max_audio = MAX_QUEUE_AUDIO,
+    .max_compute = {BASE_MAX_COMPUTE, MEDIUM_MAX_COMPUTE},
+    .sla = SLA_SECONDS,
+    .sla_rtf = SLA_RTF,
+    .chunk_seconds = CHUNK_SECONDS,
+    .aging = SCHED_AGING,
+    .slots = 1
+};
+
+static int schedSlots(const schedPolicy *p) {
+    return p->slots > 0 ? p->slots : 1;
+}
+
+/* Return the estimated compute seconds needed to complete the 'n' jobs
+ * in flight, except jobs[skip] (pass -1 to count all). Each job is costed
+ * at the real time factor 'rtf' of its model, and the ones not started
+ * yet at the one of 'model'. */
+double schedCompute(const double *rtf, const schedJob *jobs, int n,
+                    int skip, int model)
+{
+    double compute = 0;
+    for (int i = 0; i < n; i++) {
+        if (i == skip || jobs[i].remaining <= 0) continue;
+        int m = jobs[i].model == -1 ? model : jobs[i].model;
+        compute += (jobs[i].remaining - jobs[i].done)*rtf[m];
+    }
+    return compute;
+}
+
+/* Return 1 if a new job can be accepted. 'jobs' are the 'n' jobs in flight,
+ * the last one being the new job, and 'rtf' the real time factors of the
+ * models. Admission is about work, not job count: a job is refused if the
+ * audio in flight would exceed max_audio, the work in flight, even using
+ * the base model, would exceed its compute cap, or the job is not expected
+ * to finish within the SLA. max_queue is just a safety limit. The
+ * jobs are used by schedPredict(), so pass a copy. */
+int schedAdmit(const schedPolicy *p, const double *rtf, schedJob *jobs, int n) {
+    if (n > p->max_queue) return 0;
+
+    double audio = 0;
+    for (int i = 0; i < n; i++) audio += jobs[i].remaining - jobs[i].done;
+    if (audio > p->max_audio) return 0;
+    if (schedCompute(rtf, jobs, n, -1, SCHED_MODEL_BASE) / schedSlots(p) >
+        p->max_compute[SCHED_MODEL_BASE]) return 0;
+
+    double duration = jobs[n-1].remaining;
+    schedPredict(p, rtf, jobs, n);
+    return jobs[n-1].finish <= p->sla + p->sla_rtf*duration;
+}
+
+/* Return the model (SCHED_MODEL_*) a job should use, given the compute
+ * seconds needed by the other jobs in flight when it starts, if they used
+ * the medium model. When the backlog per slot is large we use the faster
+ * model, to clear it. */
+int schedSelectModel(const schedPolicy *p, double backlog) {
+    return backlog / schedSlots(p) >= p->max_compute[SCHED_MODEL_MEDIUM] ?
+           SCHED_MODEL_BASE : SCHED_MODEL_MEDIUM;
+}
+
+const char *schedModelName(int model) {
+    return model == SCHED_MODEL_BASE ? "base" : "medium";
+}
+
+/* Return how many seconds of audio the next chunk of a job should cover,
+ * given the seconds still to transcribe. Jobs release the transcription
+ * slot between chunks, so a long job can't keep short ones waiting for
+ * more than a chunk. A short tail is merged into the last chunk. */
+double schedChunk(const schedPolicy *p, double remaining) {
+    if (p->chunk_seconds <= 0 || remaining <= p->chunk_seconds*1.5)
+        return remaining;
+    return p->chunk_seconds;
+}
+
+/* Priority of a job waiting for the transcription slot: the slot goes to
+ * the waiter with the lowest value. This is shortest remaining audio first,
+ * so voice notes overtake long files between their chunks, but every
+ * second of waiting is worth 'aging' seconds of audio, so long jobs are
+ * not starved by a steady flow of short ones. */
+double schedPriority(const schedPolicy *p, double remaining, double waited) {
+    return remaining - p->aging*waited;
+}
+
+/* Predict when each of the 'n' jobs in flight will start and finish, in
+ * seconds from now, populating their 'start' and 'finish' fields, by
+ * replaying the policy: chunk by chunk, each free slot going to the waiter
+ * with the best schedPriority(), ties to the first in 'jobs'. 'rtf' are the
+ * real time factors of the models. Jobs that already started have 'start'
+ * set to 0. The other fields of the jobs are used as state, so pass a
+ * copy. */
+void schedPredict(const schedPolicy *p, const double *rtf, schedJob *jobs,
+                  int n)
+{
+    int free = schedSlots(p);
+    double now = 0;
+
+    /* From now on 'waited' is the time the job started waiting, that is
+     * negative for jobs waiting right now, and 'end' is when the running
+     * chunk finishes. */
+    for (int i = 0; i < n; i++) {
+        schedJob *j = jobs+i;
+        j->start = j->model == -1 ? -1 : 0;
+        j->finish = -1;
+        j->waiting = !j->running;
+        if (j->running) {
+            double chunk = schedChunk(p, j->remaining);
+            double done = j->done < chunk ? j->done : chunk;
+            j->end = (chunk - done)*rtf[j->model] - j->waited;
+            if (j->end < 0) j->end = 0;    /* Late, assume it ends now. */
+            free--;
+        } else {
+            j->waited = -j->waited;
+        }
+    }
+
+    while (1) {
+        /* Start the next chunks on the free slots. */
+        while (free > 0) {
+            int cur = -1;
+            double bestprio = 0;
+            for (int i = 0; i < n; i++) {
+                if (!jobs[i].waiting) continue;
+                double prio = schedPriority(p, jobs[i].remaining,
+                                            now - jobs[i].waited);
+                if (cur == -1 || prio < bestprio) {
+                    cur = i;
+                    bestprio = prio;
+                }
+            }
+            if (cur == -1) break;
+
+            schedJob *j = jobs+cur;
+            j->waiting = 0;
+            j->running = 1;
+            free--;
+            if (j->model == -1) {
+                double backlog = schedCompute(rtf, jobs, n, cur,
+                                              SCHED_MODEL_MEDIUM);
+                j->model = schedSelectModel(p, backlog);
+                j->start = now;
+            }
+            j->end = now + schedChunk(p, j->remaining)*rtf[j->model];
+        }
+
+        /* Then move to the end of the first chunk to finish. */
+        int cur = -1;
+        for (int i = 0; i < n; i++) {
+            if (jobs[i].running && (cur == -1 || jobs[i].end < jobs[cur].end))
+                cur = i;
+        }
+        if (cur == -1) break;
+
+        schedJob *j = jobs+cur;
+        now = j->end;
+        j->running = 0;
+        free++;
+        j->remaining -= schedChunk(p, j->remaining);
+        j->done = 0;
+        if (j->remaining <= 0) {
+            j->finish = now;
+        } else {
+            j->waiting = 1;
+            j->waited = now;
+        }
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+/* Scheduling policy: admission of new jobs and model selection. This is
+ * used both by the bot and by the simulator (wbsim), so it must not
+ * depend on anything else than the numbers it is given. */
+
+#define SCHED_MODEL_BASE 0
+#define SCHED_MODEL_MEDIUM 1
+#define SCHED_NUM_MODELS 2
+
+typedef struct schedPolicy {
+    int max_queue;          /* Max jobs queued or running. */
+    double max_audio;       /* Max audio seconds queued or running. */
+    double max_compute[SCHED_NUM_MODELS];   /* Compute seconds of work in
+                               flight per slot above which a model is not
+                               used: for the base model, new jobs are
+                               refused. */
+    double sla;             /* Jobs must be expected to finish within */
+    double sla_rtf;         /* sla + sla_rtf * duration seconds. */
+    double chunk_seconds;   /* Long jobs run in chunks of this length. */
+    double aging;           /* Priority gained per second of waiting. */
+    int slots;              /* Chunks transcribed in parallel. */
+} schedPolicy;
+
+/* A job in flight, as seen by schedPredict() and schedAdmit(). */
+typedef struct schedJob {
+    double remaining;       /* Audio seconds left, running chunk included. */
+    double waited;          /* Seconds waited for the slot, or, if running,
+                               seconds since the chunk started or last
+                               made progress. */
+    double done;            /* If running, audio seconds of the chunk
+                               already transcribed. */
+    int model;              /* SCHED_MODEL_*, -1 if not started yet. */
+    int running;            /* Transcribing a chunk right now. */
+    double start, finish;   /* Set by schedPredict(): seconds from now. */
+    int waiting;            /* Used by schedPredict(). */
+    double end;             /* Used by schedPredict(). */
+} schedJob;
+
+extern schedPolicy SchedPolicy;
+
+double schedCompute(const double *rtf, const schedJob *jobs, int n,
+                    int skip, int model);
+int schedAdmit(const schedPolicy *p, const double *rtf, schedJob *jobs, int n);
+int schedSelectModel(const schedPolicy *p, double backlog);
+const char *schedModelName(int model);
+double schedChunk(const schedPolicy *p, double remaining);
+double schedPriority(const schedPolicy *p, double remaining, double waited);
+void schedPredict(const schedPolicy *p, const double *rtf, schedJob *jobs,
+                  int n);
+
+#endif
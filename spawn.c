@@ -0,0 +1,218 @@
+/* ============================================================================
+ * Process launcher.
+ *
+ * We run external tools (ffprobe, ffmpeg, whisper-cli) from a multi
+ * threaded process. fork() has to copy the page tables of the parent, so
+ * its cost grows with our mapped memory, so we use posix_spawn() instead,
+ * that glibc implements with clone(CLONE_VM|CLONE_VFORK): the child shares
+ * our memory until it calls exec. Redirections are done with spawn file
+ * actions, so no code of ours runs in the child at all.
+ *
+ * Children are reaped by a single reaper thread, that waits for all of
+ * them at once using pidfds and epoll, collecting exit status and resource
+ * usage with wait4(). Threads waiting for a child just sleep on a condition
+ * variable. If pidfds are not supported by the kernel, we fall back to
+ * calling wait4() directly from the waiting thread.
+ * ==========================================================================*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#include "spawn.h"
+
+extern char **environ;
+
+static pthread_mutex_t SpawnLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t SpawnCond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t ReaperOnce = PTHREAD_ONCE_INIT;
+static int ReaperEpoll = -1;    /* -1 if the reaper is not available. */
+static pid_t ReaperPid = -1;    /* Process owning the reaper thread. */
+
+/* The reaper thread: wait for any pidfd to become readable, that is, for
+ * any child to exit, and reap it. */
+static void *reaperMain(void *arg) {
+    (void) arg;
+    struct epoll_event ev[16];
+    while (1) {
+        int n = epoll_wait(ReaperEpoll, ev, 16, -1);
+        for (int j = 0; j < n; j++) {
+            childProc *c = ev[j].data.ptr;
+
+            /* The child exited, so wait4() will not block. Reap it with
+             * the lock held, so that spawnKill() never signals a PID that
+             * was already reaped and may be reused. */
+            pthread_mutex_lock(&SpawnLock);
+            if (wait4(c->pid, &c->status, 0, &c->ru) != c->pid) {
+                c->status = -1;
+                memset(&c->ru, 0, sizeof(c->ru));
+            }
+            epoll_ctl(ReaperEpoll, EPOLL_CTL_DEL, c->pidfd, NULL);
+            close(c->pidfd);
+            c->done = 1;
+            pthread_cond_broadcast(&SpawnCond);
+            pthread_mutex_unlock(&SpawnLock);
+        }
+    }
+    return NULL;
+}
+
+static void reaperInit(void) {
+    int fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd == -1) return;
+    ReaperEpoll = fd;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, reaperMain, NULL) != 0) {
+        close(fd);
+        ReaperEpoll = -1;
+        return;
+    }
+    pthread_detach(tid);
+    ReaperPid = getpid();
+}
+
+static int pidfdOpen(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Start the program argv[0] (searched in the PATH) with the NULL
+ * terminated arguments 'argv'. Stdout and stderr are redirected to 'outfd'
+ * and 'errfd', or to /dev/null if -1. Such file descriptors should be
+ * created with O_CLOEXEC: the dup2() done in the child clears the flag,
+ * and this way other children don't inherit them.
+ * Returns 0 on success, -1 on error. */
+int spawnChild(childProc *c, const char *const argv[], int outfd, int errfd) {
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null",
+                                     O_RDONLY, 0);
+    if (outfd != -1)
+        posix_spawn_file_actions_adddup2(&fa, outfd, STDOUT_FILENO);
+    else
+        posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+                                         O_WRONLY, 0);
+    if (errfd != -1)
+        posix_spawn_file_actions_adddup2(&fa, errfd, STDERR_FILENO);
+    else
+        posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null",
+                                         O_WRONLY, 0);
+
+    memset(c, 0, sizeof(*c));
+    int err = posix_spawnp(&c->pid, argv[0], &fa, NULL,
+                           (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    /* Hand the child to the reaper, if possible. A process forked after
+     * the reaper was started doesn't have the thread: it waits by itself. */
+    pthread_once(&ReaperOnce, reaperInit);
+    c->pidfd = ReaperEpoll != -1 && ReaperPid == getpid() ?
+               pidfdOpen(c->pid) : -1;
+    if (c->pidfd != -1) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        if (epoll_ctl(ReaperEpoll, EPOLL_CTL_ADD, c->pidfd, &ev) == -1) {
+            close(c->pidfd);
+            c->pidfd = -1;
+        }
+    }
+    return 0;
+}
+
+/* Populate the exit status and resource usage of a reaped child. */
+static void spawnResult(childProc *c, int *status, struct rusage *ru) {
+    if (status) *status = c->status;
+    if (ru) *ru = c->ru;
+}
+
+/* Wait for the child to exit. 'status' and 'ru', if not NULL, are populated
+ * with the wait4() results. Returns 0 on success, -1 on error. */
+int spawnWait(childProc *c, int *status, struct rusage *ru) {
+    if (c->pidfd == -1) {
+        if (!c->done) {
+            if (wait4(c->pid, &c->status, 0, &c->ru) != c->pid) return -1;
+            c->done = 1;
+        }
+        spawnResult(c, status, ru);
+        return 0;
+    }
+
+    pthread_mutex_lock(&SpawnLock);
+    while (!c->done) pthread_cond_wait(&SpawnCond, &SpawnLock);
+    pthread_mutex_unlock(&SpawnLock);
+    spawnResult(c, status, ru);
+    return c->status == -1 ? -1 : 0;
+}
+
+/* Like spawnWait() but never blocks: returns 1 if the child exited,
+ * populating 'status' and 'ru', otherwise 0. */
+int spawnTryWait(childProc *c, int *status, struct rusage *ru) {
+    if (c->pidfd == -1) {
+        if (!c->done) {
+            if (wait4(c->pid, &c->status, WNOHANG, &c->ru) != c->pid)
+                return 0;
+            c->done = 1;
+        }
+        spawnResult(c, status, ru);
+        return 1;
+    }
+
+    pthread_mutex_lock(&SpawnLock);
+    int done = c->done;
+    pthread_mutex_unlock(&SpawnLock);
+    if (done) spawnResult(c, status, ru);
+    return done;
+}
+
+/* Send a signal to the child, if it was not reaped yet. After the child
+ * is reaped its PID may be reused, so we must not signal it anymore. */
+void spawnKill(childProc *c, int sig) {
+    pthread_mutex_lock(&SpawnLock);
+    if (!c->done) kill(c->pid, sig);
+    pthread_mutex_unlock(&SpawnLock);
+}
+
+/* Return the CPU seconds used so far by a child still running, reading
+ * /proc/<pid>/stat, or -1 if not available. */
+double spawnCpuTime(childProc *c) {
+    char path[64], buf[1024];
+    double cpu = -1;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)c->pid);
+
+    pthread_mutex_lock(&SpawnLock);
+    FILE *fp = c->done ? NULL : fopen(path, "r");
+    pthread_mutex_unlock(&SpawnLock);
+    if (fp == NULL) return -1;
+    size_t n = fread(buf, 1, sizeof(buf)-1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+
+    /* The command name may contain spaces: fields are counted after its
+     * closing parenthesis, where the state (field 3) starts. */
+    char *p = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (p && sscanf(p+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                         "%lu %lu", &utime, &stime) == 2)
+        cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+    return cpu;
+}
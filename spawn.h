@@ -0,0 +1,24 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/* A child process started with spawnChild(). When pidfds are available
+ * children are reaped by a single reaper thread, otherwise by whoever
+ * waits for them. */
+typedef struct childProc {
+    pid_t pid;
+    int pidfd;              /* -1 if pidfds are not available. */
+    int done;               /* Set once the child was reaped. */
+    int status;             /* Exit status, valid if 'done'. */
+    struct rusage ru;       /* Resource usage, valid if 'done'. */
+} childProc;
+
+int spawnChild(childProc *c, const char *const argv[], int outfd, int errfd);
+int spawnWait(childProc *c, int *status, struct rusage *ru);
+int spawnTryWait(childProc *c, int *status, struct rusage *ru);
+void spawnKill(childProc *c, int sig);
+double spawnCpuTime(childProc *c);
+
+#endif
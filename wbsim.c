@@ -0,0 +1,394 @@
+/* Discrete event simulator of the transcription queue.
+ *
+ * It replays an arrival trace through the same admission, model selection
+ * and chunk scheduling policy the bot uses (see sched.c), in simulated
+ * time, and reports latency percentiles, rejection rate, SLA misses and
+ * the fraction of jobs served by each model. This way changes to the
+ * admission limits, the model tiers or the policy itself can be evaluated
+ * against real traffic.
+ *
+ * The trace is a text file with one job per line:
+ *
+ *  <arrival time in seconds> <audio duration in seconds> <user id>
+ *
+ * Empty lines and lines starting with '#' are ignored. Alternatively
+ * --traffic <dir> extracts the arrivals of voice and audio messages from
+ * a log recorded with "whisperbot --record <dir>".
+ *
+ * Model speed is given as real time factor (processing time / audio
+ * duration), with --rtf base=<factor> and --rtf medium=<factor>. */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sds.h"
+#include "cJSON.h"
+#include "xmalloc.h"
+#include "config.h"
+#include "sched.h"
+
+cJSON *cJSON_Select(cJSON *o, const char *fmt, ...);
+
+typedef struct simJob {
+    double arrival;         /* Arrival time, seconds. */
+    double duration;        /* Audio duration, seconds. */
+    long long user;         /* User ID. */
+    double start, finish;   /* Simulated start / finish times. */
+    double remaining;       /* Audio seconds left to transcribe. */
+    double since;           /* When it started waiting for the slot. */
+    int model;              /* SCHED_MODEL_* used. */
+    int rejected;           /* True if not admitted. */
+} simJob;
+
+simJob *Jobs = NULL;
+int NumJobs = 0, JobsCap = 0;
+
+void addJob(double arrival, double duration, long long user) {
+    if (NumJobs == JobsCap) {
+        JobsCap = JobsCap ? JobsCap*2 : 1024;
+        Jobs = xrealloc(Jobs,sizeof(simJob)*JobsCap);
+    }
+    simJob *j = Jobs+NumJobs++;
+    memset(j,0,sizeof(*j));
+    j->arrival = arrival;
+    j->duration = duration;
+    j->user = user;
+}
+
+/* Load a text trace. Return 0 on error. */
+int loadTrace(const char *filename) {
+    FILE *fp = fopen(filename,"r");
+    if (fp == NULL) return 0;
+    char line[256];
+    while (fgets(line,sizeof(line),fp)) {
+        double t, d;
+        long long user;
+        if (line[0] == '#' || line[0] == '\n') continue;
+        if (sscanf(line,"%lf %lf %lld",&t,&d,&user) != 3) {
+            fprintf(stderr,"Bad trace line: %s",line);
+            continue;
+        }
+        addJob(t,d,user);
+    }
+    fclose(fp);
+    return 1;
+}
+
+/* Load the arrivals from a traffic log recorded with --record. Messages
+ * without a duration (documents) are skipped. Return 0 on error. */
+int loadTraffic(const char *dir) {
+    sds path = sdscatprintf(sdsempty(),"%s/traffic.log",dir);
+    FILE *fp = fopen(path,"r");
+    sdsfree(path);
+    if (fp == NULL) return 0;
+
+    char hdr[128];
+    long long ms;
+    char type;
+    size_t len;
+    while (fgets(hdr,sizeof(hdr),fp) &&
+           sscanf(hdr,"%lld %c %zu",&ms,&type,&len) == 3)
+    {
+        sds payload = sdsnewlen(NULL,len);
+        if (fread(payload,1,len,fp) != len || fgetc(fp) != '\n') {
+            sdsfree(payload);
+            break;
+        }
+        cJSON *json = type == 'U' ? cJSON_Parse(payload) : NULL;
+        cJSON *update;
+        cJSON_ArrayForEach(update,cJSON_Select(json,".result:a")) {
+            cJSON *d = cJSON_Select(update,".message.voice.duration:n");
+            if (!d) d = cJSON_Select(update,".message.audio.duration:n");
+            cJSON *user = cJSON_Select(update,".message.from.id:n");
+            if (!d) continue;
+            addJob(ms/1000.0,d->valuedouble,
+                   user ? (long long)user->valuedouble : 0);
+        }
+        cJSON_Delete(json);
+        sdsfree(payload);
+    }
+    fclose(fp);
+    return 1;
+}
+
+int cmpArrival(const void *a, const void *b) {
+    const simJob *x = a, *y = b;
+    return (x->arrival > y->arrival) - (x->arrival < y->arrival);
+}
+
+int cmpUser(const void *a, const void *b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+int cmpDouble(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* A transcription slot of the simulation. */
+typedef struct simSlot {
+    int job;                /* Job being transcribed, or -1 if free. */
+    double start, end;      /* When the running chunk started / finishes. */
+} simSlot;
+
+/* Populate 'jobs' with the jobs in flight, as seen by sched.c: the running
+ * ones first, then the waiting ones in arrival order, then 'extra', a job
+ * arriving now, if not -1. Returns the number of jobs. */
+int snapshot(schedJob *jobs, const simSlot *slots, int nslots,
+             const int *waiting, int nwaiting, int extra, double now)
+{
+    int n = 0;
+    for (int i = 0; i < nslots; i++) {
+        if (slots[i].job == -1) continue;
+        simJob *j = Jobs+slots[i].job;
+        jobs[n++] = (schedJob){.remaining = j->remaining,
+                               .waited = now-slots[i].start,
+                               .model = j->model, .running = 1};
+    }
+    for (int i = 0; i < nwaiting; i++) {
+        simJob *j = Jobs+waiting[i];
+        jobs[n++] = (schedJob){.remaining = j->remaining,
+                               .waited = now-j->since,
+                               .model = j->model};
+    }
+    if (extra != -1)
+        jobs[n++] = (schedJob){.remaining = Jobs[extra].duration,
+                               .model = -1};
+    return n;
+}
+
+/* Run the simulation: p->slots transcription slots, each taken one chunk
+ * at a time, exactly like the bot does. When a slot is free it goes to the
+ * waiting job with the best schedPriority(), the oldest one among ties.
+ * Admission is decided on arrival, model selection when the first chunk
+ * starts. The policy predicts with the same real time factors used by the
+ * simulation, while the bot has to learn them. */
+void simulate(const schedPolicy *p, const double *rtf) {
+    int nslots = p->slots > 0 ? p->slots : 1;
+    simSlot *slots = xmalloc(sizeof(simSlot)*nslots);
+    int *waiting = xmalloc(sizeof(int)*(NumJobs ? NumJobs : 1));
+    schedJob *jobs = xmalloc(sizeof(schedJob)*(NumJobs+1));
+    int nwaiting = 0;           /* Waiting jobs, in arrival order. */
+    int nrunning = 0;           /* Busy slots. */
+    int next = 0;               /* Next arrival. */
+    double now = 0;
+
+    for (int i = 0; i < nslots; i++) slots[i].job = -1;
+    while (next < NumJobs || nrunning) {
+        double tarrival = next < NumJobs ? Jobs[next].arrival : INFINITY;
+        double tfinish = INFINITY;
+        int first = -1;
+        for (int i = 0; i < nslots; i++) {
+            if (slots[i].job != -1 && slots[i].end < tfinish) {
+                tfinish = slots[i].end;
+                first = i;
+            }
+        }
+
+        if (tfinish <= tarrival) {
+            now = tfinish;
+            simJob *j = Jobs+slots[first].job;
+            j->remaining -= schedChunk(p,j->remaining);
+            if (j->remaining <= 0) {
+                j->finish = now;
+            } else {
+                j->since = now;
+                waiting[nwaiting++] = slots[first].job;
+            }
+            slots[first].job = -1;
+            nrunning--;
+        } else {
+            now = tarrival;
+            simJob *j = Jobs+next;
+            int n = snapshot(jobs,slots,nslots,waiting,nwaiting,next,now);
+            if (schedAdmit(p,rtf,jobs,n)) {
+                j->remaining = j->duration;
+                j->since = now;
+                j->model = -1;
+                waiting[nwaiting++] = next;
+            } else {
+                j->rejected = 1;
+            }
+            next++;
+        }
+
+        for (int s = 0; s < nslots && nwaiting; s++) {
+            if (slots[s].job != -1) continue;
+            int best = 0;
+            double bestprio = 0;
+            for (int i = 0; i < nwaiting; i++) {
+                simJob *j = Jobs+waiting[i];
+                double prio = schedPriority(p,j->remaining,now-j->since);
+                if (i == 0 || prio < bestprio) {
+                    best = i;
+                    bestprio = prio;
+                }
+            }
+            int id = waiting[best];
+            memmove(waiting+best,waiting+best+1,
+                    sizeof(int)*(nwaiting-best-1));
+            nwaiting--;
+
+            simJob *j = Jobs+id;
+            if (j->model == -1) {
+                int n = snapshot(jobs,slots,nslots,waiting,nwaiting,-1,now);
+                double backlog = schedCompute(rtf,jobs,n,-1,
+                                              SCHED_MODEL_MEDIUM);
+                j->model = schedSelectModel(p,backlog);
+                j->start = now;
+            }
+            slots[s].job = id;
+            slots[s].start = now;
+            slots[s].end = now + schedChunk(p,j->remaining)*rtf[j->model];
+            nrunning++;
+        }
+    }
+    xfree(jobs);
+    xfree(waiting);
+    xfree(slots);
+}
+
+void printPercentiles(const char *name, double *v, int n) {
+    if (n == 0) {
+        printf("%s: no samples\n", name);
+        return;
+    }
+    qsort(v,n,sizeof(double),cmpDouble);
+    printf("%s: p50 %.1f p90 %.1f p99 %.1f max %.1f\n", name,
+           v[n*50/100], v[n*90/100], v[n*99/100], v[n-1]);
+}
+
+void report(const schedPolicy *p) {
+    int accepted = 0, missed = 0, served[SCHED_NUM_MODELS] = {0};
+    double *latency = xmalloc(sizeof(double)*(NumJobs ? NumJobs : 1));
+    double *wait = xmalloc(sizeof(double)*(NumJobs ? NumJobs : 1));
+    double audio = 0, refused = 0;
+
+    for (int i = 0; i < NumJobs; i++) {
+        simJob *j = Jobs+i;
+        if (j->rejected) {
+            refused += j->duration;
+            continue;
+        }
+        latency[accepted] = j->finish - j->arrival;
+        wait[accepted] = j->start - j->arrival;
+        if (latency[accepted] > p->sla + p->sla_rtf*j->duration) missed++;
+        served[j->model]++;
+        audio += j->duration;
+        accepted++;
+    }
+    int rejected = NumJobs-accepted;
+    printf("jobs: %d accepted: %d rejected: %d (%.2f%%)\n",
+           NumJobs, accepted, rejected,
+           NumJobs ? rejected*100.0/NumJobs : 0);
+    printf("audio seconds served: %.0f rejected: %.0f\n", audio, refused);
+    printf("sla missed: %d (%.2f%%)\n", missed,
+           accepted ? missed*100.0/accepted : 0);
+    for (int m = 0; m < SCHED_NUM_MODELS; m++)
+        printf("served by %s: %d (%.2f%%)\n", schedModelName(m), served[m],
+               accepted ? served[m]*100.0/accepted : 0);
+
+    /* Distinct users, and the share of jobs of the heaviest one. */
+    long long *users = xmalloc(sizeof(long long)*(NumJobs ? NumJobs : 1));
+    for (int i = 0; i < NumJobs; i++) users[i] = Jobs[i].user;
+    qsort(users,NumJobs,sizeof(long long),cmpUser);
+    int distinct = 0, run = 0, maxrun = 0;
+    for (int i = 0; i < NumJobs; i++) {
+        if (i == 0 || users[i] != users[i-1]) {
+            distinct++;
+            run = 0;
+        }
+        if (++run > maxrun) maxrun = run;
+    }
+    xfree(users);
+    printf("users: %d, heaviest user jobs: %d (%.2f%%)\n", distinct, maxrun,
+           NumJobs ? maxrun*100.0/NumJobs : 0);
+
+    printPercentiles("latency seconds",latency,accepted);
+    printPercentiles("wait seconds",wait,accepted);
+    xfree(latency);
+    xfree(wait);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [--rtf base=<factor>] [--rtf medium=<factor>]\n"
+        "       [--max-queue <jobs>] [--max-audio <seconds>]\n"
+        "       [--max-compute base=<seconds>] [--max-compute medium=<seconds>]\n"
+        "       [--sla <seconds>] [--sla-rtf <factor>]\n"
+        "       [--chunk <seconds>] [--aging <factor>] [--slots <n>]\n"
+        "       <trace file> | --traffic <dir>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    schedPolicy p = SchedPolicy;
+    double rtf[SCHED_NUM_MODELS] = {0.1, 0.4};
+    const char *trace = NULL, *traffic = NULL;
+
+    for (int j = 1; j < argc; j++) {
+        int morearg = argc-j-1;
+        if (!strcmp(argv[j],"--rtf") && morearg) {
+            char *arg = argv[++j];
+            if (!strncmp(arg,"base=",5))
+                rtf[SCHED_MODEL_BASE] = atof(arg+5);
+            else if (!strncmp(arg,"medium=",7))
+                rtf[SCHED_MODEL_MEDIUM] = atof(arg+7);
+            else
+                usage(argv[0]);
+        } else if (!strcmp(argv[j],"--max-queue") && morearg) {
+            p.max_queue = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--max-audio") && morearg) {
+            p.max_audio = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--max-compute") && morearg) {
+            char *arg = argv[++j];
+            if (!strncmp(arg,"base=",5))
+                p.max_compute[SCHED_MODEL_BASE] = atof(arg+5);
+            else if (!strncmp(arg,"medium=",7))
+                p.max_compute[SCHED_MODEL_MEDIUM] = atof(arg+7);
+            else
+                usage(argv[0]);
+        } else if (!strcmp(argv[j],"--sla") && morearg) {
+            p.sla = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--sla-rtf") && morearg) {
+            p.sla_rtf = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--chunk") && morearg) {
+            p.chunk_seconds = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--aging") && morearg) {
+            p.aging = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--slots") && morearg) {
+            p.slots = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--traffic") && morearg) {
+            traffic = argv[++j];
+        } else if (argv[j][0] != '-' && trace == NULL) {
+            trace = argv[j];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (!trace == !traffic) usage(argv[0]);
+
+    cJSON_Hooks jh = {.malloc_fn = xmalloc, .free_fn = xfree};
+    cJSON_InitHooks(&jh);
+    if (!(trace ? loadTrace(trace) : loadTraffic(traffic))) {
+        perror("Loading the trace");
+        exit(1);
+    }
+    qsort(Jobs,NumJobs,sizeof(simJob),cmpArrival);
+
+    printf("policy: max_queue %d max_audio %g max_compute base %g "
+           "medium %g sla %g+%g*duration chunk %g aging %g slots %d, "
+           "rtf base %g medium %g\n",
+           p.max_queue, p.max_audio, p.max_compute[SCHED_MODEL_BASE],
+           p.max_compute[SCHED_MODEL_MEDIUM], p.sla, p.sla_rtf,
+           p.chunk_seconds, p.aging, p.slots,
+           rtf[SCHED_MODEL_BASE], rtf[SCHED_MODEL_MEDIUM]);
+    simulate(&p,rtf);
+    report(&p);
+    return 0;
+}
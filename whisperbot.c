@@ -1,8 +1,7 @@
 /* Copyright (c) 2026, Salvatore Sanfilippo <antirez at gmail dot com>
  * All rights reserved. BSD license. */
 
-#define _POSIX_C_SOURCE 200809L
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,27 +16,94 @@
 #include <errno.h>
 #include <time.h>
 #include <signal.h>
+#include <sys/stat.h>
 
 #include "botlib.h"
+#include "config.h"
+#include "sched.h"
+#include "media.h"
+#include "spawn.h"
+#include "eta.h"
+#include "quota.h"
+#include "worker.h"
+#include "jobs.h"
+#include "ring.h"
 
-/* Configuration. */
-#define MAX_QUEUE 10
-#define MAX_SECONDS 900
-#define MSG_LIMIT 4000
-#define TIMEOUT 600
-#define WHISPER_PATH "/app/build/bin/whisper-cli"
-#define SHORT_AUDIO_THRESHOLD 1.5  /* Seconds. Below this, use DEFAULT_LANG. */
-#define DEFAULT_LANG "it"          /* Language for short audio. */
-
-/* Model selection based on queue length. */
-#define MODEL_BASE "/app/models/ggml-base.bin"
-#define MODEL_MEDIUM "/app/models/ggml-medium.bin"
-#define QUEUE_THRESHOLD_BASE 3  /* Use base model when queue >= this */
-#define EDIT_INTERVAL_MS 500    /* Min ms between message edits. */
-
-/* Serialization: only one whisper process at a time. */
-atomic_int QueueLen = 0;
-pthread_mutex_t WhisperLock = PTHREAD_MUTEX_INITIALIZER;
+/* Fake transcription backend, enabled with --fake-whisper, in order to
+ * load test scheduling and message editing without whisper.cpp and its
+ * models. Instead of whisper-cli we run ourselves as a child process, see
+ * fakeWhisperMain(), that emits synthetic segments at the configured real
+ * time factor. */
+struct {
+    int enabled;
+    double rtf;         /* Real time factor of the medium model. The base
+                           model is simulated 3 times faster. */
+    double jitter;      /* Each segment takes rtf * (1 +/- jitter). */
+    double failrate;    /* Probability of a job failing mid-way. */
+    double hangrate;    /* Probability of a job hanging mid-way. */
+} FakeWhisper = {0, 0.1, 0.2, 0, 0};
+
+/* Deployment mode, see jobs.c. */
+#define MODE_STANDALONE 0       /* Poll Telegram and serve the requests. */
+#define MODE_INGEST 1           /* Poll Telegram and queue the jobs. */
+#define MODE_TRANSCRIBER 2      /* Serve the jobs queued. */
+static int Mode = MODE_STANDALONE;
+
+/* Serialization: one whisper process per slot, the slots being the ones
+ * of the local worker and of the remote workers up, see worker.c. Jobs
+ * take a slot for one chunk at a time, see slotAcquire().
+ *
+ * The jobs waiting for a slot are queued in the SLOT_CLASSES rings of
+ * SlotQueue by audio left: class c holds the jobs with up to
+ * SLOT_CLASS_SECONDS * 2^c seconds left, the last one all the longer
+ * ones. A free slot goes to the head with the best schedPriority(), see
+ * slotDispatch(). Every class is in arrival order, so its head is the job
+ * that aged the most among jobs within a factor of two in audio left.
+ * The rings are only touched with SlotLock held, that also guards the
+ * rest of the state, so their depth is exact.
+ *
+ * A job in flight: waiting for a slot, or running one of its chunks. */
+typedef struct slotJob {
+    double remaining;           /* Audio seconds left, running chunk
+                                   included. */
+    long long since;            /* When it started waiting, or started
+                                   the running chunk, mstime(). */
+    int model;                  /* SCHED_MODEL_*, -1 before the first
+                                   chunk. */
+    int granted;
+    int worker;                 /* Worker of the running chunk. */
+    int pos;                    /* Queue position when admitted. */
+    int64_t chat_id, msg_id;    /* Status message. */
+    double eta;                 /* Estimated seconds to finish shown in the
+                                   status at 'eta_time', -1 if none. */
+    long long eta_time;
+    double audio;               /* Audio duration in seconds. */
+    double progress;            /* Audio transcribed so far, in seconds,
+                                   from the whisper timestamps. */
+    long long progress_time;    /* When 'progress' was updated, mstime(). */
+    int64_t user;               /* Who sent the audio. */
+    struct slotJob *next;
+} slotJob;
+
+#define SLOT_CLASSES 6
+#define SLOT_CLASS_SECONDS (CHUNK_SECONDS/8.0)
+
+static pthread_mutex_t SlotLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t SlotCond = PTHREAD_COND_INITIALIZER;
+static slotJob *SlotJobs = NULL;        /* In flight, in admission order. */
+static ring *SlotQueue = NULL;          /* Waiters, see above. */
+
+/* Return the class of SlotQueue for a job with 'remaining' seconds of
+ * audio left. */
+int slotClass(double remaining) {
+    double limit = SLOT_CLASS_SECONDS;
+    int c = 0;
+    while (c < SLOT_CLASSES-1 && remaining > limit) {
+        c++;
+        limit *= 2;
+    }
+    return c;
+}
 
 /* Return current time in milliseconds. */
 long long mstime(void) {
@@ -46,158 +112,572 @@ long long mstime(void) {
     return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-/* Run command with NULL-terminated args. Capture stdout in *out if not NULL.
- * Stderr goes to /dev/null. Returns 0 on success, -1 on error. */
-int runCommand(sds *out, const char *cmd, ...) {
-    /* Build argv from varargs. */
-    va_list ap;
-    const char *argv[64];
-    int argc = 0;
+/* Return the jobs in flight as an array for sched.c, the running ones
+ * first, then the waiters, in admission order. If 'extra' is not NULL it is
+ * appended as a job arriving now. The number of jobs is returned by
+ * reference in 'count', and the index of 'j' in 'idx'. The array must be
+ * freed with xfree(). Must be called with SlotLock held. */
+schedJob *slotJobs(slotJob *extra, slotJob *j, int *count, int *idx) {
+    int n = 1;
+    for (slotJob *r = SlotJobs; r; r = r->next) n++;
+    schedJob *jobs = xmalloc(sizeof(schedJob)*n);
 
-    argv[argc++] = cmd;
-    va_start(ap, cmd);
-    while (argc < 63 && (argv[argc] = va_arg(ap, const char *)) != NULL)
-        argc++;
-    va_end(ap);
-    argv[argc] = NULL;
+    long long now = mstime();
+    n = 0;
+    *idx = -1;
+    for (slotJob *r = SlotJobs; r; r = r->next) {
+        if (!r->granted) continue;
+        /* The whisper timestamps tell how much of the chunk is done: only
+         * the time since the last segment needs a guess. */
+        double done = r->progress - (r->audio - r->remaining);
+        long long since = r->since;
+        if (done > 0) since = r->progress_time;
+        else done = 0;
+        if (r == j) *idx = n;
+        jobs[n++] = (schedJob){
+            .remaining = r->remaining,
+            .waited = (now - since) / 1000.0,
+            .done = done,
+            .model = r->model,
+            .running = 1
+        };
+    }
+    for (slotJob *w = SlotJobs; w; w = w->next) {
+        if (w->granted) continue;
+        if (w == j) *idx = n;
+        jobs[n++] = (schedJob){
+            .remaining = w->remaining,
+            .waited = (now - w->since) / 1000.0,
+            .model = w->model
+        };
+    }
+    if (extra) {
+        if (extra == j) *idx = n;
+        jobs[n++] = (schedJob){
+            .remaining = extra->remaining,
+            .model = extra->model
+        };
+    }
+    *count = n;
+    return jobs;
+}
+
+/* The scheduling policy, with the slots of the workers up. */
+schedPolicy slotPolicy(void) {
+    schedPolicy p = SchedPolicy;
+    p.slots = workerCapacity();
+    return p;
+}
 
-    /* Create pipe if output requested. */
-    int fd[2] = {-1, -1};
-    if (out && pipe(fd) == -1) return -1;
+/* Estimate in how many seconds the queued job 'j' will finish, populating
+ * the status message 'buf' accordingly, and remembering the estimate
+ * shown. Must be called with SlotLock held. */
+double slotStatus(slotJob *j, char *buf, size_t len) {
+    double rtf[SCHED_NUM_MODELS];
+    int n, idx;
+    etaRtf(rtf);
+    schedJob *jobs = slotJobs(NULL, j, &n, &idx);
+    schedPolicy p = slotPolicy();
+    schedPredict(&p, rtf, jobs, n);
+    double start = jobs[idx].start, finish = jobs[idx].finish;
+    xfree(jobs);
 
-    pid_t pid = fork();
-    if (pid == -1) {
-        if (out) {
-            close(fd[0]);
-            close(fd[1]);
+    char s[32], f[32];
+    etaFormat(s, sizeof(s), start);
+    etaFormat(f, sizeof(f), finish);
+    snprintf(buf, len, "Queued (%d), starting in %s, done in %s.",
+             j->pos, s, f);
+    j->eta = finish;
+    j->eta_time = mstime();
+    return finish;
+}
+
+/* Refresh the status message of a job waiting for its first chunk, if the
+ * estimate changed materially since the last edit: a message edited too
+ * often hits the Telegram rate limits. Called with SlotLock held, that is
+ * released during the edit. */
+void slotUpdateStatus(slotJob *j) {
+    double shown = j->eta - (mstime() - j->eta_time) / 1000.0;
+    double eta = j->eta;
+    long long eta_time = j->eta_time;
+    char msg[128];
+    double finish = slotStatus(j, msg, sizeof(msg));
+
+    double delta = finish > shown ? finish - shown : shown - finish;
+    char a[32], b[32];
+    etaFormat(a, sizeof(a), shown);
+    etaFormat(b, sizeof(b), finish);
+    if (delta < ETA_MIN_CHANGE || delta < shown*ETA_CHANGE_RATIO ||
+        !strcmp(a, b))
+    {
+        /* Not worth an edit: keep the estimate shown. */
+        j->eta = eta;
+        j->eta_time = eta_time;
+        return;
+    }
+
+    pthread_mutex_unlock(&SlotLock);
+    botEditMessageText(j->chat_id, j->msg_id, msg);
+    pthread_mutex_lock(&SlotLock);
+}
+
+/* Record that 'j' was transcribed up to 'seconds' of its audio. */
+void slotProgress(slotJob *j, double seconds) {
+    pthread_mutex_lock(&SlotLock);
+    j->progress = seconds;
+    j->progress_time = mstime();
+    pthread_mutex_unlock(&SlotLock);
+}
+
+/* Append to 's' the state of the job 'j', predicted in 'sj'. */
+sds slotReportJob(sds s, slotJob *j, schedJob *sj) {
+    int pct = j->audio > 0 ? j->progress * 100 / j->audio : 0;
+    char len[32], start[32], finish[32];
+    snprintf(len, sizeof(len), "%d:%02d",
+             (int)j->audio / 60, (int)j->audio % 60);
+    etaFormat(start, sizeof(start), sj->start);
+    etaFormat(finish, sizeof(finish), sj->finish);
+    if (j->granted)
+        return sdscatprintf(s, "\nYour %s audio: transcribing (%s), "
+            "%d%% done, finishing in %s.", len,
+            schedModelName(j->model), pct, finish);
+    else if (j->model != -1)
+        return sdscatprintf(s, "\nYour %s audio: %d%% done, waiting "
+            "for its next chunk, finishing in %s.", len, pct, finish);
+    else
+        return sdscatprintf(s, "\nYour %s audio: queued, starting in "
+            "%s, finishing in %s.", len, start, finish);
+}
+
+/* Reply to the /status command: the work in flight, and the state of the
+ * jobs of 'user'. Jobs of other users are just counted. */
+sds slotReport(int64_t user) {
+    double rtf[SCHED_NUM_MODELS];
+    int n, idx;
+    etaRtf(rtf);
+    pthread_mutex_lock(&SlotLock);
+    schedJob *jobs = slotJobs(NULL, NULL, &n, &idx);
+    double audio = 0;
+    for (int i = 0; i < n; i++) audio += jobs[i].remaining - jobs[i].done;
+    sds s = sdscatprintf(sdsempty(), "%d job%s in flight, %d waiting, %d "
+                         "seconds of audio left.", n, n == 1 ? "" : "s",
+                         (int)ringDepth(SlotQueue), (int)audio);
+    schedPolicy p = slotPolicy();
+    schedPredict(&p, rtf, jobs, n);
+
+    /* Same order as slotJobs(): the running jobs, then the waiters. */
+    int i = 0;
+    for (int granted = 1; granted >= 0; granted--) {
+        for (slotJob *j = SlotJobs; j; j = j->next) {
+            if (j->granted != granted) continue;
+            if (j->user == user) s = slotReportJob(s, j, jobs+i);
+            i++;
         }
-        return -1;
     }
+    pthread_mutex_unlock(&SlotLock);
+    xfree(jobs);
+    return s;
+}
 
-    if (pid == 0) {
-        if (out) {
-            close(fd[0]);
-            dup2(fd[1], STDOUT_FILENO);
-            close(fd[1]);
-        } else {
-            int devnull = open("/dev/null", O_WRONLY);
-            if (devnull != -1) { dup2(devnull, STDOUT_FILENO); close(devnull); }
+/* Give to 'j' a slot of the worker 'w'. The model is selected when the
+ * first chunk starts, based on the backlog. Called with SlotLock held. */
+void slotGrant(slotJob *j, int w) {
+    j->granted = 1;
+    j->worker = w;
+    j->since = mstime();
+    if (j->model == -1) {
+        double rtf[SCHED_NUM_MODELS];
+        int n, idx;
+        etaRtf(rtf);
+        schedJob *jobs = slotJobs(NULL, j, &n, &idx);
+        double backlog = schedCompute(rtf, jobs, n, idx, SCHED_MODEL_MEDIUM);
+        xfree(jobs);
+        schedPolicy p = slotPolicy();
+        j->model = schedSelectModel(&p, backlog);
+    }
+}
+
+/* Queue 'j' for a slot, or grant it one right away if some slot is free
+ * and nobody else is waiting. Called with SlotLock held. */
+void slotEnqueue(slotJob *j) {
+    j->granted = 0;
+    j->since = mstime();
+    int w;
+    if (ringDepth(SlotQueue) == 0 && (w = workerPick()) != -1) {
+        slotGrant(j, w);
+        return;
+    }
+    /* Can't fail: admission keeps at most max_queue jobs in flight, and
+     * every class has room for as many. */
+    ringPush(SlotQueue, slotClass(j->remaining), j);
+}
+
+/* Admit the new job 'j' if the work in flight allows it, see schedAdmit(),
+ * queueing it for the slot. The initial status message for the user is
+ * written in 'status'. Returns 1 if the job was admitted, otherwise 0. */
+int slotAdmit(slotJob *j, char *status, size_t len) {
+    double rtf[SCHED_NUM_MODELS];
+    int n, idx;
+    etaRtf(rtf);
+    pthread_mutex_lock(&SlotLock);
+    schedJob *jobs = slotJobs(j, j, &n, &idx);
+    schedPolicy p = slotPolicy();
+    int admit = schedAdmit(&p, rtf, jobs, n);
+    xfree(jobs);
+    if (admit) {
+        j->pos = n;
+        j->eta = -1;
+        j->next = NULL;
+        slotJob **tail = &SlotJobs;
+        while (*tail) tail = &(*tail)->next;
+        *tail = j;
+        slotEnqueue(j);
+        if (j->granted)
+            snprintf(status, len, "Transcribing...");
+        else
+            slotStatus(j, status, len);
+    }
+    pthread_mutex_unlock(&SlotLock);
+    return admit;
+}
+
+/* Wait for a transcription slot, in order to transcribe the next chunk
+ * of 'j'. While waiting for the first chunk, the status message is kept
+ * updated with the estimated completion time. Returns the milliseconds
+ * waited. */
+long long slotAcquire(slotJob *j) {
+    long long start = mstime();
+    pthread_mutex_lock(&SlotLock);
+    while (!j->granted) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += ETA_REFRESH_MS / 1000;
+        ts.tv_nsec += (ETA_REFRESH_MS % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
         }
-        int devnull = open("/dev/null", O_WRONLY);
-        if (devnull != -1) { dup2(devnull, STDERR_FILENO); close(devnull); }
-        execvp(cmd, (char *const *)argv);
-        _exit(1);
+        pthread_cond_timedwait(&SlotCond, &SlotLock, &ts);
+        if (!j->granted && j->model == -1 && j->eta >= 0)
+            slotUpdateStatus(j);
     }
+    pthread_mutex_unlock(&SlotLock);
+    return mstime() - start;
+}
 
-    /* Parent: read output if requested. */
-    if (out) {
-        close(fd[1]);
-        *out = sdsempty();
-        char buf[1024];
-        ssize_t n;
-        while ((n = read(fd[0], buf, sizeof(buf)-1)) > 0) {
-            buf[n] = '\0';
-            *out = sdscat(*out, buf);
+/* Grant the free slots to the waiters with the best schedPriority(),
+ * looking at the head of every class. Ties go to the lowest class, with
+ * less audio left. Called with SlotLock held. */
+void slotDispatch(void) {
+    int granted = 0;
+    while (ringDepth(SlotQueue)) {
+        int worker = workerPick();
+        if (worker == -1) break;
+
+        long long now = mstime();
+        int best = -1;
+        double bestprio = 0;
+        for (int c = 0; c < SLOT_CLASSES; c++) {
+            slotJob *w = ringPeek(SlotQueue, c);
+            if (w == NULL) continue;
+            double prio = schedPriority(&SchedPolicy, w->remaining,
+                                        (now - w->since) / 1000.0);
+            if (best == -1 || prio < bestprio) {
+                best = c;
+                bestprio = prio;
+            }
         }
-        close(fd[0]);
+        slotGrant(ringPopClass(SlotQueue, best), worker);
+        granted = 1;
+    }
+    if (granted) pthread_cond_broadcast(&SlotCond);
+}
+
+/* Release the slot held by 'j', that has now 'remaining' seconds of audio
+ * left: if not zero, the job is queued again for its next chunk, otherwise
+ * it is no longer in flight. Free slots go to the waiters, see
+ * slotDispatch(). */
+void slotRelease(slotJob *j, double remaining) {
+    pthread_mutex_lock(&SlotLock);
+    workerDone(j->worker);
+    j->remaining = remaining;
+    if (remaining > 0) {
+        slotEnqueue(j);
+    } else {
+        slotJob **r = &SlotJobs;
+        while (*r != j) r = &(*r)->next;
+        *r = j->next;
     }
+    slotDispatch();
+    pthread_mutex_unlock(&SlotLock);
+}
 
-    int status;
-    waitpid(pid, &status, 0);
-    if (!(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
-        if (out) {
-            sdsfree(*out);
-            *out = NULL;
+/* Called by worker.c when a worker comes back up. */
+void slotKick(void) {
+    pthread_mutex_lock(&SlotLock);
+    slotDispatch();
+    pthread_mutex_unlock(&SlotLock);
+}
+
+/* A transcription in progress. Long audio is transcribed by calling
+ * whisper() once per chunk: the message being edited and the text are
+ * carried from one chunk to the next. */
+typedef struct whisperJob {
+    const char *wav;
+    int model;                  /* SCHED_MODEL_*. */
+    int worker;                 /* Worker running it, see worker.c. */
+    int64_t target;
+    int64_t chat_id, msg_id;    /* Message we are streaming the text to. */
+    int short_audio;            /* Use DEFAULT_LANG instead of auto-detect. */
+    sds text;                   /* Text of the current message. */
+    char prompt[PROMPT_CHARS+1];/* Tail of the transcript so far. */
+    int preview;                /* Just a preview, see whisperPreview(). */
+    long long first_text;       /* When some text was first shown, mstime(),
+                                   or 0. */
+    double checkpoint;          /* End of the last segment received, in
+                                   seconds from the start of the audio. */
+    double audio;               /* Audio duration in seconds. */
+    double rtf;                 /* Expected real time factor of 'model'. */
+    slotJob *slot;              /* Progress is reported here, if not NULL. */
+    int timedout;               /* Last whisper run killed by the timeout
+                                   or by the stall watchdog. */
+    int retries;                /* Runs resumed after a failure. */
+    int exit;                   /* Exit status sent by a remote worker,
+                                   -1 until received. */
+    int lost;                   /* Last run lost with its remote worker. */
+    int busy;                   /* Last run refused by its remote worker,
+                                   busy with other clients. */
+    procStats *ps;              /* Whisper resource usage, accumulated. */
+} whisperJob;
+
+#define WHISPER_LOST -2         /* See whisperTranscribe(). */
+#define WHISPER_BUSY -3
+
+/* Remember the last PROMPT_CHARS of the transcript, starting at a word
+ * boundary, to prompt whisper with them in the next chunk. */
+void whisperSetPrompt(whisperJob *wj) {
+    const char *s = wj->text;
+    if (!strncmp(s, "[...]\n", 6)) s += 6;
+    size_t len = strlen(s);
+    if (len > PROMPT_CHARS) {
+        s += len - PROMPT_CHARS;
+        const char *space = strchr(s, ' ');
+        if (space) s = space+1;
+    }
+    snprintf(wj->prompt, sizeof(wj->prompt), "%s", s);
+    for (char *p = wj->prompt; *p; p++) if (*p == '\n') *p = ' ';
+}
+
+/* Parse a line of whisper-cli output such as:
+ *
+ *  [00:00:01.000 --> 00:00:04.500]   Some text.
+ *
+ * Returns the text, and the end of the segment in seconds by reference,
+ * or NULL if the line is not a segment. */
+const char *whisperParseSegment(const char *line, double *end) {
+    int h, m, s, ms, len = 0;
+    if (sscanf(line, "[%*d:%*d:%*d.%*d --> %d:%d:%d.%d]%n",
+               &h, &m, &s, &ms, &len) != 4 || len == 0) return NULL;
+    *end = h*3600 + m*60 + s + ms/1000.0;
+    line += len;
+    while (*line == ' ') line++;
+    return line;
+}
+
+/* Move the complete lines of whisper output from 'pending' to 'text',
+ * without timestamps, and advance the checkpoint to the end of the last
+ * segment. A segment counts only once its line is complete: the text and
+ * the checkpoint always agree. Timestamps are relative to 'base', that is
+ * where the audio sent to remote workers starts. */
+sds whisperConsume(whisperJob *wj, sds text, sds pending, double base) {
+    char *p = pending, *nl;
+    double checkpoint = wj->checkpoint;
+    while ((nl = strchr(p, '\n')) != NULL) {
+        *nl = '\0';
+        double end;
+        const char *seg = whisperParseSegment(p, &end);
+        if (seg) {
+            if (*seg) text = sdscatprintf(text, "%s\n", seg);
+            wj->checkpoint = base + end;
+        } else if (wj->worker != WORKER_LOCAL) {
+            sscanf(p, "DONE %d", &wj->exit);
         }
-        return -1;
+        p = nl+1;
     }
-    return 0;
+    sdsrange(pending, p - pending, -1);
+    if (wj->slot && wj->checkpoint != checkpoint)
+        slotProgress(wj->slot, wj->checkpoint);
+    return text;
 }
 
-/* Return audio duration in seconds, or -1 on error. */
-double getDuration(const char *path) {
-    sds out;
-    if (runCommand(&out, "ffprobe", "-i", path, "-show_entries",
-                   "format=duration", "-v", "quiet", "-of", "csv=p=0",
-                   NULL) != 0) return -1;
-    double dur = atof(out);
-    sdsfree(out);
-    return dur;
-}
-
-/* Convert to 16khz mono WAV. For short audio, pad to 1.5s with silence.
- * Whisper fails on audio < 1s. */
-int toWav(const char *in, const char *out, double duration) {
-    if (duration < SHORT_AUDIO_THRESHOLD) {
-        /* Pad with silence. */
-        char af[64];
-        snprintf(af, sizeof(af), "apad=whole_dur=%.1f", SHORT_AUDIO_THRESHOLD);
-        return runCommand(NULL, "ffmpeg", "-y", "-i", in, "-af", af,
-                          "-ar", "16000", "-ac", "1", "-c:a", "pcm_s16le",
-                          out, NULL);
-    }
-    return runCommand(NULL, "ffmpeg", "-y", "-i", in,
-                      "-ar", "16000", "-ac", "1", "-c:a", "pcm_s16le",
-                      out, NULL);
-}
-
-/* Run whisper with timeout. Streams output to Telegram by editing 'msg_id'.
- * For short audio, use DEFAULT_LANG instead of auto-detect.
- * Returns 0 on success, -1 on error. */
-int whisper(const char *wav, const char *model, int64_t target,
-            int64_t chat_id, int64_t msg_id, int short_audio)
+/* Start whisper-cli for 'job' on 'wav', see workerSpawnProc. With the
+ * fake backend the whisper-cli arguments are the same, just prefixed. */
+int whisperSpawn(childProc *c, const workerJob *job, const char *wav,
+                 int outfd)
 {
-    int fd[2];
-    if (pipe(fd) == -1) return -1;
-
-    pid_t pid = fork();
-    if (pid == -1) {
-        close(fd[0]);
-        close(fd[1]);
-        return -1;
+    const char *argv[24];
+    char fakeopt[4][32];
+    int argc = 0;
+    if (FakeWhisper.enabled) {
+        snprintf(fakeopt[0], sizeof(fakeopt[0]), "%g", FakeWhisper.rtf);
+        snprintf(fakeopt[1], sizeof(fakeopt[1]), "%g", FakeWhisper.jitter);
+        snprintf(fakeopt[2], sizeof(fakeopt[2]), "%g", FakeWhisper.failrate);
+        snprintf(fakeopt[3], sizeof(fakeopt[3]), "%g", FakeWhisper.hangrate);
+        argv[argc++] = "/proc/self/exe";
+        argv[argc++] = "fake-whisper";
+        argv[argc++] = fakeopt[0];
+        argv[argc++] = fakeopt[1];
+        argv[argc++] = fakeopt[2];
+        argv[argc++] = fakeopt[3];
+    } else {
+        argv[argc++] = WHISPER_PATH;
+    }
+    argv[argc++] = "-m";
+    argv[argc++] = job->model == SCHED_MODEL_BASE ? MODEL_BASE : MODEL_MEDIUM;
+    argv[argc++] = "-f"; argv[argc++] = wav;
+    argv[argc++] = "-l"; argv[argc++] = job->lang;
+    argv[argc++] = "-np";
+    char range[2][32];
+    if (job->offset > 0 || job->duration > 0) {
+        snprintf(range[0], sizeof(range[0]), "%lld",
+                 (long long)(job->offset*1000));
+        snprintf(range[1], sizeof(range[1]), "%lld",
+                 (long long)(job->duration*1000));
+        argv[argc++] = "-ot"; argv[argc++] = range[0];
+        argv[argc++] = "-d"; argv[argc++] = range[1];
     }
+    if (job->prompt[0]) {
+        argv[argc++] = "--prompt"; argv[argc++] = job->prompt;
+    }
+    char ctx[32];
+    if (job->audio_ctx) {
+        snprintf(ctx, sizeof(ctx), "%d", job->audio_ctx);
+        argv[argc++] = "-ac"; argv[argc++] = ctx;
+    }
+    argv[argc] = NULL;
+    return spawnChild(c, argv, outfd, outfd);
+}
+
+/* Run whisper with timeout on 'duration' seconds of audio starting at
+ * 'offset', or up to the end if 'duration' is 0, on the worker of the job.
+ * Streams output to Telegram by appending it to the job text and editing
+ * the job message. Returns 0 on success, -1 on error. */
+int whisper(whisperJob *wj, double offset, double duration) {
+    workerJob job = {
+        .model = wj->model,
+        .offset = offset,
+        .duration = duration
+    };
+    snprintf(job.lang, sizeof(job.lang), "%s",
+             wj->short_audio ? DEFAULT_LANG : "auto");
+    snprintf(job.prompt, sizeof(job.prompt), "%s", wj->prompt);
 
-    if (pid == 0) {
-        close(fd[0]);
-        dup2(fd[1], STDOUT_FILENO);
-        dup2(fd[1], STDERR_FILENO);
+    /* Whisper pads the audio to 30 second windows, and the encoder cost
+     * depends on the window, not on the audio. For the preview we reduce
+     * the audio context to what the audio needs: 1500 frames are 30s. */
+    if (wj->preview) job.audio_ctx = duration*50;
+
+    /* Remote runs stream the output on the connection, and are over when
+     * the worker closes it. Their timestamps start at 'offset'. */
+    int remote = wj->worker != WORKER_LOCAL;
+    double base = remote ? offset : 0;
+    childProc c;
+    int fd[2];
+    wj->exit = -1;
+    wj->lost = 0;
+    wj->busy = 0;
+    if (remote) {
+        fd[0] = workerSend(wj->worker, &job, wj->wav);
+        if (fd[0] == WORKER_BUSY) {
+            wj->busy = 1;
+            return -1;
+        }
+        if (fd[0] == -1) {
+            wj->lost = 1;
+            return -1;
+        }
+        printf("Whisper run at %.2fs sent to worker %s\n", offset,
+               workerName(wj->worker));
+    } else {
+        if (pipe2(fd, O_CLOEXEC) == -1) return -1;
+        if (whisperSpawn(&c, &job, wj->wav, fd[1]) == -1) {
+            close(fd[0]);
+            close(fd[1]);
+            return -1;
+        }
         close(fd[1]);
-        const char *lang = short_audio ? DEFAULT_LANG : "auto";
-        execlp(WHISPER_PATH, "whisper-cli",
-               "-m", model,
-               "-f", wav,
-               "-l", lang,
-               "-np", "-nt", NULL);
-        _exit(1);
     }
-
-    close(fd[1]);
     fcntl(fd[0], F_SETFL, O_NONBLOCK);
 
-    sds text = sdsempty();
-    time_t start = time(NULL);
-    long long last_edit = 0;
+    int64_t chat_id = wj->chat_id, msg_id = wj->msg_id;
+    procStats *ps = wj->ps;
+    sds text = wj->text;
+    if (sdslen(text)) text = sdscat(text, "\n");
+    sds pending = sdsempty();
+    long long start = mstime(), last_edit = 0;
+    size_t shown_len = 0;
+    int shown_pct = -1;
+    long long last_output = start;
+    double last_cpu = 0;
     int status = 0;
+    struct rusage ru;
+    char buf[1024];
+    ssize_t n;
+    wj->timedout = 0;
+
+    /* Kill the run if it takes TIMEOUT_RTF_MARGIN times what we expect
+     * from the real time factor learned for the model, plus TIMEOUT_BASE
+     * for loading it. Learned factors are per number of cores, so they
+     * account for the threads whisper can use on this machine. */
+    double audio = duration > 0 ? duration : wj->audio - offset;
+    if (audio < 0) audio = 0;
+    long long timeout = (TIMEOUT_BASE + TIMEOUT_RTF_MARGIN*wj->rtf*audio)*1000;
 
     /* Read data as it is stremed by whisper.cpp, hoping it
      * will not change output format. */
     while (1) {
-        /* Timeout check. */
-        if (time(NULL) - start > TIMEOUT) {
-            kill(pid, SIGKILL);
-            waitpid(pid, NULL, 0);
-            close(fd[0]);
-            sdsfree(text);
-            botEditMessageText(chat_id, msg_id, "Transcription timed out.");
-            return -1;
+        /* Stall watchdog. Whisper prints a segment every few seconds of
+         * audio: if nothing arrived for STALL_SECONDS and the process
+         * did not even use the CPU meanwhile, it is hung, and waiting for
+         * the timeout would just waste the slot. A process busy but silent
+         * is left to the timeout. Remote runs only have the timeout. */
+        long long now = mstime();
+        int stalled = 0;
+        if (!remote && now - last_output > STALL_SECONDS*1000) {
+            double cpu = spawnCpuTime(&c);
+            if (cpu >= 0 && cpu - last_cpu < STALL_MIN_CPU) stalled = 1;
+            last_output = now;
+            last_cpu = cpu;
+        }
+
+        /* Timeout check. What was already printed is still good. */
+        if (stalled || now - start > timeout) {
+            printf("Whisper %s after %.1fs, at %.2fs of audio\n",
+                   stalled ? "stalled" : "timed out", (now - start) / 1000.0,
+                   wj->checkpoint);
+            /* Remote runs are killed by the worker as we disconnect. */
+            if (!remote) {
+                spawnKill(&c, SIGKILL);
+                if (spawnWait(&c, NULL, &ru) == 0) procStatsAdd(ps, &ru);
+            }
+            while ((n = read(fd[0], buf, sizeof(buf))) > 0)
+                pending = sdscatlen(pending, buf, n);
+            text = whisperConsume(wj, text, pending, base);
+            wj->timedout = 1;
+            break;
         }
 
         /* Read available data. */
-        char buf[1024];
-        ssize_t n;
-        while ((n = read(fd[0], buf, sizeof(buf)-1)) > 0) {
-            buf[n] = '\0';
-            text = sdscat(text, buf);
+        int got = 0;
+        while ((n = read(fd[0], buf, sizeof(buf))) > 0) {
+            pending = sdscatlen(pending, buf, n);
+            got = 1;
+        }
+        int eof = n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR);
+        if (got) {
+            text = whisperConsume(wj, text, pending, base);
+            last_output = mstime();
+            if (!remote) last_cpu = spawnCpuTime(&c);
         }
 
         /* Message too long? Send and continue in new message. */
@@ -205,22 +685,37 @@ int whisper(const char *wav, const char *model, int64_t target,
             botEditMessageText(chat_id, msg_id, text);
             sdsfree(text);
             text = sdsnew("[...]\n");
-            botSendMessageAndGetInfo(target, text, 0, &chat_id, &msg_id);
+            botSendMessageAndGetInfo(wj->target, text, 0, &chat_id, &msg_id);
             last_edit = mstime();
+            shown_len = sdslen(text);
+            shown_pct = -1;
         }
 
-        /* Update message periodically. */
-        if (sdslen(text) && mstime() - last_edit >= EDIT_INTERVAL_MS) {
-            botEditMessageText(chat_id, msg_id, text);
+        /* Update message periodically, if the text or the percentage done
+         * changed. The percentage is removed by the final edit. */
+        int pct = wj->preview || wj->audio <= 0 ? -1 :
+                  wj->checkpoint * 100 / wj->audio;
+        if (pct > 99) pct = 99;
+        if (sdslen(text) && mstime() - last_edit >= EDIT_INTERVAL_MS &&
+            (sdslen(text) != shown_len || pct != shown_pct))
+        {
+            sds msg = sdsdup(text);
+            if (pct >= 0) msg = sdscatprintf(msg, "\n[%d%%]", pct);
+            botEditMessageText(chat_id, msg_id, msg);
+            sdsfree(msg);
+            shown_len = sdslen(text);
+            shown_pct = pct;
             last_edit = mstime();
+            if (!wj->first_text) wj->first_text = last_edit;
         }
 
         /* Child done? */
-        if (waitpid(pid, &status, WNOHANG) == pid) {
-            while ((n = read(fd[0], buf, sizeof(buf)-1)) > 0) {
-                buf[n] = '\0';
-                text = sdscat(text, buf);
-            }
+        if (remote && eof) break;
+        if (!remote && spawnTryWait(&c, &status, &ru)) {
+            procStatsAdd(ps, &ru);
+            while ((n = read(fd[0], buf, sizeof(buf))) > 0)
+                pending = sdscatlen(pending, buf, n);
+            text = whisperConsume(wj, text, pending, base);
             break;
         }
 
@@ -228,25 +723,149 @@ int whisper(const char *wav, const char *model, int64_t target,
     }
 
     close(fd[0]);
+    sdsfree(pending);
 
-    /* Check exit status. */
-    int exit_ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    /* Check exit status. A remote run that didn't report one was lost
+     * with the connection. */
+    int exit_ok;
+    if (remote) {
+        exit_ok = !wj->timedout && wj->exit == 0;
+        wj->lost = !wj->timedout && wj->exit == -1;
+    } else {
+        exit_ok = !wj->timedout &&
+                  WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
 
     /* Trim whitespace from output. */
     sdstrim(text, " \t\r\n");
 
-    /* Final update. */
-    if (sdslen(text) > 0) {
-        botEditMessageText(chat_id, msg_id, text);
-    } else if (!exit_ok) {
-        botEditMessageText(chat_id, msg_id, "Transcription failed.");
-    } else {
-        botEditMessageText(chat_id, msg_id, "(no speech detected)");
+    /* Final update. A preview only shows what it got: the transcription
+     * that follows will replace it. */
+    if (wj->preview) {
+        if (sdslen(text) > 0) {
+            text = sdscat(text, " [...]");
+            botEditMessageText(chat_id, msg_id, text);
+            if (!wj->first_text) wj->first_text = mstime();
+        }
+        wj->text = text;
+        return exit_ok ? 0 : -1;
     }
-    sdsfree(text);
+    wj->text = text;
+    wj->chat_id = chat_id;
+    wj->msg_id = msg_id;
     return exit_ok ? 0 : -1;
 }
 
+/* Show in the job message that the transcription failed, after the text
+ * obtained so far. */
+void whisperFailed(whisperJob *wj) {
+    const char *why = wj->timedout ? "timed out" : "failed";
+    sds msg = sdslen(wj->text) ?
+        sdscatprintf(sdsdup(wj->text), "\n\n(Transcription %s.)", why) :
+        sdscatprintf(sdsempty(), "Transcription %s.", why);
+    botEditMessageText(wj->chat_id, wj->msg_id, msg);
+    sdsfree(msg);
+}
+
+/* Transcribe 'duration' seconds of audio starting at 'offset', or up to
+ * the end if 'duration' is 0, and show the final text. If whisper times
+ * out or crashes, the segments it completed stay in the message, and it
+ * is run again from the end of the last one, up to WHISPER_RETRIES times:
+ * no audio is transcribed twice. Returns 0 on success, -1 on error, or
+ * WHISPER_LOST if the remote worker of the job was lost: the worker is
+ * marked down, and the rest of the range, from the checkpoint, should
+ * be moved to another one. WHISPER_BUSY is returned if the worker refused
+ * the run having no free slot: the worker is fine, and the range should
+ * just be queued again. */
+int whisperTranscribe(whisperJob *wj, double offset, double duration) {
+    double end = offset + duration;
+    int err, retries = 0;
+    wj->checkpoint = offset;
+    while (1) {
+        double left = end - wj->checkpoint;
+        err = whisper(wj, wj->checkpoint, duration > 0 ? left : 0);
+        if (err == 0) break;
+
+        /* Failed after the last segment of the range: nothing to redo. */
+        if (duration > 0 && end - wj->checkpoint < 0.01) {
+            err = 0;
+            break;
+        }
+        if (wj->busy) {
+            workerBusy(wj->worker);
+            return WHISPER_BUSY;
+        }
+        if (wj->lost) {
+            printf("Worker %s lost at %.2fs\n", workerName(wj->worker),
+                   wj->checkpoint);
+            workerDown(wj->worker);
+            if (wj->audio - wj->checkpoint < 0.01) {
+                err = 0;
+                break;
+            }
+            whisperSetPrompt(wj);
+            return WHISPER_LOST;
+        }
+        if (retries++ == WHISPER_RETRIES) break;
+        wj->retries++;
+        whisperSetPrompt(wj);
+        printf("Whisper %s, resuming at %.2fs\n",
+               wj->timedout ? "timed out" : "failed", wj->checkpoint);
+    }
+
+    if (err) {
+        whisperFailed(wj);
+        return -1;
+    }
+    if (sdslen(wj->text) > 0) {
+        botEditMessageText(wj->chat_id, wj->msg_id, wj->text);
+        if (!wj->first_text) wj->first_text = mstime();
+    } else {
+        botEditMessageText(wj->chat_id, wj->msg_id, "(no speech detected)");
+    }
+    whisperSetPrompt(wj);
+    return 0;
+}
+
+/* For long audio, the first text of the transcription shows up only once
+ * whisper decoded the first 30 seconds window with the medium model. Before
+ * starting it, we quickly transcribe the first PREVIEW_SECONDS with the
+ * base model and a reduced audio context, and show that: the transcription
+ * replaces it as soon as its first text arrives. Returns 0 if the preview
+ * ran, even with no text, -1 if it failed, or like whisperTranscribe()
+ * WHISPER_BUSY or WHISPER_LOST if its worker refused it or was lost: the
+ * caller should release the slot, and run the preview on the next one. A
+ * failed preview is not run again: it would only delay the transcription. */
+int whisperPreview(whisperJob *wj) {
+    whisperJob preview = *wj;
+    double rtf[SCHED_NUM_MODELS];
+    etaRtf(rtf);
+    preview.model = SCHED_MODEL_BASE;
+    preview.rtf = rtf[SCHED_MODEL_BASE];
+    preview.text = sdsempty();
+    preview.prompt[0] = '\0';
+    preview.slot = NULL;
+    preview.preview = 1;
+    int err = whisper(&preview, 0, PREVIEW_SECONDS);
+    sdsfree(preview.text);
+    wj->first_text = preview.first_text;
+    if (err == 0) return 0;
+    if (preview.busy) {
+        printf("Preview refused by worker %s\n", workerName(wj->worker));
+        workerBusy(wj->worker);
+        return WHISPER_BUSY;
+    }
+    if (preview.lost) {
+        printf("Worker %s lost during the preview\n",
+               workerName(wj->worker));
+        workerDown(wj->worker);
+        return WHISPER_LOST;
+    }
+    printf("Preview %s on worker %s\n",
+           preview.timedout ? "timed out" : "failed", workerName(wj->worker));
+    return -1;
+}
+
 /* Check if file is audio based on mime type or extension. */
 int isAudioFile(BotRequest *br) {
     const char *exts[] = {
@@ -268,33 +887,104 @@ int isAudioFile(BotRequest *br) {
     return 0;
 }
 
-void handleRequest(sqlite3 *dbhandle, BotRequest *br) {
-    UNUSED(dbhandle);
+/* Per job metrics: resource usage of every stage, so that we know the
+ * real CPU cost per audio second for each model and format. Logged when
+ * the job is done. */
+typedef struct jobMetrics {
+    int id;
+    double audio;           /* Audio duration in seconds, -1 if unknown. */
+    const char *model;      /* Model used, NULL if not transcribed. */
+    int chunks;             /* Chunks transcribed. */
+    int retries;            /* Whisper runs resumed after a failure. */
+    double first_text;      /* Seconds from the request to the first text
+                               shown, -1 if none. */
+    double wait;            /* Seconds waited for the slot, all chunks. */
+    procStats probe, convert, whisper;
+    audioLevels levels;     /* Valid if the audio was converted. */
+} jobMetrics;
 
-    /* Accept voice messages, audio files, or documents that look like audio. */
-    int is_audio = 0;
-    if (br->file_type == TB_FILE_TYPE_VOICE_OGG) is_audio = 1;
-    if (br->file_type == TB_FILE_TYPE_AUDIO) is_audio = 1;
-    if (br->file_type == TB_FILE_TYPE_DOCUMENT && isAudioFile(br)) is_audio = 1;
-    if (!is_audio) return;
+void logJobMetrics(jobMetrics *jm, BotRequest *br) {
+    if (jm->audio < 0) return;
+    double cpu = jm->probe.utime + jm->probe.stime +
+                 jm->convert.utime + jm->convert.stime +
+                 jm->whisper.utime + jm->whisper.stime;
+    const char *format = br->file_mime ? br->file_mime : "unknown";
+    if (br->file_type == TB_FILE_TYPE_VOICE_OGG) format = "voice";
+    printf("Job %d: %s, %.1fs audio, model %s, %d chunks, %d retries, "
+           "%.1fs wait, %.1fs to first text, "
+           "probe %.2f+%.2fs cpu %ldkB rss, "
+           "convert %.2f+%.2fs cpu %ldkB rss, "
+           "whisper %.2f+%.2fs cpu %ldkB rss %ld/%ld csw, "
+           "%.3f cpu seconds per audio second, "
+           "rms %.1f dB peak %.1f dB clip %.2f%% speech %.2f gain %.1f dB\n",
+           jm->id, format, jm->audio,
+           jm->model ? jm->model : "none", jm->chunks, jm->retries,
+           jm->wait, jm->first_text,
+           jm->probe.utime, jm->probe.stime, jm->probe.maxrss,
+           jm->convert.utime, jm->convert.stime, jm->convert.maxrss,
+           jm->whisper.utime, jm->whisper.stime, jm->whisper.maxrss,
+           jm->whisper.nvcsw, jm->whisper.nivcsw,
+           jm->audio > 0 ? cpu / jm->audio : 0,
+           jm->levels.rms_db, jm->levels.peak_db,
+           jm->levels.clip_ratio*100, jm->levels.speech_ratio,
+           jm->levels.gain_db);
+}
+
+/* Write in 'buf' the reply to a request over the quota 'kind', that can
+ * be retried at 'reset', see quotaTake(). */
+void overQuotaMessage(char *buf, size_t len, int kind, time_t reset) {
+    struct tm tm;
+    gmtime_r(&reset, &tm);
+    snprintf(buf, len,
+             "%s audio quota is used up, try again after %02d:%02d UTC.",
+             kind == QUOTA_USER ? "Your" : "This chat's",
+             tm.tm_hour, tm.tm_min);
+}
+
+/* Tell the user that the audio of 'br' was not served, and why. For a job
+ * claimed from the job table, the "Queued" message is edited instead of
+ * being left stale. */
+void serveFailed(BotRequest *br, queuedJob *qj, char *msg) {
+    if (qj && qj->status_msg)
+        botEditMessageText(qj->status_chat, qj->status_msg, msg);
+    else
+        botSendMessage(br->target, msg, br->msg_id);
+}
+
+/* Download, convert and transcribe the audio of 'br', for which 'charged'
+ * seconds were taken from the quotas. 'qj' is the job claimed from the
+ * job table, or NULL. Returns the seconds to refund to the quotas: all
+ * of them if the audio could not be served. */
+double serveAudio(sqlite3 *dbhandle, BotRequest *br, double charged,
+                  queuedJob *qj)
+{
+    long long received = mstime();
+    double refund = 0;
+    int billed = 0;
 
-    /* Temp file names. Fixed extension - ffmpeg detects format from content,
-     * otherwise we can expose the server to security issues because of
-     * path traversal. */
+    /* Intermediate files: their paths have no extension, ffmpeg detects
+     * the format from content, otherwise we can expose the server to
+     * security issues because of path traversal. */
     static atomic_int id = 0;
     int myid = atomic_fetch_add(&id, 1);
-    char in[64], out[64];
-    snprintf(in, sizeof(in), "/tmp/wb_%d_%d.audio", (int)getpid(), myid);
-    snprintf(out, sizeof(out), "/tmp/wb_%d_%d.wav", (int)getpid(), myid);
+    char name[32];
+    scratchFile in, out;
+    jobMetrics jm = {.id = myid, .audio = -1, .first_text = -1};
+
+    snprintf(name, sizeof(name), "%d.audio", myid);
+    int err = scratchCreate(&in, name);
+    snprintf(name, sizeof(name), "%d.wav", myid);
+    err |= scratchCreate(&out, name);
 
     /* Download. */
-    if (!botGetFile(br, in)) {
-        botSendMessage(br->target, "Can't download audio.", br->msg_id);
-        return;
+    if (err || !botGetFile(br, in.path)) {
+        serveFailed(br, qj, "Can't download audio.");
+        goto cleanup;
     }
+    scratchAccount(&in);
 
     /* Check duration. */
-    double dur = getDuration(in);
+    double dur = getDuration(in.path, &jm.probe);
     if (dur < 0 || dur > MAX_SECONDS) {
         char msg[128];
         if (dur < 0)
@@ -302,67 +992,410 @@ void handleRequest(sqlite3 *dbhandle, BotRequest *br) {
         else
             snprintf(msg, sizeof(msg), "Audio too long: %.0fs (max %ds).",
                      dur, MAX_SECONDS);
-        botSendMessage(br->target, msg, br->msg_id);
-        unlink(in);
-        return;
+        serveFailed(br, qj, msg);
+        goto cleanup;
     }
+    jm.audio = dur;
+    if (dur > charged) {
+        /* Longer than declared, or not declared at all: the quotas must
+         * cover the rest too. Transcribers check the quotas of the ingest
+         * process, that charges the rest as a negative refund. */
+        int qkind;
+        time_t reset;
+        if (qj) quotaRefresh(dbhandle, br->from, br->target);
+        if (!quotaTake(br->from, br->target, dur - charged, &qkind, &reset)) {
+            char msg[128];
+            overQuotaMessage(msg, sizeof(msg), qkind, reset);
+            serveFailed(br, qj, msg);
+            goto cleanup;
+        }
+        if (qj) refund -= dur - charged;
+    } else {
+        refund += charged - dur;
+    }
+    charged = dur;
 
     /* Convert. */
-    if (toWav(in, out, dur) != 0) {
-        botSendMessage(br->target, "Audio conversion failed.", br->msg_id);
-        unlink(in);
+    if (toWav(in.path, out.path, dur, &jm.convert) != 0) {
+        serveFailed(br, qj, "Audio conversion failed.");
+        goto cleanup;
+    }
+    scratchAccount(&out);
+    scratchRelease(&in);
+
+    /* Analyze the audio before taking a queue slot: there is no point in
+     * running whisper on silence. Quiet audio is normalized. */
+    if (checkAudio(out.path, &jm.levels) == 1) {
+        billed = 1;
+        serveFailed(br, qj, "(no speech detected)");
+        goto cleanup;
+    }
+
+    /* Check the work in flight, and notify the user, with an estimate of
+     * the completion time if the job has to wait. */
+    etaLoad(dbhandle);
+    slotJob job = {
+        .remaining = dur,
+        .model = -1,
+        .audio = dur,
+        .user = br->from
+    };
+    char status[128];
+    if (!slotAdmit(&job, status, sizeof(status))) {
+        serveFailed(br, qj, "Too busy, try later.");
+        goto cleanup;
+    }
+    billed = 1;
+    if (qj && qj->status_msg) {
+        job.chat_id = qj->status_chat;
+        job.msg_id = qj->status_msg;
+        botEditMessageText(job.chat_id, job.msg_id, status);
+    } else {
+        botSendMessageAndGetInfo(br->target, status, br->msg_id,
+                                 &job.chat_id, &job.msg_id);
+    }
+
+    /* Transcribe, one chunk at a time: between chunks the slot may go to
+     * jobs with less audio left, so a long file doesn't hold the queue.
+     * Chunk timings train the estimator. */
+    whisperJob wj = {
+        .wav = out.path,
+        .target = br->target,
+        .chat_id = job.chat_id,
+        .msg_id = job.msg_id,
+        .short_audio = dur < SHORT_AUDIO_THRESHOLD,
+        .audio = dur,
+        .slot = &job,
+        .text = sdsempty(),
+        .exit = -1,
+        .ps = &jm.whisper
+    };
+    double done = 0;
+    int failovers = 0, started = 0, previewed = 0;
+    while (1) {
+        double len = schedChunk(&SchedPolicy, dur - done);
+        jm.wait += slotAcquire(&job) / 1000.0;
+        double rtf[SCHED_NUM_MODELS];
+        etaRtf(rtf);
+        wj.rtf = rtf[job.model];
+        wj.worker = job.worker;
+
+        if (!started) {
+            started = 1;
+            wj.model = job.model;
+            jm.model = schedModelName(job.model);
+
+            char msg[64];
+            snprintf(msg, sizeof(msg), "Transcribing (%s)...", jm.model);
+            botEditMessageText(job.chat_id, job.msg_id, msg);
+
+            /* With the base model the preview would not be faster than
+             * the transcription itself. */
+            previewed = wj.model != SCHED_MODEL_MEDIUM ||
+                        dur < PREVIEW_MIN_SECONDS;
+        }
+        if (!previewed) {
+            /* A preview refused or lost by its worker gives the slot back
+             * like a chunk would, and is run on the next one. A lost one
+             * counts as a failover of the job. */
+            int err = whisperPreview(&wj);
+            if (err == WHISPER_BUSY) {
+                slotRelease(&job, dur - done);
+                continue;
+            }
+            if (err == WHISPER_LOST) {
+                previewed = failovers++ >= WORKER_FAILOVERS;
+                slotRelease(&job, dur - done);
+                continue;
+            }
+            previewed = 1;
+        }
+        jm.chunks++;
+
+        /* The last chunk runs up to the end, whatever the real length of
+         * the audio is compared to the probed duration. */
+        double left = dur - done - len;
+        long long start = mstime();
+        int retries = wj.retries;
+        int err = whisperTranscribe(&wj, done, left > 0 ? len : 0);
+        jm.retries = wj.retries;
+        if (err == WHISPER_BUSY) {
+            /* Nothing ran: wait for a slot again. */
+            jm.chunks--;
+            done = wj.checkpoint;
+            slotRelease(&job, dur - done);
+            continue;
+        }
+        if (err == WHISPER_LOST && failovers++ < WORKER_FAILOVERS) {
+            /* Queue what is left of the chunk again, for another worker. */
+            done = wj.checkpoint;
+            slotRelease(&job, dur - done);
+            continue;
+        }
+        if (err == WHISPER_LOST) whisperFailed(&wj);
+        slotRelease(&job, err ? 0 : left);
+        if (err) break;
+
+        /* Only local runs train the estimator: remote workers may run on
+         * different hardware. */
+        if (wj.retries == retries && wj.worker == WORKER_LOCAL)
+            etaLearn(dbhandle, job.model, len, (mstime() - start) / 1000.0);
+        if (left <= 0) break;
+        done += len;
+    }
+    sdsfree(wj.text);
+    if (wj.first_text) jm.first_text = (wj.first_text - received) / 1000.0;
+
+cleanup:
+    if (!billed) refund += charged;
+    scratchRelease(&in);
+    scratchRelease(&out);
+    logJobMetrics(&jm, br);
+    return refund;
+}
+
+void handleRequest(sqlite3 *dbhandle, BotRequest *br) {
+    if (br->argc && (!strcasecmp(br->argv[0], "/status") ||
+                     !strncasecmp(br->argv[0], "/status@", 8)))
+    {
+        sds reply = Mode == MODE_INGEST ? jobReport(dbhandle, br->from) :
+                                          slotReport(br->from);
+        botSendMessage(br->target, reply, br->msg_id);
+        sdsfree(reply);
         return;
     }
-    unlink(in);
 
-    /* Check queue. */
-    int pos = atomic_fetch_add(&QueueLen, 1);
-    if (pos >= MAX_QUEUE) {
-        atomic_fetch_sub(&QueueLen, 1);
+    /* Accept voice messages, audio files, or documents that look like audio. */
+    int is_audio = 0;
+    if (br->file_type == TB_FILE_TYPE_VOICE_OGG) is_audio = 1;
+    if (br->file_type == TB_FILE_TYPE_AUDIO) is_audio = 1;
+    if (br->file_type == TB_FILE_TYPE_DOCUMENT && isAudioFile(br)) is_audio = 1;
+    if (!is_audio) return;
+
+    /* Don't take more work than we have scratch memory for. */
+    if (Mode != MODE_INGEST &&
+        scratchBytes() + br->file_size > SPOOL_MAX_MB*1024LL*1024)
+    {
         botSendMessage(br->target, "Too busy, try later.", br->msg_id);
-        unlink(out);
         return;
     }
 
-    /* Notify user. */
-    int64_t chat_id, msg_id;
-    sds status = pos > 0
-        ? sdscatprintf(sdsempty(), "Queued (%d)...", pos+1)
-        : sdsnew("Transcribing...");
-    botSendMessageAndGetInfo(br->target, status, br->msg_id, &chat_id, &msg_id);
-    sdsfree(status);
+    /* Quotas are checked before downloading anything, with the duration
+     * declared by Telegram, and checked again for the rest once probed,
+     * see serveAudio(). Jobs that we fail to serve are refunded at
+     * cleanup. */
+    quotaLoad(dbhandle);
+    double charged = br->file_duration;
+    int qkind;
+    time_t reset;
+    if (!quotaTake(br->from, br->target, charged, &qkind, &reset)) {
+        char msg[128];
+        overQuotaMessage(msg, sizeof(msg), qkind, reset);
+        botSendMessage(br->target, msg, br->msg_id);
+        return;
+    }
 
-    /* Wait for turn. */
-    pthread_mutex_lock(&WhisperLock);
+    /* In the split deployment the job is served by a transcriber. */
+    if (Mode == MODE_INGEST) {
+        if (jobEnqueue(dbhandle, br, charged) == 0)
+            quotaGive(br->from, br->target, charged);
+        return;
+    }
+    quotaGive(br->from, br->target, serveAudio(dbhandle, br, charged, NULL));
+}
 
-    /* Select model based on queue length. */
-    int qlen = atomic_load(&QueueLen);
-    const char *model = qlen >= QUEUE_THRESHOLD_BASE ? MODEL_BASE : MODEL_MEDIUM;
-    const char *mname = qlen >= QUEUE_THRESHOLD_BASE ? "base" : "medium";
+/* Jobs claimed by a transcriber and still being served. */
+static atomic_int JobsServed = 0;
 
-    char msg[64];
-    snprintf(msg, sizeof(msg), "Transcribing (%s)...", mname);
-    botEditMessageText(chat_id, msg_id, msg);
+/* Serve a job claimed from the job table, in its own thread. */
+void *jobThread(void *arg) {
+    queuedJob *qj = arg;
+    sqlite3 *db = dbInit(NULL);
+    double refund = serveAudio(db, qj->br, qj->charged, qj);
+    jobComplete(db, qj, refund);
+    sqlite3_close(db);
+    freeBotRequest(qj->br);
+    xfree(qj);
+    atomic_fetch_sub(&JobsServed, 1);
+    return NULL;
+}
 
-    /* Run whisper, we pass the chat/msg ID since it will update
-     * the message with actual transcription. */
-    int short_audio = dur < SHORT_AUDIO_THRESHOLD;
-    whisper(out, model, br->target, chat_id, msg_id, short_audio);
+/* Called from cron by transcribers: keep our leases, and claim a job if
+ * a slot is free. The queue is the job table, shared with the other
+ * transcribers, so we don't take jobs that would wait here. */
+void jobServe(sqlite3 *dbhandle) {
+    jobHeartbeat(dbhandle);
+    if (atomic_load(&JobsServed) >= workerCapacity() ||
+        scratchBytes() >= SPOOL_MAX_MB*1024LL*1024) return;
 
-    pthread_mutex_unlock(&WhisperLock);
-    atomic_fetch_sub(&QueueLen, 1);
-    unlink(out);
+    queuedJob *qj = jobClaim(dbhandle);
+    if (qj == NULL) return;
+    atomic_fetch_add(&JobsServed, 1);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, jobThread, qj) != 0) {
+        /* The lease will expire, and the job will be queued again. */
+        atomic_fetch_sub(&JobsServed, 1);
+        freeBotRequest(qj->br);
+        xfree(qj);
+        return;
+    }
+    pthread_detach(tid);
 }
 
 void cron(sqlite3 *dbhandle) {
-    UNUSED(dbhandle);
+    if (Mode == MODE_TRANSCRIBER) {
+        jobServe(dbhandle);
+        return;
+    }
+    if (Mode == MODE_INGEST) jobReap(dbhandle);
+    quotaPersist(dbhandle);
+}
+
+/* =============================================================================
+ * Fake whisper backend
+ * ===========================================================================*/
+
+/* Entry point of the fake whisper-cli process, invoked as:
+ *
+ *  whisperbot fake-whisper <rtf> <jitter> <failrate> <hangrate> <args...>
+ *
+ * The audio duration is obtained from the WAV file size, then the audio is
+ * "transcribed" in segments of 2-8 seconds, printing some text after
+ * sleeping for the segment duration multiplied by the real time factor.
+ * Like whisper-cli, timestamps are printed unless -nt is given, and -ot / -d
+ * select the range to transcribe, in milliseconds. */
+int fakeWhisperMain(int argc, char **argv) {
+    if (argc < 6) return 1;
+    double rtf = atof(argv[2]);
+    double jitter = atof(argv[3]);
+    double failrate = atof(argv[4]);
+    double hangrate = atof(argv[5]);
+    const char *model = "", *wav = NULL;
+    int timestamps = 1;
+    double offset = 0, length = 0;
+
+    for (int j = 6; j < argc; j++) {
+        if (!strcmp(argv[j], "-m") && j+1 < argc) model = argv[++j];
+        else if (!strcmp(argv[j], "-f") && j+1 < argc) wav = argv[++j];
+        else if (!strcmp(argv[j], "-nt")) timestamps = 0;
+        else if (!strcmp(argv[j], "-ot") && j+1 < argc)
+            offset = atoi(argv[++j]) / 1000.0;
+        else if (!strcmp(argv[j], "-d") && j+1 < argc)
+            length = atoi(argv[++j]) / 1000.0;
+        else if (!strcmp(argv[j], "--prompt") && j+1 < argc) j++;
+        else if (!strcmp(argv[j], "-ac") && j+1 < argc) j++;
+    }
+    if (strstr(model, "base")) rtf /= 3;
+
+    struct stat st;
+    if (wav == NULL || stat(wav, &st) == -1) return 1;
+    double duration = (st.st_size - 44) / 32000.0; /* 16 kHz, 16 bit mono. */
+    if (length > 0 && offset + length < duration) duration = offset + length;
+
+    srand(getpid() ^ time(NULL));
+    int fail = (double)rand() / RAND_MAX < failrate;
+    int hang = (double)rand() / RAND_MAX < hangrate;
+    double pos = offset;
+    while (pos < duration) {
+        double seg = 2 + 6.0 * rand() / RAND_MAX;
+        if (pos + seg > duration) seg = duration - pos;
+        double j = jitter * (2.0 * rand() / RAND_MAX - 1);
+        usleep((useconds_t)(seg * rtf * (1 + j) * 1000000));
+
+        /* Failures happen at a random point of the job. */
+        if (fail && rand() % 3 == 0) return 1;
+        if (hang && rand() % 3 == 0) while (1) pause();
+        if (timestamps) {
+            int a = pos * 1000, b = (pos + seg) * 1000;
+            printf("[%02d:%02d:%02d.%03d --> %02d:%02d:%02d.%03d]  ",
+                   a/3600000, a/60000%60, a/1000%60, a%1000,
+                   b/3600000, b/60000%60, b/1000%60, b%1000);
+        }
+        printf(" Synthetic segment from %.1f to %.1f seconds.\n",
+               pos, pos + seg);
+        fflush(stdout);
+        pos += seg;
+    }
+    return fail;
 }
 
 int main(int argc, char **argv) {
     static char *triggers[] = {"*", NULL};
-    printf("Whisper bot started. Queue max: %d, Audio max: %ds\n",
-           MAX_QUEUE, MAX_SECONDS);
-    startBot(TB_CREATE_KV_STORE, argc, argv, TB_FLAGS_NONE,
-             handleRequest, cron, triggers);
+    if (argc > 1 && !strcmp(argv[1], "fake-whisper"))
+        return fakeWhisperMain(argc, argv);
+
+    /* Parse our own options, leaving the rest to botlib. */
+    const char *spool = NULL, *bind_addr = WORKER_BIND;
+    int j, botargc = 1, listen_port = 0, worker_slots = LOCAL_SLOTS;
+    for (j = 1; j < argc; j++) {
+        int morearg = argc-j-1;
+        if (!strcmp(argv[j], "--fake-whisper")) {
+            FakeWhisper.enabled = 1;
+        } else if (!strcmp(argv[j], "--fake-rtf") && morearg) {
+            FakeWhisper.rtf = atof(argv[++j]);
+        } else if (!strcmp(argv[j], "--fake-jitter") && morearg) {
+            FakeWhisper.jitter = atof(argv[++j]);
+        } else if (!strcmp(argv[j], "--fake-fail") && morearg) {
+            FakeWhisper.failrate = atof(argv[++j]);
+        } else if (!strcmp(argv[j], "--fake-hang") && morearg) {
+            FakeWhisper.hangrate = atof(argv[++j]);
+        } else if (!strcmp(argv[j], "--spool") && morearg) {
+            spool = argv[++j];
+        } else if (!strcmp(argv[j], "--ingest")) {
+            Mode = MODE_INGEST;
+        } else if (!strcmp(argv[j], "--transcriber")) {
+            Mode = MODE_TRANSCRIBER;
+        } else if (!strcmp(argv[j], "--worker-listen") && morearg) {
+            listen_port = atoi(argv[++j]);
+        } else if (!strcmp(argv[j], "--worker-bind") && morearg) {
+            bind_addr = argv[++j];
+        } else if (!strcmp(argv[j], "--worker-slots") && morearg) {
+            worker_slots = atoi(argv[++j]);
+        } else if (!strcmp(argv[j], "--worker") && morearg) {
+            if (workerAdd(argv[++j]) == -1) {
+                fprintf(stderr, "Invalid worker address or too many "
+                                "workers: %s\n", argv[j]);
+                exit(1);
+            }
+        } else {
+            argv[botargc++] = argv[j];
+        }
+    }
+    argc = botargc;
+
+    if (scratchInit(spool))
+        printf("Intermediate audio files spooled in %s\n",
+               spool ? spool : SPOOL_DIR);
+    if (FakeWhisper.enabled)
+        printf("Using the fake whisper backend: rtf %g, jitter %g, "
+               "failure rate %g, hang rate %g\n", FakeWhisper.rtf,
+               FakeWhisper.jitter, FakeWhisper.failrate, FakeWhisper.hangrate);
+    if (listen_port) {
+        if (worker_slots < 1) worker_slots = 1;
+        return workerServe(bind_addr, listen_port, worker_slots,
+                           whisperSpawn);
+    }
+
+    SlotQueue = ringNew(SLOT_CLASSES, SchedPolicy.max_queue);
+    workerInit(worker_slots, slotKick);
+    if (workerCount() > 1)
+        printf("Dispatching to %d remote workers, probed every %ds\n",
+               workerCount()-1, WORKER_PROBE_SECONDS);
+    if (Mode == MODE_INGEST)
+        printf("Ingest mode: jobs are queued for the transcribers\n");
+    if (Mode == MODE_TRANSCRIBER)
+        printf("Transcriber mode: serving the jobs queued by ingest\n");
+    printf("Whisper bot started. Queue max: %ds of audio, Audio max: %ds\n",
+           MAX_QUEUE_AUDIO, MAX_SECONDS);
+    if (Mode == MODE_STANDALONE) {
+        startBot(TB_CREATE_KV_STORE ETA_CREATE_TABLE QUOTA_CREATE_TABLE,
+                 argc, argv, TB_FLAGS_NONE, handleRequest, cron, triggers);
+    } else {
+        startBot(TB_CREATE_KV_STORE ETA_CREATE_TABLE QUOTA_CREATE_TABLE
+                 JOBS_CREATE_TABLE, argc, argv,
+                 Mode == MODE_TRANSCRIBER ? TB_FLAGS_NO_UPDATES :
+                                            TB_FLAGS_NONE,
+                 handleRequest, cron, triggers);
+    }
     return 0;
 }
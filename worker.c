@@ -0,0 +1,520 @@
+/* ============================================================================
+ * Remote transcription workers.
+ *
+ * "whisperbot --worker-listen <port>" runs a worker daemon, that accepts
+ * whisper runs over TCP, on the address given with --worker-bind (by
+ * default 127.0.0.1), and streams the whisper-cli output back. The bot,
+ * started with one or more "--worker <host>:<port>", dispatches chunks to
+ * the workers as well as to its local slots, see workerPick().
+ *
+ * The protocol is line oriented. On connection the worker greets with:
+ *
+ *  WORKER <slots> <busy>
+ *
+ * The client may just close the connection, that's how workers are
+ * probed, or request a run with a line followed by the prompt, of the
+ * given size:
+ *
+ *  JOB <model> <lang> <audio ctx> <prompt bytes> <wav bytes>
+ *
+ * The worker replies "BUSY" and closes the connection if all its slots
+ * are taken, otherwise "SEND", and the client sends the WAV file to
+ * transcribe. The WAV holds only the audio to transcribe, so timestamps
+ * are relative to it. The worker replies with the output of whisper-cli
+ * as it is produced, then "DONE <exit status>", and closes the connection.
+ * If the client closes the connection the run is killed. A client silent
+ * for WORKER_CONNECT_MS before its request is complete is dropped, and
+ * both sides use TCP keepalive, so a peer gone never holds a slot.
+ *
+ * On the bot side every worker has the capacity it advertised, or zero
+ * while it is down. A worker is marked down when a run on it is lost. A
+ * worker busy with other clients answering "BUSY" is not down: its
+ * capacity is just reduced to the runs we have there, and the run is
+ * queued again. A thread probes every WORKER_PROBE_SECONDS the workers
+ * down or with reduced capacity, to bring them back.
+ * ==========================================================================*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "botlib.h"
+#include "config.h"
+#include "media.h"
+#include "sched.h"
+#include "worker.h"
+
+/* =============================================================================
+ * Socket helpers
+ * ===========================================================================*/
+
+/* Write all of 'buf' to the socket 'fd'. A peer gone must not kill us with
+ * SIGPIPE. Returns 0 on success, -1 on error. */
+static int workerWrite(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Like read(), but waiting at most 'ms' milliseconds for data. Returns -1
+ * with errno set to ETIMEDOUT on timeout. */
+static ssize_t workerRead(int fd, void *buf, size_t len, int ms) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int ready;
+    while ((ready = poll(&pfd, 1, ms)) == -1 && errno == EINTR);
+    if (ready == 0) errno = ETIMEDOUT;
+    if (ready != 1) return -1;
+    return read(fd, buf, len);
+}
+
+/* Enable keepalive probes on 'fd', so that a peer machine gone is noticed
+ * in half a minute even if the connection is silent. */
+static void workerKeepalive(int fd) {
+    int yes = 1, idle = 10, interval = 5, count = 3;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+/* Read a line into 'buf', without the newline, waiting at most 'ms'
+ * milliseconds for every byte. Lines are read one byte at a time, in
+ * order to leave what follows them in the socket. Returns 0 on success,
+ * -1 on error, timeout or line too long. */
+static int workerReadLine(int fd, char *buf, size_t len, int ms) {
+    size_t n = 0;
+    while (n < len-1) {
+        if (workerRead(fd, buf+n, 1, ms) != 1) return -1;
+        if (buf[n] == '\n') {
+            buf[n] = '\0';
+            return 0;
+        }
+        n++;
+    }
+    return -1;
+}
+
+/* =============================================================================
+ * Worker daemon
+ * ===========================================================================*/
+
+static pthread_mutex_t ServeLock = PTHREAD_MUTEX_INITIALIZER;
+static int ServeSlots, ServeBusy;
+static workerSpawnProc ServeSpawn;
+
+/* Receive 'len' bytes from the socket into the file 'path'. Returns 0 on
+ * success, -1 on error or if the client stalls. */
+static int workerReceive(int fd, const char *path, long long len) {
+    int out = open(path, O_WRONLY|O_CLOEXEC);
+    if (out == -1) return -1;
+    char buf[65536];
+    while (len > 0) {
+        ssize_t n = workerRead(fd, buf, len < (long long)sizeof(buf) ?
+                                        (size_t)len : sizeof(buf),
+                               WORKER_CONNECT_MS);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0 || write(out, buf, n) != n) break;
+        len -= n;
+    }
+    close(out);
+    return len == 0 ? 0 : -1;
+}
+
+/* Run the job requested on the connection 'fd', with whisper writing its
+ * output straight to the socket. */
+static void workerRun(int fd, const workerJob *job, long long wavlen) {
+    static atomic_int runs = 0;
+    int id = atomic_fetch_add(&runs, 1) + 1;
+    char name[32], line[64];
+    scratchFile wav;
+    childProc c;
+    int status = -1, gone = 0;
+    long long start = ustime();
+
+    snprintf(name, sizeof(name), "worker_%d.wav", id);
+    if (scratchCreate(&wav, name) == 0 &&
+        workerReceive(fd, wav.path, wavlen) == 0 &&
+        ServeSpawn(&c, job, wav.path, fd) == 0)
+    {
+        /* The client sends nothing more: if the socket becomes readable,
+         * it closed the connection, and the run is no longer needed. */
+        scratchAccount(&wav);
+        while (!spawnTryWait(&c, &status, NULL)) {
+            struct pollfd pfd = {.fd = fd, .events = POLLIN|POLLRDHUP};
+            if (poll(&pfd, 1, 100) == 1) {
+                spawnKill(&c, SIGKILL);
+                spawnWait(&c, &status, NULL);
+                gone = 1;
+                break;
+            }
+        }
+    }
+    scratchRelease(&wav);
+
+    int exitcode = status == -1 ? 127 :
+                   WIFEXITED(status) ? WEXITSTATUS(status) :
+                                       128 + WTERMSIG(status);
+    if (!gone) {
+        snprintf(line, sizeof(line), "DONE %d\n", exitcode);
+        workerWrite(fd, line, strlen(line));
+    }
+    printf("Run %s: %s, %.1fs audio, exit %d, %.1fs%s\n", name,
+           schedModelName(job->model), (wavlen - 44) / 32000.0, exitcode,
+           (ustime() - start) / 1e6, gone ? ", client gone" : "");
+}
+
+/* Serve a client: send the greeting, then run the job requested, if any.
+ * Connections are served by their own thread. */
+static void *workerConn(void *arg) {
+    int fd = (intptr_t)arg;
+    char line[128];
+    workerJob job = {0};
+    int plen;
+    long long wavlen;
+
+    pthread_mutex_lock(&ServeLock);
+    snprintf(line, sizeof(line), "WORKER %d %d\n", ServeSlots, ServeBusy);
+    pthread_mutex_unlock(&ServeLock);
+    if (workerWrite(fd, line, strlen(line)) == -1 ||
+        workerReadLine(fd, line, sizeof(line), WORKER_CONNECT_MS) == -1 ||
+        sscanf(line, "JOB %d %7s %d %d %lld", &job.model, job.lang,
+               &job.audio_ctx, &plen, &wavlen) != 5 ||
+        job.model < 0 || job.model >= SCHED_NUM_MODELS ||
+        job.audio_ctx < 0 || plen < 0 || plen > PROMPT_CHARS ||
+        wavlen < 44 || wavlen > WORKER_MAX_WAV_MB*1024LL*1024)
+    {
+        close(fd);
+        return NULL;
+    }
+    for (char *p = job.lang; *p; p++) {
+        if (!isalpha((unsigned char)*p)) {
+            close(fd);
+            return NULL;
+        }
+    }
+    size_t got = 0;
+    while (got < (size_t)plen) {
+        ssize_t n = workerRead(fd, job.prompt+got, plen-got,
+                               WORKER_CONNECT_MS);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            close(fd);
+            return NULL;
+        }
+        got += n;
+    }
+    job.prompt[plen] = '\0';
+
+    pthread_mutex_lock(&ServeLock);
+    int busy = ServeBusy >= ServeSlots;
+    if (!busy) ServeBusy++;
+    pthread_mutex_unlock(&ServeLock);
+    if (busy) {
+        workerWrite(fd, "BUSY\n", 5);
+        close(fd);
+        return NULL;
+    }
+
+    if (workerWrite(fd, "SEND\n", 5) == 0) workerRun(fd, &job, wavlen);
+    close(fd);
+    pthread_mutex_lock(&ServeLock);
+    ServeBusy--;
+    pthread_mutex_unlock(&ServeLock);
+    return NULL;
+}
+
+/* Run the worker daemon on the IPv4 address 'addr' and 'port',
+ * transcribing at most 'slots' jobs at once, started with 'spawn'. The
+ * protocol has no authentication, so by default workers only listen on
+ * the loopback interface. Returns only on error. */
+int workerServe(const char *addr, int port, int slots,
+                workerSpawnProc spawn)
+{
+    ServeSlots = slots;
+    ServeSpawn = spawn;
+
+    struct sockaddr_in sa = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port)
+    };
+    if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+        fprintf(stderr, "Invalid worker bind address: %s\n", addr);
+        return 1;
+    }
+    int s = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0), yes = 1;
+    if (s == -1 ||
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1 ||
+        bind(s, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+        listen(s, 64) == -1)
+    {
+        perror("Worker socket");
+        return 1;
+    }
+    printf("Worker listening on %s:%d, %d slots\n", addr, port, slots);
+
+    while (1) {
+        int fd = accept4(s, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EINTR) usleep(100000);
+            continue;
+        }
+        workerKeepalive(fd);
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, workerConn, (void *)(intptr_t)fd)) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+/* =============================================================================
+ * Dispatcher
+ * ===========================================================================*/
+
+typedef struct worker {
+    char host[128], port[16];   /* Empty host for the local worker. */
+    char name[160];
+    int slots;                  /* Capacity we can use, 0 while down. */
+    int advertised;             /* Slots of the worker when last seen. */
+    int busy;                   /* Runs we have there. */
+} worker;
+
+static pthread_mutex_t WorkerLock = PTHREAD_MUTEX_INITIALIZER;
+static worker Workers[MAX_WORKERS] = {{.name = "local"}};
+static int NumWorkers = 1;
+static void (*WorkerChanged)(void);
+
+/* Register the worker at 'addr', as "host:port". Must be called before
+ * workerInit(). Returns 0 on success, -1 on error. */
+int workerAdd(const char *addr) {
+    const char *colon = strrchr(addr, ':');
+    if (NumWorkers == MAX_WORKERS || colon == NULL || colon == addr ||
+        colon[1] == '\0' || colon-addr >= (int)sizeof(Workers[0].host) ||
+        strlen(colon+1) >= sizeof(Workers[0].port)) return -1;
+
+    worker *w = Workers+NumWorkers++;
+    memcpy(w->host, addr, colon-addr);
+    w->host[colon-addr] = '\0';
+    strcpy(w->port, colon+1);
+    snprintf(w->name, sizeof(w->name), "%s:%s", w->host, w->port);
+    w->slots = 0;               /* Down until probed. */
+    w->advertised = 0;
+    return 0;
+}
+
+/* Connect to the remote worker 'w' and read its greeting. Returns the
+ * socket, and the slots advertised and how many of them are busy by
+ * reference, or -1 on error. */
+static int workerConnect(int w, int *slots, int *busy) {
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *res;
+    if (getaddrinfo(Workers[w].host, Workers[w].port, &hints, &res) != 0)
+        return -1;
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK,
+                    ai->ai_protocol);
+        if (fd == -1) continue;
+        struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if ((connect(fd, ai->ai_addr, ai->ai_addrlen) == -1 &&
+             errno != EINPROGRESS) ||
+            poll(&pfd, 1, WORKER_CONNECT_MS) != 1 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd == -1) return -1;
+
+    /* Blocking from now on, with keepalive. */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    workerKeepalive(fd);
+
+    char line[64];
+    if (workerReadLine(fd, line, sizeof(line), WORKER_CONNECT_MS) == -1 ||
+        sscanf(line, "WORKER %d %d", slots, busy) != 2 || *slots < 1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Probe the workers down or with reduced capacity, giving back the slots
+ * free there. */
+static void *workerProbe(void *arg) {
+    UNUSED(arg);
+    while (1) {
+        int changed = 0;
+        for (int w = 1; w < NumWorkers; w++) {
+            worker *k = Workers+w;
+            pthread_mutex_lock(&WorkerLock);
+            int probe = k->slots == 0 || k->slots < k->advertised;
+            pthread_mutex_unlock(&WorkerLock);
+
+            int slots, busy, fd;
+            if (!probe || (fd = workerConnect(w, &slots, &busy)) == -1)
+                continue;
+            close(fd);
+
+            /* The runs busy there include ours. */
+            pthread_mutex_lock(&WorkerLock);
+            int was = k->slots, usable = k->busy + slots - busy;
+            if (usable > slots) usable = slots;
+            k->advertised = slots;
+            if (usable > k->slots) k->slots = usable;
+            int now = k->slots;
+            pthread_mutex_unlock(&WorkerLock);
+            if (now == was) continue;
+            if (was == 0)
+                printf("Worker %s is up, %d slots\n", k->name, now);
+            else
+                printf("Worker %s has %d slots for us\n", k->name, now);
+            changed = 1;
+        }
+        if (changed && WorkerChanged) WorkerChanged();
+        sleep(WORKER_PROBE_SECONDS);
+    }
+    return NULL;
+}
+
+/* Start dispatching, with 'local_slots' local slots, calling 'changed'
+ * every time some capacity comes back. */
+void workerInit(int local_slots, void (*changed)(void)) {
+    Workers[WORKER_LOCAL].slots = local_slots;
+    WorkerChanged = changed;
+    if (NumWorkers > 1) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, workerProbe, NULL) == 0)
+            pthread_detach(tid);
+    }
+}
+
+int workerCount(void) {
+    return NumWorkers;
+}
+
+const char *workerName(int w) {
+    return Workers[w].name;
+}
+
+/* Return the slots of the workers up. */
+int workerCapacity(void) {
+    int slots = 0;
+    pthread_mutex_lock(&WorkerLock);
+    for (int w = 0; w < NumWorkers; w++) slots += Workers[w].slots;
+    pthread_mutex_unlock(&WorkerLock);
+    return slots;
+}
+
+/* Pick the worker for a new run: the one with the lowest ratio of busy
+ * to advertised slots, the local one among ties, and account the run to
+ * it. Returns -1 if all the slots are busy. */
+int workerPick(void) {
+    int best = -1;
+    pthread_mutex_lock(&WorkerLock);
+    for (int w = 0; w < NumWorkers; w++) {
+        worker *k = Workers+w;
+        if (k->busy >= k->slots) continue;
+        if (best == -1 ||
+            k->busy*Workers[best].slots < Workers[best].busy*k->slots)
+            best = w;
+    }
+    if (best != -1) Workers[best].busy++;
+    pthread_mutex_unlock(&WorkerLock);
+    return best;
+}
+
+/* The run on 'w' accounted by workerPick() is over. */
+void workerDone(int w) {
+    pthread_mutex_lock(&WorkerLock);
+    Workers[w].busy--;
+    pthread_mutex_unlock(&WorkerLock);
+}
+
+/* Mark the remote worker 'w' down, after a run on it was lost. */
+void workerDown(int w) {
+    if (w == WORKER_LOCAL) return;
+    pthread_mutex_lock(&WorkerLock);
+    int slots = Workers[w].slots;
+    Workers[w].slots = 0;
+    pthread_mutex_unlock(&WorkerLock);
+    if (slots) printf("Worker %s is down\n", Workers[w].name);
+}
+
+/* The remote worker 'w' refused a run, busy with other clients: until
+ * the probe finds free slots there, use only the ones we hold, the run
+ * refused excluded. */
+void workerBusy(int w) {
+    pthread_mutex_lock(&WorkerLock);
+    worker *k = Workers+w;
+    if (k->slots > k->busy-1) k->slots = k->busy > 0 ? k->busy-1 : 0;
+    int slots = k->slots;
+    pthread_mutex_unlock(&WorkerLock);
+    printf("Worker %s busy, %d slots for us\n", Workers[w].name, slots);
+}
+
+/* Start 'job' on the remote worker 'w', sending the audio of the job,
+ * sliced from 'wav'. Returns the connection, where the output of
+ * whisper-cli will stream, WORKER_BUSY if the worker has no free slot, or
+ * -1 on error. */
+int workerSend(int w, const workerJob *job, const char *wav) {
+    sds audio = wavSlice(wav, job->offset, job->duration);
+    if (audio == NULL) return -1;
+
+    int slots, busy, fd = workerConnect(w, &slots, &busy);
+    if (fd != -1) {
+        char hdr[128], line[16];
+        size_t plen = strlen(job->prompt);
+        snprintf(hdr, sizeof(hdr), "JOB %d %s %d %zu %zu\n", job->model,
+                 job->lang, job->audio_ctx, plen, sdslen(audio));
+        if (workerWrite(fd, hdr, strlen(hdr)) == -1 ||
+            workerWrite(fd, job->prompt, plen) == -1 ||
+            workerReadLine(fd, line, sizeof(line), WORKER_CONNECT_MS) == -1)
+        {
+            close(fd);
+            fd = -1;
+        } else if (!strcmp(line, "BUSY")) {
+            close(fd);
+            fd = WORKER_BUSY;
+        } else if (strcmp(line, "SEND") ||
+                   workerWrite(fd, audio, sdslen(audio)) == -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    sdsfree(audio);
+    return fd;
+}
@@ -0,0 +1,39 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "config.h"
+#include "spawn.h"
+#include "sds.h"
+
+#define WORKER_LOCAL 0          /* Index of the local worker. */
+#define WORKER_BUSY -2          /* Returned by workerSend(). */
+
+/* A whisper run, as requested to a worker. */
+typedef struct workerJob {
+    int model;                  /* SCHED_MODEL_*. */
+    char lang[8];               /* Language code, or "auto". */
+    double offset;              /* Seconds of audio to skip. */
+    double duration;            /* Seconds to transcribe, 0 up to the end. */
+    int audio_ctx;              /* Whisper audio context, 0 for default. */
+    char prompt[PROMPT_CHARS+1];/* Empty if none. */
+} workerJob;
+
+/* Start whisper-cli for 'job' on the local file 'wav', with stdout and
+ * stderr going to 'outfd'. Returns 0 on success, -1 on error. */
+typedef int (*workerSpawnProc)(childProc *c, const workerJob *job,
+                               const char *wav, int outfd);
+
+int workerServe(const char *addr, int port, int slots,
+                workerSpawnProc spawn);
+int workerAdd(const char *addr);
+void workerInit(int local_slots, void (*changed)(void));
+int workerCount(void);
+const char *workerName(int w);
+int workerCapacity(void);
+int workerPick(void);
+void workerDone(int w);
+void workerDown(int w);
+void workerBusy(int w);
+int workerSend(int w, const workerJob *job, const char *wav);
+
+#endif
@@ -0,0 +1,103 @@
+/* ============================================================================
+ * Allocator wrapper: we want to exit on OOM instead of trying to recover.
+ *
+ * The backend is chosen at compile time:
+ *
+ *  make                    -- libc malloc, with a bounded number of arenas.
+ *  make MALLOC=jemalloc    -- jemalloc (thread caches, low fragmentation).
+ *  make MALLOC=mimalloc    -- mimalloc (thread local free lists).
+ *
+ * Note that linking jemalloc/mimalloc also replaces malloc() for the
+ * libraries we use (curl, SQLite), not just for our own allocations.
+ * ==========================================================================*/
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "xmalloc.h"
+
+#if defined(USE_JEMALLOC)
+#include <jemalloc/jemalloc.h>
+#elif defined(USE_MIMALLOC)
+#include <mimalloc.h>
+#define malloc(size) mi_malloc(size)
+#define realloc(ptr,size) mi_realloc(ptr,size)
+#define free(ptr) mi_free(ptr)
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+/* Allocations performed by the current thread, used by the benchmarks to
+ * report allocations per operation. Thread local so that it costs nothing
+ * in terms of contention. */
+static _Thread_local unsigned long long ThreadAllocs = 0;
+
+void *xmalloc(size_t size) {
+    ThreadAllocs++;
+    void *p = malloc(size);
+    if (p == NULL) {
+        printf("Out of memory: malloc(%zu)", size);
+        exit(1);
+    }
+    return p;
+}
+
+void *xrealloc(void *ptr, size_t size) {
+    ThreadAllocs++;
+    void *p = realloc(ptr,size);
+    if (p == NULL) {
+        printf("Out of memory: realloc(%zu)", size);
+        exit(1);
+    }
+    return p;
+}
+
+void xfree(void *ptr) {
+    free(ptr);
+}
+
+/* Return the number of xmalloc()/xrealloc() calls done by this thread. */
+unsigned long long xmallocThreadAllocs(void) {
+    return ThreadAllocs;
+}
+
+/* Called once at startup, before threads are created. With glibc every
+ * thread that finds the existing arenas busy gets a new one, up to 8 per
+ * core, and memory freed into an arena is rarely returned to the OS: with
+ * our many short lived threads this means RSS slowly creeping up.
+ * So we cap the number of arenas to 'arenas' (if zero, the glibc default
+ * is retained). The other backends have per-thread caches and don't need
+ * tuning. */
+void xmallocInit(int arenas) {
+#if !defined(USE_JEMALLOC) && !defined(USE_MIMALLOC) && defined(__GLIBC__)
+    if (arenas > 0) mallopt(M_ARENA_MAX,arenas);
+#else
+    (void) arenas;
+#endif
+}
+
+/* Return free memory to the operating system, if the allocator needs to
+ * be asked explicitly. Can be called from time to time: it is not cheap,
+ * since it walks all the arenas. */
+void xmallocRelease(void) {
+#if defined(USE_MIMALLOC)
+    mi_collect(0);
+#elif !defined(USE_JEMALLOC) && defined(__GLIBC__)
+    malloc_trim(0);
+#endif
+}
+
+/* Return the resident set size of the process in bytes, or 0 if it is
+ * not possible to obtain it. */
+size_t xmallocRSS(void) {
+    FILE *fp = fopen("/proc/self/statm","r");
+    if (fp == NULL) return 0;
+    unsigned long size, rss;
+    int items = fscanf(fp,"%lu %lu",&size,&rss);
+    fclose(fp);
+    if (items != 2) return 0;
+    return (size_t)rss * sysconf(_SC_PAGESIZE);
+}
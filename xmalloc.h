@@ -1,6 +1,27 @@
 #ifndef XMALLOC_H
 #define XMALLOC_H
+
+#include <stddef.h>
+
+/* The allocator backend is selected at compile time, see the MALLOC
+ * variable in the Makefile. */
+#if defined(USE_JEMALLOC)
+#define XMALLOC_LIB "jemalloc"
+#elif defined(USE_MIMALLOC)
+#define XMALLOC_LIB "mimalloc"
+#else
+#define XMALLOC_LIB "libc"
+#endif
+
+/* Number of glibc malloc arenas used when not configured otherwise.
+ * Ignored by jemalloc and mimalloc, that have their own thread caches. */
+#define XMALLOC_DEFAULT_ARENAS 2
+
 void *xmalloc(size_t size);
 void *xrealloc(void *ptr, size_t size);
 void xfree(void *ptr);
+void xmallocInit(int arenas);
+void xmallocRelease(void);
+size_t xmallocRSS(void);
+unsigned long long xmallocThreadAllocs(void);
 #endif